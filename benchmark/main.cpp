@@ -0,0 +1,1030 @@
+#include <memory>
+#include <functional>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <future>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "../src/aloop.h"
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace aloop;
+using namespace std;
+
+static int64_t measureUs(function<void()> run) {
+    int64_t begin = ALooper::GetNowUs();
+    run();
+    return ALooper::GetNowUs() - begin;
+}
+
+static void report(const char* name, int64_t count, int64_t us) {
+    printf("  %-32s %10lld ops in %8lld us, %12.0f ops/s\n",
+        name, (long long)count, (long long)us, us > 0 ? count * 1e6 / us : 0.0);
+}
+
+class CountHandler : public AHandler {
+public:
+    void expect(int64_t count) {
+        mReceived = 0;
+        mExpected = count;
+        mDone = promise<void>();
+    }
+    void wait() {
+        mDone.get_future().wait();
+    }
+protected:
+    void onMessageReceived(const shared_ptr<AMessage> &msg){
+        if (++mReceived == mExpected)
+            mDone.set_value();
+    }
+private:
+    int64_t mReceived{0};
+    int64_t mExpected{0};
+    promise<void> mDone;
+};
+
+//多个生产者线程同时向同一个handler发送消息
+void PostByHandlerVsIdBenchmark() {
+    const int kProducers = max(2u, thread::hardware_concurrency());
+    const int kPerProducer = 200000;
+
+    auto looper = ALooper::create();
+    looper->start();
+    shared_ptr<CountHandler> handler(new CountHandler);
+    looper->registerHandler(handler);
+    handler_id id = handler->id();
+
+    auto run = [&](const char* name, function<shared_ptr<AMessage>()> create) {
+        handler->expect((int64_t)kProducers * kPerProducer);
+        int64_t us = measureUs([&]{
+            vector<thread> producers;
+            for (int i = 0; i < kProducers; i++) {
+                producers.push_back(thread([&]{
+                    for (int j = 0; j < kPerProducer; j++) {
+                        create()->post();
+                    }
+                }));
+            }
+            for (auto &t : producers) {
+                t.join();
+            }
+            handler->wait();
+        });
+        report(name, (int64_t)kProducers * kPerProducer, us);
+    };
+
+    printf("  %d producers\n", kProducers);
+    run("create(what, handler)", [&]{ return AMessage::create(1, handler); });
+    run("create(what, id)", [&]{ return AMessage::create(1, id); });
+
+    looper->stop();
+}
+
+//模拟会话创建/销毁：每个会话注册、注销32个handler
+void RegisterBulkBenchmark() {
+    const int kHandlers = 32;
+    const int kSessions = 20000;
+
+    auto looper = ALooper::create();
+    vector<shared_ptr<AHandler>> handlers;
+    for (int i = 0; i < kHandlers; i++) {
+        handlers.push_back(shared_ptr<AHandler>(new CountHandler));
+    }
+
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kSessions; i++) {
+            for (auto &handler : handlers) {
+                looper->registerHandler(handler);
+            }
+            for (auto &handler : handlers) {
+                looper->unregisterHandler(handler->id());
+            }
+        }
+    });
+    report("registerHandler x32", kSessions, us);
+
+    us = measureUs([&]{
+        for (int i = 0; i < kSessions; i++) {
+            looper->unregisterHandlers(looper->registerHandlers(handlers));
+        }
+    });
+    report("registerHandlers(32)", kSessions, us);
+}
+
+//典型消息：1~3个附加数据
+void MessageBenchmark() {
+    const int kCount = 1000000;
+
+    printf("  sizeof(AMessage) = %zu\n", sizeof(AMessage));
+
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            auto msg = AMessage::create();
+            msg->setInt32("index", i);
+            msg->setInt64("timeUs", i);
+            msg->setFloat("gain", 1.0f);
+        }
+    });
+    report("create, 3 items", kCount, us);
+
+    auto looper = ALooper::create();
+    looper->start();
+    shared_ptr<CountHandler> handler(new CountHandler);
+    looper->registerHandler(handler);
+
+    //每批消息都等处理完再发下一批，避免队列过长影响测量
+    const int kBatch = 1000;
+    handler->expect(kCount);
+    us = measureUs([&]{
+        for (int i = 0; i < kCount; i += kBatch) {
+            for (int j = 0; j < kBatch; j++) {
+                auto msg = AMessage::create(1, handler);
+                msg->setInt32("index", i + j);
+                msg->setInt64("timeUs", i + j);
+                msg->post();
+            }
+            while (looper->getQueueDepth() > 0) {
+                this_thread::yield();
+            }
+        }
+        handler->wait();
+    });
+    report("post + dispatch, 2 items", kCount, us);
+
+    looper->stop();
+}
+
+//const char*与AKey两种名字的set/find
+void KeyBenchmark() {
+    const int kCount = 1000000;
+    static const AKey kIndex("index");
+    static const AKey kTimeUs("timeUs");
+    static const AKey kGain("gain");
+
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            auto msg = AMessage::create();
+            msg->setInt32("index", i);
+            msg->setInt64("timeUs", i);
+            msg->setFloat("gain", 1.0f);
+            int32_t index;
+            msg->findInt32("index", &index);
+        }
+    });
+    report("set/find by const char*", kCount, us);
+
+    us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            auto msg = AMessage::create();
+            msg->setInt32(kIndex, i);
+            msg->setInt64(kTimeUs, i);
+            msg->setFloat(kGain, 1.0f);
+            int32_t index;
+            msg->findInt32(kIndex, &index);
+        }
+    });
+    report("set/find by AKey", kCount, us);
+}
+
+//在带有大量附加数据（如编解码配置）的消息中查找
+void LookupBenchmark() {
+    const int kEntries = 60;
+    const int kRounds = 100000;
+
+    auto msg = AMessage::create();
+    vector<string> names;
+    for (int i = 0; i < kEntries; i++) {
+        names.push_back("codec-config-" + to_string(i));
+        msg->setInt32(names.back().c_str(), i);
+    }
+    vector<AKey> keys;
+    for (auto &name : names) {
+        keys.push_back(AKey(name.c_str()));
+    }
+
+    int64_t sum = 0;
+    int64_t us = measureUs([&]{
+        for (int r = 0; r < kRounds; r++) {
+            for (auto &name : names) {
+                int32_t value;
+                msg->findInt32(name.c_str(), &value);
+                sum += value;
+            }
+        }
+    });
+    report("find by const char*, 60 items", (int64_t)kRounds * kEntries, us);
+
+    us = measureUs([&]{
+        for (int r = 0; r < kRounds; r++) {
+            for (auto &key : keys) {
+                int32_t value;
+                msg->findInt32(key, &value);
+                sum += value;
+            }
+        }
+    });
+    report("find by AKey, 60 items", (int64_t)kRounds * kEntries, us);
+    printf("  (checksum %lld)\n", (long long)sum);
+}
+
+//元数据消息中的短字符串
+void StringBenchmark() {
+    const int kCount = 1000000;
+
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            auto msg = AMessage::create();
+            msg->setString("mime", "video/avc");
+            msg->setString("language", "und");
+            std::string mime;
+            msg->findString("mime", &mime);
+        }
+    });
+    report("2 short strings + findString", kCount, us);
+}
+
+//notify模式：每个事件dup()一次通知模板，再附加事件数据
+void DupBenchmark() {
+    const int kCount = 1000000;
+
+    auto notify = AMessage::create();
+    notify->setInt32("generation", 1);
+    notify->setString("mime", "video/avc");
+    notify->setString("url", "http://example.com/media/stream/playlist.m3u8");
+    notify->setObject("session", make_shared<int>(0));
+    notify->setInt64("startUs", 0);
+    notify->setFloat("rate", 1.0f);
+
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            auto msg = notify->dup();
+            msg->setInt32("what", i);
+        }
+    });
+    report("dup 6 items + setInt32", kCount, us);
+}
+
+//把buffer交给下一级：放入消息再取出
+void ObjectBenchmark() {
+    const int kCount = 1000000;
+
+    auto buffer = make_shared<std::string>(4096, 'b');
+    auto msg = AMessage::create();
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            msg->setObject(AKEY("buffer"), std::move(buffer));
+            msg->takeObject(AKEY("buffer"), &buffer);
+        }
+    });
+    report("setObject(move) + takeObject", kCount, us);
+}
+
+//所有权单向转移的buffer
+void UniqueBenchmark() {
+    const int kCount = 1000000;
+
+    auto msg = AMessage::create();
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            msg->setObject(AKEY("buffer"), make_shared<std::string>(64, 'b'));
+            shared_ptr<std::string> buffer;
+            msg->takeObject(AKEY("buffer"), &buffer);
+        }
+    });
+    report("make_shared + takeObject", kCount, us);
+
+    us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            msg->setUnique(AKEY("buffer"), unique_ptr<std::string>(new std::string(64, 'b')));
+            unique_ptr<std::string> buffer = msg->take<std::string>(AKEY("buffer"));
+        }
+    });
+    report("unique_ptr + take", kCount, us);
+}
+
+//把一帧中的一段放进消息：复制成字符串，或者slice共享内存
+void BufferBenchmark() {
+    const int kCount = 1000000;
+    const size_t kFrameSize = 64 * 1024;
+
+    auto frame = ABuffer::create(kFrameSize, ABuffer::kSimdAlignment);
+    memset(frame->data(), 'f', kFrameSize);
+    auto msg = AMessage::create();
+
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            msg->setString(AKEY("payload"), (const char *)frame->data() + 1024, 16 * 1024);
+        }
+    });
+    report("setString(16KB copy)", kCount, us);
+
+    us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            msg->setBuffer(AKEY("payload"), frame->slice(1024, 16 * 1024));
+        }
+    });
+    report("setBuffer(slice)", kCount, us);
+}
+
+//1024个采样：装箱成vector对象，或者直接用数组类型；取出后求和
+void ArrayBenchmark() {
+    const int kCount = 1000000;
+    const size_t kSamples = 1024;
+
+    vector<float> samples(kSamples, 0.5f);
+    auto msg = AMessage::create();
+    double sum = 0;
+
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            msg->setObject(AKEY("samples"), make_shared<vector<float>>(samples));
+            shared_ptr<vector<float>> found;
+            msg->findObject(AKEY("samples"), &found);
+            sum += (*found)[i % kSamples];
+        }
+    });
+    report("setObject(vector) + findObject", kCount, us);
+
+    us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            msg->setFloatArray(AKEY("samples"), samples.data(), kSamples);
+            const float *values;
+            size_t count;
+            msg->findFloatArray(AKEY("samples"), &values, &count);
+            sum += values[i % count];
+        }
+    });
+    report("setFloatArray + findFloatArray", kCount, us);
+    printf("  (checksum %.0f)\n", sum);
+}
+
+//同一线程创建释放，以及在looper线程释放
+void PoolBenchmark() {
+    const int kCount = 1000000;
+
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            auto msg = AMessage::create(1, INVALID_HANDLER_ID);
+            msg->setInt32(AKEY("index"), i);
+        }
+    });
+    report("create + release", kCount, us);
+
+    us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            auto msg = AMessage::obtain(1, INVALID_HANDLER_ID);
+            msg->setInt32(AKEY("index"), i);
+        }
+    });
+    report("obtain + release", kCount, us);
+
+    auto looper = ALooper::create();
+    looper->start();
+    shared_ptr<CountHandler> handler(new CountHandler);
+    looper->registerHandler(handler);
+    handler_id id = handler->id();
+
+    //消息在looper线程释放，分批发送以免队列过长
+    const int kBatch = 1000;
+    auto run = [&](const char* name, function<shared_ptr<AMessage>()> create) {
+        handler->expect(kCount);
+        int64_t us = measureUs([&]{
+            for (int i = 0; i < kCount; i += kBatch) {
+                for (int j = 0; j < kBatch; j++) {
+                    create()->post();
+                }
+                while (looper->getQueueDepth() > 0) {
+                    this_thread::yield();
+                }
+            }
+            handler->wait();
+        });
+        report(name, kCount, us);
+    };
+    run("create + post", [&]{ return AMessage::create(1, id); });
+    run("obtain + post", [&]{ return AMessage::obtain(1, id); });
+    looper->stop();
+
+    MessagePoolStats stats = getMessagePoolStats();
+    printf("  pool: obtained %llu, hits %llu, refills %llu, released %llu\n",
+        (unsigned long long)stats.obtained, (unsigned long long)stats.hits,
+        (unsigned long long)stats.refills, (unsigned long long)stats.released);
+}
+
+//10个长字符串字段的消息：设置、读取、释放
+void ArenaBenchmark() {
+    const int kCount = 200000;
+    const int kFields = 10;
+
+    vector<AKey> keys;
+    char name[16];
+    for (int i = 0; i < kFields; i++) {
+        snprintf(name, sizeof(name), "field%d", i);
+        keys.push_back(AKey(name));
+    }
+    std::string value(48, 'v');
+
+    auto run = [&](const char* name, bool arena) {
+        size_t total = 0;
+        int64_t us = measureUs([&]{
+            for (int i = 0; i < kCount; i++) {
+                auto msg = AMessage::obtain();
+                if (arena) {
+                    msg->enableArena(1024);
+                }
+                for (auto &key : keys) {
+                    msg->setString(key, value);
+                }
+                for (auto &key : keys) {
+                    const char *s;
+                    size_t len;
+                    msg->findString(key, &s, &len);
+                    total += len;
+                }
+            }
+        });
+        report(name, kCount, us);
+        printf("  (checksum %zu)\n", total);
+    };
+    run("10 strings, heap", false);
+    run("10 strings, arena", true);
+}
+
+ALOOP_FIELD(Index, int32_t);
+ALOOP_FIELD(TimeUs, int64_t);
+ALOOP_FIELD(Gain, float);
+typedef TypedMessage<Index, TimeUs, Gain> SampleMessage;
+
+//同一消息上反复设置、读取3个字段：AKey与TypedMessage
+void TypedBenchmark() {
+    const int kCount = 10000000;
+    static const AKey kIndex("index");
+    static const AKey kTimeUs("timeUs");
+    static const AKey kGain("gain");
+
+    int64_t sum = 0;
+    auto msg = AMessage::create();
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            msg->setInt32(kIndex, i);
+            msg->setInt64(kTimeUs, i);
+            msg->setFloat(kGain, 1.0f);
+            int32_t index = 0;
+            int64_t timeUs = 0;
+            float gain = 0;
+            msg->findInt32(kIndex, &index);
+            msg->findInt64(kTimeUs, &timeUs);
+            msg->findFloat(kGain, &gain);
+            sum += index + timeUs + (int64_t)gain;
+        }
+    });
+    report("AKey set/find x3", kCount, us);
+
+    auto typed = SampleMessage::create(0, INVALID_HANDLER_ID);
+    us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            typed->set<Index>(i);
+            typed->set<TimeUs>(i);
+            typed->set<Gain>(1.0f);
+            sum += typed->get<Index>() + typed->get<TimeUs>() + (int64_t)typed->get<Gain>();
+        }
+    });
+    report("TypedMessage set/get x3", kCount, us);
+    printf("  (checksum %lld)\n", (long long)sum);
+}
+
+static void reportBytes(const char* name, int64_t bytes, int64_t us) {
+    printf("  %-32s %10lld B  in %8lld us, %12.1f MB/s\n",
+        name, (long long)bytes, (long long)us, us > 0 ? bytes / (double)us : 0.0);
+}
+
+//序列化/反序列化，以及不构造消息直接读取
+void WireBenchmark() {
+    const int kCount = 500000;
+
+    auto msg = AMessage::create(1, INVALID_HANDLER_ID);
+    msg->setInt32("index", 1);
+    msg->setInt64("timeUs", 123456789);
+    msg->setSize("size", 4096);
+    msg->setFloat("gain", 0.5f);
+    msg->setDouble("rate", 1.0);
+    msg->setString("mime", "video/avc");
+    msg->setString("url", "http://example.com/media/stream/playlist.m3u8");
+    msg->setInt32("width", 1920);
+    msg->setInt32("height", 1080);
+
+    vector<uint8_t> buffer;
+    msg->writeToBuffer(&buffer);
+    const size_t kSize = buffer.size();
+    printf("  %zu bytes per message\n", kSize);
+
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            buffer.clear();
+            msg->writeToBuffer(&buffer);
+        }
+    });
+    reportBytes("writeToBuffer", (int64_t)kSize * kCount, us);
+
+    us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            AMessage::readFromBuffer(buffer.data(), buffer.size());
+        }
+    });
+    reportBytes("readFromBuffer", (int64_t)kSize * kCount, us);
+
+    static const AKey kHeight("height");
+    int64_t sum = 0;
+    us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            AMessageView view;
+            int32_t height = 0;
+            view.init(buffer.data(), buffer.size());
+            view.findInt32(kHeight, &height);
+            sum += height;
+        }
+    });
+    reportBytes("AMessageView init + find", (int64_t)kSize * kCount, us);
+    printf("  (checksum %lld)\n", (long long)sum);
+}
+
+#ifdef __linux__
+//共享内存ring：写端线程序列化写入，读端线程直接在ring上读取
+void RingBenchmark() {
+    const int kCount = 1000000;
+    const char *kName = "/aloop-bench-ring";
+
+    auto writer = ASharedRing::create(kName, 1 << 20);
+    auto reader = ASharedRing::open(kName);
+    ASharedRing::unlink(kName);
+
+    auto msg = AMessage::create(1, INVALID_HANDLER_ID);
+    msg->setInt32("index", 0);
+    msg->setInt64("timeUs", 0);
+    msg->setString("mime", "video/avc");
+
+    int64_t bytes = 0;
+    int64_t us = measureUs([&]{
+        thread consumer([&]{
+            static const AKey kIndex("index");
+            int64_t sum = 0;
+            auto read = [&](const void *data, size_t size) {
+                AMessageView view;
+                int32_t index = 0;
+                view.init(data, size);
+                view.findInt32(kIndex, &index);
+                sum += index;
+            };
+            for (int i = 0; i < kCount; i++) {
+                reader->read(read);
+            }
+            printf("  (checksum %lld)\n", (long long)sum);
+        });
+
+        vector<uint8_t> buffer;
+        for (int i = 0; i < kCount; i++) {
+            msg->setInt32("index", i);
+            buffer.clear();
+            msg->writeToBuffer(&buffer);
+            writer->write(buffer.data(), buffer.size());
+            bytes += buffer.size();
+        }
+        consumer.join();
+    });
+    report("encode + ring + view", kCount, us);
+    printf("  %.1f MB/s\n", bytes / (double)us);
+}
+
+class EchoHandler : public AHandler {
+protected:
+    void onMessageReceived(const shared_ptr<AMessage> &msg){
+        shared_ptr<AReplyToken> token;
+        if (msg->senderAwaitsResponse(&token))
+            AMessage::create()->postReply(token);
+    }
+};
+
+//socketpair两端各一个looper：单向吞吐和postAndAwaitResponse往返延迟
+void SocketBenchmark() {
+    const int kCount = 1000000;
+    const int kRounds = 20000;
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        printf("  socketpair failed\n");
+        return;
+    }
+    auto looperA = ALooper::create();
+    auto looperB = ALooper::create();
+    looperA->start();
+    looperB->start();
+    auto bridgeA = ASocketBridge::create(fds[0], looperA);
+    auto bridgeB = ASocketBridge::create(fds[1], looperB);
+
+    shared_ptr<CountHandler> counter(new CountHandler);
+    shared_ptr<EchoHandler> echo(new EchoHandler);
+    looperB->registerHandler(counter);
+    looperB->registerHandler(echo);
+    bridgeB->exportHandler(1, counter);
+    bridgeB->exportHandler(2, echo);
+    bridgeA->start();
+    bridgeB->start();
+
+    auto remote = bridgeA->getRemoteHandler(1);
+    counter->expect(kCount);
+    int64_t us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            auto msg = AMessage::create(1, remote);
+            msg->setInt32("index", i);
+            msg->setString("mime", "video/avc");
+            msg->post();
+        }
+        counter->wait();
+    });
+    report("post through socket", kCount, us);
+    uint64_t messages = 0, writes = 0;
+    bridgeA->getWriteStats(&messages, &writes);
+    printf("  %llu messages in %llu writes\n", (unsigned long long)messages, (unsigned long long)writes);
+
+    auto echoRemote = bridgeA->getRemoteHandler(2);
+    us = measureUs([&]{
+        auto response = AMessage::createNull();
+        for (int i = 0; i < kRounds; i++) {
+            AMessage::create(0, echoRemote)->postAndAwaitResponse(&response);
+        }
+    });
+    report("round trip", kRounds, us);
+    printf("  %.1f us per round trip\n", us / (double)kRounds);
+
+    bridgeA.reset();
+    bridgeB.reset();
+    looperA->stop();
+    looperB->stop();
+}
+//looper分发时记录到日志的开销，以及尽快重放的吞吐
+void JournalBenchmark() {
+    const int kCount = 1000000;
+    const char *kPath = "/tmp/aloop-bench.journal";
+
+    auto looper = ALooper::create();
+    looper->start();
+    shared_ptr<CountHandler> handler(new CountHandler);
+    looper->registerHandler(handler);
+
+    auto run = [&]{
+        handler->expect(kCount);
+        return measureUs([&]{
+            for (int i = 0; i < kCount; i++) {
+                auto msg = AMessage::create(1, handler);
+                msg->setInt32("index", i);
+                msg->setString("mime", "video/avc");
+                msg->post();
+            }
+            handler->wait();
+        });
+    };
+    report("dispatch", kCount, run());
+
+    auto recorder = AJournalRecorder::create(kPath);
+    if (recorder == NULL) {
+        printf("  create journal failed\n");
+        looper->stop();
+        return;
+    }
+    looper->setRecorder(recorder);
+    report("dispatch with recorder", kCount, run());
+    looper->setRecorder(nullptr);
+    recorder->close();
+
+    auto replayer = AJournalReplayer::open(kPath);
+    replayer->setDefaultTarget(handler);
+    handler->expect(kCount);
+    int64_t us = measureUs([&]{
+        replayer->replay(false);
+        handler->wait();
+    });
+    report("replay", kCount, us);
+
+    looper->stop();
+    unlink(kPath);
+}
+//持久化队列在不同msync批量下post + 分发（推进检查点）的吞吐
+void PersistentQueueBenchmark() {
+    const int kCount = 200000;
+    const char *kDir = "/tmp/aloop-bench-queue";
+    const size_t kBatches[] = {1, 16, 256, 0};
+
+    for (size_t batch : kBatches) {
+        if (system("rm -rf /tmp/aloop-bench-queue") != 0) {
+            return;
+        }
+        auto queue = APersistentQueue::open(kDir, batch);
+        if (queue == NULL) {
+            printf("  open queue failed\n");
+            return;
+        }
+        auto looper = ALooper::create();
+        shared_ptr<CountHandler> handler(new CountHandler);
+        looper->registerHandler(handler);
+        queue->bindHandler(1, handler);
+        looper->setPersistentQueue(queue);
+        looper->start();
+
+        //每条都落盘时较慢，只发少量消息
+        int count = batch == 1 ? kCount / 100 : kCount;
+        handler->expect(count);
+        int64_t us = measureUs([&]{
+            for (int i = 0; i < count; i++) {
+                auto msg = AMessage::create(1, handler);
+                msg->setInt32("index", i);
+                msg->setString("mime", "video/avc");
+                msg->post();
+            }
+            queue->sync();
+            handler->wait();
+        });
+        uint64_t appended = 0, syncs = 0;
+        queue->getStats(&appended, &syncs);
+        char name[64];
+        snprintf(name, sizeof(name), "sync every %zu", batch);
+        report(batch == 0 ? "sync at end" : name, count, us);
+        printf("  %llu messages in %llu syncs\n", (unsigned long long)appended, (unsigned long long)syncs);
+        looper->stop();
+    }
+    system("rm -rf /tmp/aloop-bench-queue");
+}
+//收到数据后写回应答，fd就绪时直接回调或由消息转发
+class PipeEchoHandler : public AHandler {
+public:
+    PipeEchoHandler(int readFd, int replyFd) : mReadFd(readFd), mReplyFd(replyFd) {}
+protected:
+    void onMessageReceived(const shared_ptr<AMessage> &msg){
+        echo();
+    }
+    void onFdEvent(int fd, uint32_t events){
+        echo();
+    }
+private:
+    int mReadFd;
+    int mReplyFd;
+
+    void echo() {
+        char c;
+        if (read(mReadFd, &c, 1) == 1 && write(mReplyFd, &c, 1) != 1) {
+            printf("  write failed\n");
+        }
+    }
+};
+
+//fd就绪的往返：looper直接在epoll上等待fd，对比单独的epoll线程每次就绪post一条消息
+void FdBenchmark() {
+    const int kRounds = 50000;
+    int request[2], reply[2];
+    if (pipe(request) != 0 || pipe(reply) != 0) {
+        printf("  pipe failed\n");
+        return;
+    }
+    auto roundTrip = [&]{
+        char c = 'x';
+        for (int i = 0; i < kRounds; i++) {
+            if (write(request[1], &c, 1) != 1 || read(reply[0], &c, 1) != 1) {
+                break;
+            }
+        }
+    };
+
+    auto looper = ALooper::create();
+    looper->start();
+    shared_ptr<PipeEchoHandler> handler(new PipeEchoHandler(request[0], reply[1]));
+    looper->registerHandler(handler);
+
+    int epollFd = epoll_create1(0);
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = request[0];
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, request[0], &ev);
+    atomic<bool> running(true);
+    thread poller([&]{
+        struct epoll_event event;
+        while (running) {
+            if (epoll_wait(epollFd, &event, 1, 10) == 1) {
+                AMessage::create(0, handler)->post();
+            }
+        }
+    });
+    int64_t us = measureUs(roundTrip);
+    report("epoll thread + post", kRounds, us);
+    running = false;
+    poller.join();
+    close(epollFd);
+
+    looper->addFd(request[0], ALooper::EVENT_INPUT, handler);
+    us = measureUs(roundTrip);
+    report("addFd", kRounds, us);
+    looper->removeFd(request[0]);
+
+    //looper改为epoll等待后，普通消息的吞吐
+    const int kCount = 1000000;
+    shared_ptr<CountHandler> counter(new CountHandler);
+    looper->registerHandler(counter);
+    counter->expect(kCount);
+    us = measureUs([&]{
+        for (int i = 0; i < kCount; i++) {
+            AMessage::create(1, counter)->post();
+        }
+        counter->wait();
+    });
+    report("post + dispatch on epoll", kCount, us);
+
+    looper->stop();
+    for (int fd : {request[0], request[1], reply[0], reply[1]}) {
+        close(fd);
+    }
+}
+//looper线程上保持固定数量的4KB读请求，对比io_uring和没有io_uring时的方式
+void IoBenchmark() {
+    const int kCount = 200000;
+    const int kWindow = 32;
+    const size_t kFileSize = 16 << 20;
+    const size_t kBlock = 4096;
+
+    char path[] = "/tmp/aloop-bench-io-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || ftruncate(fd, kFileSize) != 0) {
+        printf("  create file failed\n");
+        return;
+    }
+    unlink(path);
+
+    for (bool uring : {true, false}) {
+        auto looper = ALooper::create();
+        if (uring && looper->enableIoUring() != OK) {
+            printf("  io_uring unavailable\n");
+            continue;
+        }
+        looper->start();
+
+        atomic<int> submitted(0);
+        int completed = 0;
+        promise<void> done;
+        vector<shared_ptr<ABuffer>> buffers;
+        function<void(int)> submit = [&](int slot) {
+            int64_t offset = (int64_t)(submitted++ * 7919 % (kFileSize / kBlock)) * kBlock;
+            looper->submitRead(fd, buffers[slot], offset, [&, slot](int32_t) {
+                if (++completed == kCount) {
+                    done.set_value();
+                } else if (submitted < kCount) {
+                    submit(slot);
+                }
+            });
+        };
+        for (int i = 0; i < kWindow; i++) {
+            buffers.push_back(ABuffer::create(kBlock));
+        }
+        //之后的请求都在回调中、即looper线程上提交
+        int64_t us = measureUs([&]{
+            for (int i = 0; i < kWindow; i++) {
+                submit(i);
+            }
+            done.get_future().wait();
+        });
+        report(uring ? "read 4KB, io_uring" : "read 4KB, without io_uring", kCount, us);
+        looper->stop();
+    }
+    close(fd);
+}
+
+//消息在多个looper的handler之间接力
+class RelayHandler : public AHandler {
+public:
+    RelayHandler(atomic<int64_t> *remaining, promise<void> *done) : mRemaining(remaining), mDone(done) {}
+    shared_ptr<AHandler> mNext;
+protected:
+    void onMessageReceived(const shared_ptr<AMessage> &msg){
+        if (--*mRemaining > 0) {
+            AMessage::create(0, mNext)->post();
+        } else if (mDone != NULL) {
+            mDone->set_value();
+        }
+    }
+private:
+    atomic<int64_t> *mRemaining;
+    promise<void> *mDone;
+};
+
+//一个宿主线程通过epoll驱动多个looper，对比每个looper各自一个线程
+void PollBenchmark() {
+    const int kLoopers = 4;
+    const int kHops = 500000;
+
+    for (bool polled : {false, true}) {
+        atomic<int64_t> remaining(kHops);
+        promise<void> done;
+        vector<shared_ptr<ALooper>> loopers;
+        vector<shared_ptr<RelayHandler>> handlers;
+        for (int i = 0; i < kLoopers; i++) {
+            loopers.push_back(ALooper::create());
+            handlers.emplace_back(new RelayHandler(&remaining, polled ? NULL : &done));
+            loopers[i]->registerHandler(handlers[i]);
+        }
+        for (int i = 0; i < kLoopers; i++) {
+            handlers[i]->mNext = handlers[(i + 1) % kLoopers];
+        }
+
+        int64_t us;
+        if (polled) {
+            int epollFd = epoll_create1(0);
+            for (int i = 0; i < kLoopers; i++) {
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.u32 = i;
+                epoll_ctl(epollFd, EPOLL_CTL_ADD, loopers[i]->getWakeFd(), &ev);
+                loopers[i]->pollOnce();
+            }
+            us = measureUs([&]{
+                AMessage::create(0, handlers[0])->post();
+                struct epoll_event events[kLoopers];
+                while (remaining > 0) {
+                    int n = epoll_wait(epollFd, events, kLoopers, 100);
+                    for (int i = 0; i < n; i++) {
+                        loopers[events[i].data.u32]->pollOnce(64);
+                    }
+                }
+            });
+            close(epollFd);
+        } else {
+            for (auto &looper : loopers) {
+                looper->start();
+            }
+            us = measureUs([&]{
+                AMessage::create(0, handlers[0])->post();
+                done.get_future().wait();
+            });
+            for (auto &looper : loopers) {
+                looper->stop();
+            }
+        }
+        report(polled ? "relay, one host epoll" : "relay, thread per looper", kHops, us);
+        for (auto &handler : handlers) {
+            handler->mNext.reset();
+        }
+    }
+}
+#endif
+
+int main(int argc, char* argv[]){
+    using Benchmark = function<void()>;
+
+    struct{
+        string name;
+        Benchmark run;
+    }benchmarks[] = {
+        {"PostByHandlerVsId", PostByHandlerVsIdBenchmark},
+        {"RegisterBulk", RegisterBulkBenchmark},
+        {"Message", MessageBenchmark},
+        {"Key", KeyBenchmark},
+        {"Lookup", LookupBenchmark},
+        {"String", StringBenchmark},
+        {"Dup", DupBenchmark},
+        {"Object", ObjectBenchmark},
+        {"Unique", UniqueBenchmark},
+        {"Buffer", BufferBenchmark},
+        {"Array", ArrayBenchmark},
+        {"Pool", PoolBenchmark},
+        {"Arena", ArenaBenchmark},
+        {"Typed", TypedBenchmark},
+        {"Wire", WireBenchmark},
+#ifdef __linux__
+        {"Ring", RingBenchmark},
+        {"Socket", SocketBenchmark},
+        {"Journal", JournalBenchmark},
+        {"PersistentQueue", PersistentQueueBenchmark},
+        {"Fd", FdBenchmark},
+        {"Io", IoBenchmark},
+        {"Poll", PollBenchmark},
+#endif
+    };
+
+    int n = sizeof(benchmarks)/sizeof(benchmarks[0]);
+
+    //不带参数时运行全部，否则只运行名字匹配的项
+    for (int i = 0; i < n; i++) {
+        if (argc > 1 && benchmarks[i].name != argv[1])
+            continue;
+
+        printf("%s\n", benchmarks[i].name.c_str());
+        benchmarks[i].run();
+    }
+
+    return 0;
+}
@@ -1,6 +1,28 @@
 #include "aloop.h"
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <unordered_set>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
 
 #define CHECK assert
 
@@ -47,12 +69,20 @@ public:
           mReplied(false) {
     }
 
+    //跨进程的请求没有本地looper，回复通过forward发回对端
+    explicit AReplyToken(const function<status_t(const sp<AMessage> &)> &forward)
+        : mReplied(false),
+          mForward(forward) {
+    }
+
 private:
     friend class AMessage;
     friend class ALooper;
     wp<ALooper> mLooper;
     sp<AMessage> mReply;
     bool mReplied;
+    function<status_t(const sp<AMessage> &)> mForward;
+    std::mutex mForwardLock;
 
     sp<ALooper> getLooper() const {
         return mLooper.lock();
@@ -80,20 +110,17 @@ private:
 
 
 AHandler::AHandler()
-    : mID(INVALID_HANDLER_ID){
+    : mID(INVALID_HANDLER_ID),
+    mMigrations(0){
+    mLooperLock.clear();
 }
 
 handler_id AHandler::id() const {
     return mID;
 }
 
-wp<ALooper> AHandler::getLooper() const {
-    return mLooper;
-}
-
-void AHandler::setID(handler_id id, wp<ALooper> looper) {
+void AHandler::setID(handler_id id) {
     mID = id;
-    mLooper = looper;
 }
 
 void AHandler::deliverMessage(const sp<AMessage> &msg) {
@@ -102,79 +129,541 @@ void AHandler::deliverMessage(const sp<AMessage> &msg) {
 
 const handler_id INVALID_HANDLER_ID = 0;
 
+//只在极短的临界区内使用（roster slot的写者之间），避免为每个slot创建mutex
+class SpinLock {
+public:
+    void lock() {
+        while (mFlag.test_and_set(std::memory_order_acquire)) {
+            this_thread::yield();
+        }
+    }
+    void unlock() {
+        mFlag.clear(std::memory_order_release);
+    }
+private:
+    std::atomic_flag mFlag = ATOMIC_FLAG_INIT;
+};
+
 //统一不同looper的register/unregister到一个地方，可以避免多线程情况把一个handler注册到多个looper中
+//
+//handler_id = (generation << kSlotBits) | slot。slot数组按chunk惰性分配且从不移动，
+//空闲slot通过带tag的无锁栈复用，generation保证slot复用后旧id不会误命中。
+//generation有43位，同一个slot要反复注册约8.8万亿次才会回绕，不会重新得到用过的id。
+//判断一个id是否仍然有效只需读一次slot的mID，不需要任何锁。
+//slot中的looper/handler绑定按left-right方式保存两份：读者（findLooper等查找）只做
+//计数器加减和一次weak_ptr::lock()，不加锁也不等待；写者（注册、注销、迁移）之间用
+//SpinLock互斥，先改读者不用的那一份，切换后等旧读者离开再改另一份。
+//每个looper自己记录注册在其上的handler，looper析构时只需遍历自己的handler
 class ALooperRoster {
 public:
-    struct HandlerInfo {
-        ALooper* mLooper;
+    static const uint64_t kGenerationMask = (1ULL << (63 - 20)) - 1;//保证handler_id为正数
+
+    enum {
+        kSlotBits = 20,
+        kSlotMask = (1 << kSlotBits) - 1,
+        kChunkBits = 10,
+        kChunkSize = 1 << kChunkBits,
+        kMaxChunks = (1 << kSlotBits) >> kChunkBits,
+        kNoSlot = 0,//slot 0不使用，作为空闲链表的结束标记
+        kStackItems = 16,
+    };
+
+    struct Binding {
+        wp<ALooper> mLooper;
         wp<AHandler> mHandler;
     };
 
-    map<handler_id, HandlerInfo> mHandlers;
-    mutex mLock;
-    handler_id mNextHandlerID{1};
+    struct Slot {
+        std::atomic<handler_id> mID;//INVALID_HANDLER_ID表示空闲
+        std::atomic<uint32_t> mNextFree;
+        uint64_t mGeneration;//只由持有该slot的线程修改
+        SpinLock mLock;//只在写者之间互斥，读者不碰
+        std::atomic<uint32_t> mReadIndex;//读者读取的mBindings下标
+        std::atomic<uint32_t> mVersion;//读者登记用的mReaders下标
+        std::atomic<uint32_t> mReaders[2];
+        Binding mBindings[2];
+    };
+
+    ALooperRoster()
+        : mFreeHead(0), mNextUnused(1), mLiveHandlers(0),
+        mRegistered(0), mUnregistered(0), mPruned(0) {
+        for (auto &chunk : mChunks) {
+            chunk.store(NULL, std::memory_order_relaxed);
+        }
+    }
+
+    static ALooperRoster &instance() {
+        //不析构，静态存储期的handler、looper析构时仍可使用
+        static ALooperRoster *roster = new ALooperRoster;
+        return *roster;
+    }
 
     handler_id registerHandler(
             const sp<ALooper> looper, const sp<AHandler> &handler){
-        Autolock autoLock(mLock);
+        handler_id handlerID = INVALID_HANDLER_ID;
+        registerHandlers(looper, &handler, 1, &handlerID);
+        return handlerID;
+    }
 
-        if (handler->id() != INVALID_HANDLER_ID) {
-            loge("A handler must only be registered once.");
-            return INVALID_HANDLER_ID;
+    //批量注册只分配一次slot、只锁一次looper的handler表。注册失败的位置填INVALID_HANDLER_ID
+    size_t registerHandlers(const sp<ALooper> &looper,
+            const sp<AHandler> *handlers, size_t count, handler_id *handlerIDs) {
+        //少量注册（包括单个registerHandler()）时不在堆上分配
+        uint32_t stackIndices[kStackItems];
+        std::vector<uint32_t> heapIndices;
+        uint32_t *indices = stackIndices;
+        if (count > kStackItems) {
+            heapIndices.resize(count);
+            indices = heapIndices.data();
         }
+        size_t allocated = allocateSlots(indices, count);
+        size_t used = 0;
 
-        handler_id handlerID = INVALID_HANDLER_ID;
-        do{
-            handlerID = mNextHandlerID++;
-        } while(handlerID == INVALID_HANDLER_ID);
-        
-        mHandlers[handlerID] = HandlerInfo{looper.get(), handler};
-        handler->setID(handlerID, looper);
+        {
+            Autolock l(looper->mHandlersLock);
+            for (size_t i = 0; i < count; i++) {
+                handlerIDs[i] = INVALID_HANDLER_ID;
 
-        return handlerID;
+                const sp<AHandler> &handler = handlers[i];
+                if (handler == NULL || handler->id() != INVALID_HANDLER_ID) {
+                    loge("A handler must only be registered once.");
+                    continue;
+                }
+                if (used == allocated) {
+                    loge("too many handlers registered");
+                    continue;
+                }
+
+                uint32_t index = indices[used];
+                Slot *slot = getSlot(index);
+                uint64_t generation = (slot->mGeneration + 1) & kGenerationMask;
+                if (generation == 0) {
+                    generation = 1;
+                }
+                handler_id handlerID = (handler_id)((generation << kSlotBits) | index);
+
+                //同一个handler被并发注册到多个looper时，只有一个能成功
+                handler_id expected = INVALID_HANDLER_ID;
+                if (!handler->mID.compare_exchange_strong(expected, handlerID)) {
+                    loge("A handler must only be registered once.");
+                    continue;
+                }
+                slot->mGeneration = generation;
+                used++;
+
+                looper->mHandlers[handlerID] = handler;
+                {
+                    std::lock_guard<SpinLock> sl(slot->mLock);
+                    writeBinding(slot, [&](Binding &binding) {
+                        binding.mLooper = looper;
+                        binding.mHandler = handler;
+                    });
+                }
+                handler->setLooper(looper, false);
+                slot->mID.store(handlerID, std::memory_order_release);
+                handlerIDs[i] = handlerID;
+            }
+        }
+
+        if (used < allocated) {
+            freeSlots(indices + used, allocated - used);
+        }
+
+        mLiveHandlers += used;
+        mRegistered.fetch_add(used, std::memory_order_relaxed);
+        return used;
     }
 
-    void unregisterHandler(handler_id handlerID){
-        Autolock autoLock(mLock);
+    bool unregisterHandler(handler_id handlerID){
+        sp<ALooper> looper;
+        if (!releaseID(handlerID, &looper)) {
+            return false;
+        }
+        if (looper != NULL) {
+            Autolock l(looper->mHandlersLock);
+            looper->mHandlers.erase(handlerID);
+        }
+        uint32_t index = slotIndexOf(handlerID);
+        freeSlots(&index, 1);
+        return true;
+    }
 
-        sp<AHandler> handler = mHandlers[handlerID].mHandler.lock();
+    //批量注销，同一个looper上连续的handler只锁一次looper的handler表
+    size_t unregisterHandlers(const handler_id *handlerIDs, size_t count) {
+        std::vector<uint32_t> indices;
+        std::vector<std::pair<sp<ALooper>, handler_id>> released;
+        indices.reserve(count);
+        released.reserve(count);
 
-        if (handler != NULL) {
-            handler->setID(0, wp<ALooper>());
+        for (size_t i = 0; i < count; i++) {
+            sp<ALooper> looper;
+            if (releaseID(handlerIDs[i], &looper)) {
+                indices.push_back(slotIndexOf(handlerIDs[i]));
+                released.push_back(std::make_pair(looper, handlerIDs[i]));
+            }
+        }
+
+        size_t i = 0;
+        while (i < released.size()) {
+            const sp<ALooper> &looper = released[i].first;
+            if (looper == NULL) {
+                i++;
+                continue;
+            }
+
+            Autolock l(looper->mHandlersLock);
+            for (; i < released.size() && released[i].first == looper; i++) {
+                looper->mHandlers.erase(released[i].second);
+            }
+        }
+
+        freeSlots(indices.data(), indices.size());
+        return indices.size();
+    }
+
+    //handler析构时仍未注销，清理其slot和所在looper上的记录
+    void pruneHandler(handler_id handlerID) {
+        if (unregisterHandler(handlerID)) {
+            mPruned.fetch_add(1, std::memory_order_relaxed);
         }
+    }
 
-        mHandlers.erase(handlerID);
+    RosterStats getStats() const {
+        RosterStats stats;
+        stats.liveHandlers = mLiveHandlers.load(std::memory_order_relaxed);
+        stats.slotCapacity = mNextUnused.load(std::memory_order_relaxed) - 1;
+        stats.registered = mRegistered.load(std::memory_order_relaxed);
+        stats.unregistered = mUnregistered.load(std::memory_order_relaxed);
+        stats.pruned = mPruned.load(std::memory_order_relaxed);
+        return stats;
     }
 
     void unregisterHandlers(ALooper* looper){
-        Autolock autoLock(mLock);
+        unordered_map<handler_id, wp<AHandler>> handlers;
+        {
+            Autolock l(looper->mHandlersLock);
+            handlers.swap(looper->mHandlers);
+        }
+
+        std::vector<uint32_t> indices;
+        indices.reserve(handlers.size());
+        for (auto &it : handlers) {
+            if (releaseID(it.first, NULL)) {
+                indices.push_back(slotIndexOf(it.first));
+            }
+        }
+        freeSlots(indices.data(), indices.size());
+    }
 
-        auto it = mHandlers.begin();
-        while (it != mHandlers.end()){
-            if (it->second.mLooper == looper){
-                sp<AHandler> handler =it->second.mHandler.lock();
+    //把handler换绑到另一个looper上，id保持不变
+    //handler通过参数带出，避免调用者持锁时在这里释放handler的最后一个引用
+    bool rebindHandler(handler_id handlerID, ALooper *from, const sp<ALooper> &to, sp<AHandler> *handlerOut) {
+        Slot *slot = findSlot(handlerID);
+        if (slot == NULL) {
+            return false;
+        }
 
-                if (handler != NULL) {
-                    handler->setID(0, wp<ALooper>());
-                }
-                
-                mHandlers.erase(it++);
-            }else{
-                ++it;
+        sp<AHandler> &handler = *handlerOut;
+        {
+            std::lock_guard<SpinLock> l(slot->mLock);
+            const Binding &current = currentBinding(slot);
+            if (slot->mID.load(std::memory_order_relaxed) != handlerID
+                    || current.mLooper.lock().get() != from) {
+                return false;
+            }
+            handler = current.mHandler.lock();
+            writeBinding(slot, [&](Binding &binding) {
+                binding.mLooper = to;
+            });
+        }
+        //之前创建的消息发现迁移次数变化后改为通过注册表找looper
+        if (handler != NULL) {
+            handler->setLooper(to, true);
+        }
+
+        {
+            Autolock l(from->mHandlersLock);
+            from->mHandlers.erase(handlerID);
+        }
+        {
+            Autolock l(to->mHandlersLock);
+            to->mHandlers[handlerID] = handler;
+        }
+        return true;
+    }
+
+    //找到handlerID当前所在的looper，handler已注销或looper已释放时返回NULL
+    //不加锁：slot的mID校验id，binding按left-right读取，只剩一次weak_ptr::lock()
+    sp<ALooper> findLooper(handler_id handlerID) {
+        Slot *slot = findSlot(handlerID);
+        if (slot == NULL || slot->mID.load(std::memory_order_acquire) != handlerID) {
+            return NULL;
+        }
+
+        sp<ALooper> looper;
+        readBinding(slot, [&](const Binding &binding) {
+            looper = binding.mLooper.lock();
+        });
+        //读的过程中被注销，binding可能已属于slot的下一个主人
+        if (slot->mID.load(std::memory_order_acquire) != handlerID) {
+            return NULL;
+        }
+        return looper;
+    }
+
+    //找到注册在looper上的handler，与findLooper一样不加锁。handler已注销、已迁移到其他looper
+    //或已释放时返回NULL。handler只被弱引用，仍需一次weak_ptr::lock()才能安全地派发
+    sp<AHandler> findHandler(handler_id handlerID, const sp<ALooper> &looper) {
+        Slot *slot = findSlot(handlerID);
+        if (slot == NULL || slot->mID.load(std::memory_order_acquire) != handlerID) {
+            return NULL;
+        }
+
+        sp<AHandler> handler;
+        readBinding(slot, [&](const Binding &binding) {
+            if (!binding.mLooper.owner_before(looper) && !looper.owner_before(binding.mLooper)) {
+                handler = binding.mHandler.lock();
+            }
+        });
+        if (handler == NULL || handler->id() != handlerID) {
+            return NULL;
+        }
+        return handler;
+    }
+
+private:
+    std::atomic<Slot*> mChunks[kMaxChunks];
+    std::atomic<uint64_t> mFreeHead;//高32位为tag（防止ABA），低32位为slot下标
+    std::atomic<uint32_t> mNextUnused;
+
+    std::atomic<size_t> mLiveHandlers;
+    std::atomic<uint64_t> mRegistered;
+    std::atomic<uint64_t> mUnregistered;
+    std::atomic<uint64_t> mPruned;
+
+    static uint32_t slotIndexOf(handler_id id) {
+        return (uint32_t)id & kSlotMask;
+    }
+
+    //读者：登记到当前mVersion的计数器上，读mReadIndex指向的那一份，不会等待写者
+    template<class Func>
+    static void readBinding(Slot *slot, Func func) {
+        uint32_t version = slot->mVersion.load(std::memory_order_seq_cst);
+        slot->mReaders[version].fetch_add(1, std::memory_order_seq_cst);
+        func(slot->mBindings[slot->mReadIndex.load(std::memory_order_seq_cst)]);
+        slot->mReaders[version].fetch_sub(1, std::memory_order_release);
+    }
+
+    //写者持有slot->mLock时调用，此时读者只会读这一份
+    static const Binding &currentBinding(Slot *slot) {
+        return slot->mBindings[slot->mReadIndex.load(std::memory_order_relaxed)];
+    }
+
+    //写者持有slot->mLock时调用：先改读者不用的一份并让读者切过去，
+    //等两组读者计数器先后归零（旧读者都已离开）后再以同样方式改另一份
+    template<class Func>
+    static void writeBinding(Slot *slot, Func func) {
+        uint32_t readIndex = slot->mReadIndex.load(std::memory_order_relaxed);
+        func(slot->mBindings[!readIndex]);
+        slot->mReadIndex.store(!readIndex, std::memory_order_seq_cst);
+
+        uint32_t version = slot->mVersion.load(std::memory_order_relaxed);
+        waitReaders(slot, !version);
+        slot->mVersion.store(!version, std::memory_order_seq_cst);
+        waitReaders(slot, version);
+
+        func(slot->mBindings[readIndex]);
+    }
+
+    static void waitReaders(Slot *slot, uint32_t version) {
+        while (slot->mReaders[version].load(std::memory_order_seq_cst) != 0) {
+            this_thread::yield();
+        }
+    }
+
+    Slot *getSlot(uint32_t index) {
+        return &mChunks[index >> kChunkBits].load(std::memory_order_acquire)[index & (kChunkSize - 1)];
+    }
+
+    Slot *findSlot(handler_id id) {
+        uint32_t index = slotIndexOf(id);
+        if (index == kNoSlot || index >= mNextUnused.load(std::memory_order_acquire)) {
+            return NULL;
+        }
+        Slot *chunk = mChunks[index >> kChunkBits].load(std::memory_order_acquire);
+        return chunk == NULL ? NULL : &chunk[index & (kChunkSize - 1)];
+    }
+
+    //优先复用空闲slot，不够时从未使用的slot中一次性连续分配剩余的数量
+    size_t allocateSlots(uint32_t *indices, size_t count) {
+        size_t n = 0;
+        uint64_t head = mFreeHead.load(std::memory_order_acquire);
+        while (n < count && (uint32_t)head != kNoSlot) {
+            uint32_t index = (uint32_t)head;
+            uint32_t next = getSlot(index)->mNextFree.load(std::memory_order_relaxed);
+            uint64_t newHead = ((head >> 32) + 1) << 32 | next;
+            if (mFreeHead.compare_exchange_weak(head, newHead, std::memory_order_acquire)) {
+                indices[n++] = index;
+                head = newHead;
+            }
+        }
+        if (n == count) {
+            return n;
+        }
+
+        uint32_t first = mNextUnused.load(std::memory_order_relaxed);
+        uint32_t run;
+        do {
+            run = (uint32_t)std::min<size_t>(count - n, first > kSlotMask ? 0 : kSlotMask + 1 - first);
+            if (run == 0) {
+                return n;
+            }
+        } while (!mNextUnused.compare_exchange_weak(first, first + run));
+
+        for (uint32_t chunk = first >> kChunkBits; chunk <= (first + run - 1) >> kChunkBits; chunk++) {
+            ensureChunk(chunk);
+        }
+        for (uint32_t i = 0; i < run; i++) {
+            indices[n++] = first + i;
+        }
+        return n;
+    }
+
+    void ensureChunk(uint32_t chunkIndex) {
+        auto &chunk = mChunks[chunkIndex];
+        if (chunk.load(std::memory_order_acquire) != NULL) {
+            return;
+        }
+
+        Slot *slots = new Slot[kChunkSize];
+        for (size_t i = 0; i < kChunkSize; i++) {
+            slots[i].mID.store(INVALID_HANDLER_ID, std::memory_order_relaxed);
+            slots[i].mNextFree.store(kNoSlot, std::memory_order_relaxed);
+            slots[i].mGeneration = 0;
+            slots[i].mReadIndex.store(0, std::memory_order_relaxed);
+            slots[i].mVersion.store(0, std::memory_order_relaxed);
+            slots[i].mReaders[0].store(0, std::memory_order_relaxed);
+            slots[i].mReaders[1].store(0, std::memory_order_relaxed);
+        }
+
+        Slot *expected = NULL;
+        if (!chunk.compare_exchange_strong(expected, slots)) {
+            delete[] slots;
+        }
+    }
+
+    //先把要释放的slot串成链表，再一次性压入空闲栈
+    void freeSlots(const uint32_t *indices, size_t count) {
+        if (count == 0) {
+            return;
+        }
+        for (size_t i = 0; i + 1 < count; i++) {
+            getSlot(indices[i])->mNextFree.store(indices[i + 1], std::memory_order_relaxed);
+        }
+
+        Slot *last = getSlot(indices[count - 1]);
+        uint64_t head = mFreeHead.load(std::memory_order_relaxed);
+        uint64_t newHead;
+        do {
+            last->mNextFree.store((uint32_t)head, std::memory_order_relaxed);
+            newHead = ((head >> 32) + 1) << 32 | indices[0];
+        } while (!mFreeHead.compare_exchange_weak(head, newHead, std::memory_order_release));
+    }
+
+    //只有将slot的mID从handlerID改为INVALID_HANDLER_ID的线程会真正执行注销，slot由调用者释放
+    bool releaseID(handler_id handlerID, sp<ALooper> *looper) {
+        Slot *slot = findSlot(handlerID);
+        if (slot == NULL) {
+            return false;
+        }
+
+        handler_id expected = handlerID;
+        if (!slot->mID.compare_exchange_strong(expected, INVALID_HANDLER_ID)) {
+            return false;
+        }
+
+        sp<AHandler> handler;
+        {
+            std::lock_guard<SpinLock> l(slot->mLock);
+            const Binding &current = currentBinding(slot);
+            handler = current.mHandler.lock();
+            if (looper != NULL) {
+                *looper = current.mLooper.lock();
             }
+            writeBinding(slot, [](Binding &binding) {
+                binding.mHandler.reset();
+                binding.mLooper.reset();
+            });
+        }
+
+        if (handler != NULL) {
+            //先清除looper，id复位后handler可能立即被重新注册
+            handler->setLooper(wp<ALooper>(), false);
+            handler->setID(INVALID_HANDLER_ID);
         }
-        
+
+        mLiveHandlers--;
+        mUnregistered.fetch_add(1, std::memory_order_relaxed);
+        return true;
     }
 };
 
-static ALooperRoster gLooperRoster;
+
+RosterStats getRosterStats() {
+    return ALooperRoster::instance().getStats();
+}
+
+wp<ALooper> AHandler::getLooper() const {
+    return getLooper(NULL);
+}
+
+//looper和迁移次数一起读取，保证两者一致
+wp<ALooper> AHandler::getLooper(uint32_t *migrations) const {
+    while (mLooperLock.test_and_set(std::memory_order_acquire)) {
+        this_thread::yield();
+    }
+    wp<ALooper> looper = mLooper;
+    if (migrations != NULL) {
+        *migrations = mMigrations.load(std::memory_order_relaxed);
+    }
+    mLooperLock.clear(std::memory_order_release);
+    return looper;
+}
+
+void AHandler::setLooper(const wp<ALooper> &looper, bool migrated) {
+    while (mLooperLock.test_and_set(std::memory_order_acquire)) {
+        this_thread::yield();
+    }
+    mLooper = looper;
+    if (migrated) {
+        mMigrations.fetch_add(1, std::memory_order_release);
+    }
+    mLooperLock.clear(std::memory_order_release);
+}
+
+AHandler::~AHandler() {
+    handler_id id = mID;
+    if (id != INVALID_HANDLER_ID) {
+        ALooperRoster::instance().pruneHandler(id);
+    }
+}
+
+//当前线程正在执行的looper，用于判断提交I/O的线程是否为looper线程
+static thread_local ALooper *tLoopingLooper = NULL;
 
 ALooper::ALooper() 
-    : mRun(false), mRunningLocally(false){
+    : mRun(false),
+#ifdef __linux__
+    mEpollFd(-1), mWakeFd(-1), mTimerFd(-1), mTimerDeadlineUs(0),
+    mNextIoID(0), mHasIoCompletions(false),
+#endif
+    mRunningLocally(false), mPolling(false), mHasMigrations(false){
 }
 
 sp<ALooper> ALooper::create() {
-    return sp<ALooper>(new ALooper);
+    sp<ALooper> looper(new ALooper);
+    looper->mSelf = looper;
+    return looper;
 }
 
 /**
@@ -191,11 +680,23 @@ void ALooper::setName(const char *name) {
  * @return 注册成功后得到的handler。等同于handler->id()。如果注册失败，则返回INVALID_HANDLER_ID
  */
 handler_id ALooper::registerHandler(const sp<AHandler> &handler) {
-    return gLooperRoster.registerHandler(shared_from_this(), handler);
+    return ALooperRoster::instance().registerHandler(shared_from_this(), handler);
 }
 
 void ALooper::unregisterHandler(handler_id handlerID) {
-    return gLooperRoster.unregisterHandler(handlerID);
+    ALooperRoster::instance().unregisterHandler(handlerID);
+}
+
+vector<handler_id> ALooper::registerHandlers(const vector<sp<AHandler>> &handlers) {
+    vector<handler_id> handlerIDs(handlers.size(), INVALID_HANDLER_ID);
+    if (!handlers.empty()) {
+        ALooperRoster::instance().registerHandlers(shared_from_this(), handlers.data(), handlers.size(), handlerIDs.data());
+    }
+    return handlerIDs;
+}
+
+void ALooper::unregisterHandlers(const vector<handler_id> &handlerIDs) {
+    ALooperRoster::instance().unregisterHandlers(handlerIDs.data(), handlerIDs.size());
 }
 
 status_t ALooper::start(bool runOnCallingThread) {
@@ -213,6 +714,7 @@ status_t ALooper::start(bool runOnCallingThread) {
         logi("start on calling thread");
         do{
         } while (mRun && loop());
+        tLoopingLooper = NULL;
 
         return OK;
     }
@@ -237,16 +739,17 @@ status_t ALooper::stop() {
 
     {
         Autolock l(mLock);
-        if (!mRun)
+        if (!mRun && !mPolling)
             return INVALID_OPERATION;
 
+        mPolling = false;
         runningLocally = mRunningLocally;
         mThread.swap(thd);
         mRunningLocally = false;
         mRun = false;
+        wakeLocked();
     }
 
-    mQueueChangedCondition.notify_one();
     {
         Autolock l(mRepliesLock);
         mRepliesCondition.notify_all();
@@ -269,16 +772,68 @@ int64_t ALooper::GetNowUs() {
         std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
+void ALooper::setRecorder(const sp<AMessageRecorder> &recorder) {
+    Autolock l(mLock);
+    mRecorder = recorder;
+}
+
+#ifdef __linux__
+status_t ALooper::setPersistentQueue(const sp<APersistentQueue> &queue) {
+    {
+        Autolock l(mLock);
+        if (mRun || mPersistentQueue != NULL || queue == NULL) {
+            return INVALID_OPERATION;
+        }
+    }
+
+    //先恢复上次未完成的消息，再开始持久化新的消息
+    if (!queue->attach(shared_from_this())) {
+        return INVALID_OPERATION;
+    }
+    Autolock l(mLock);
+    mPersistentQueue = queue;
+    return OK;
+}
+#endif
+
 const char *ALooper::getName() const {
     return mName.c_str();
 }
 
+//looper在自己的线程上被析构时（最后一个引用在loop()中释放），通知loop()不要再访问自身
+static thread_local ALooper *tDestroyedLooper = NULL;
+
 ALooper::~ALooper() {
+    tDestroyedLooper = this;
     stop();
-    gLooperRoster.unregisterHandlers(this);
+    ALooperRoster::instance().unregisterHandlers(this);
+#ifdef __linux__
+    cancelIo();
+    if (mEpollFd >= 0) {
+        close(mEpollFd);
+        close(mWakeFd);
+        close(mTimerFd);
+    }
+#endif
 }
 
 void ALooper::post(const sp<AMessage> &msg, int64_t delayUs) {
+    uint64_t record = 0;
+    sp<APersistentQueue> queue;
+#ifdef __linux__
+    {
+        Autolock l(mLock);
+        queue = mPersistentQueue;
+    }
+    //编码和msync在锁外进行
+    if (queue != NULL) {
+        record = queue->append(msg, delayUs);
+        if (record == 0) {
+            queue.reset();
+        }
+    }
+#endif
+
     Autolock l(mLock);
 
     int64_t whenUs;
@@ -288,22 +843,40 @@ void ALooper::post(const sp<AMessage> &msg, int64_t delayUs) {
         whenUs = GetNowUs();
     }
 
-    std::list<Event>::iterator it = mEventQueue.begin();
-    while (it != mEventQueue.end() && (*it).mWhenUs <= whenUs) {
-        ++it;
-    }
-
     Event event;
     event.mWhenUs = whenUs;
     event.mMessage = msg;
+    event.mRecord = record;
+    event.mQueue = queue;
+
+    insertEventLocked(event);
+}
+
+void ALooper::insertEventLocked(const Event &event) {
+    std::list<Event>::iterator it = mEventQueue.begin();
+    while (it != mEventQueue.end() && (*it).mWhenUs <= event.mWhenUs) {
+        ++it;
+    }
 
     if (it == mEventQueue.begin()) {
-        mQueueChangedCondition.notify_one();
+        wakeLocked();
     }
 
     mEventQueue.insert(it, event);//在it前插入event，所以如果有时间相同的事件，那么就插入到时间相同的事件后
 }
 
+void ALooper::wakeLocked() {
+    mQueueChangedCondition.notify_one();
+#ifdef __linux__
+    if (mWakeFd >= 0) {
+        uint64_t one = 1;
+        if (write(mWakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            logw("failed to wake looper %s: %s", mName.c_str(), strerror(errno));
+        }
+    }
+#endif
+}
+
 // creates a reply token to be used with this looper
 sp<AReplyToken> ALooper::createReplyToken() {
     return std::shared_ptr<AReplyToken>(new AReplyToken(shared_from_this()));
@@ -318,7 +891,7 @@ status_t ALooper::awaitResponse(const sp<AReplyToken> &replyToken, sp<AMessage>
     while (!replyToken->retrieveReply(response)) {
         {
             Autolock l(mLock);
-            if (!mRun) {
+            if (!mRun && !mPolling) {
                 return -ENOENT;
             }
         }
@@ -340,13 +913,43 @@ status_t ALooper::postReply(const sp<AReplyToken> &replyToken, const sp<AMessage
 // END --- methods used only by AMessage
 
 bool ALooper::loop() {
-    Event event;
+    std::list<Event> events;
+    sp<AMessageRecorder> recorder;
+
+    tLoopingLooper = this;
+    if (mHasMigrations) {
+        processMigrations(&events);
+    }
+#ifdef __linux__
+    if (mHasIoCompletions && !processIoCompletions()) {
+        return false;
+    }
+#endif
 
     {
         std::unique_lock<std::mutex> l(mLock);
         if (!mRun) {
             return false;
         }
+#ifdef __linux__
+        if (mEpollFd >= 0) {
+            //没有到期的消息时阻塞在epoll或io_uring上，由eventfd和定时唤醒
+            if (mEventQueue.empty() || (*mEventQueue.begin()).mWhenUs > GetNowUs()) {
+                int64_t deadlineUs = mEventQueue.empty() ? -1 : (*mEventQueue.begin()).mWhenUs;
+                l.unlock();
+                return waitEvents(deadlineUs, true);
+            }
+            //有到期的消息时也检查一次fd，避免消息很多时fd得不到处理
+            l.unlock();
+            if (!waitEvents(0, false)) {
+                return false;
+            }
+            l.lock();
+            if (!mRun) {
+                return false;
+            }
+        }
+#endif
         if (mEventQueue.empty()) {
             mQueueChangedCondition.wait(l);
             return true;
@@ -364,320 +967,4730 @@ bool ALooper::loop() {
             return true;
         }
 
-        event = *mEventQueue.begin();
-        mEventQueue.erase(mEventQueue.begin());
+        //一次取出所有已到期的消息，减少加锁次数
+        auto it = mEventQueue.begin();
+        while (it != mEventQueue.end() && (*it).mWhenUs <= nowUs) {
+            ++it;
+        }
+        events.splice(events.end(), mEventQueue, mEventQueue.begin(), it);
+        recorder = mRecorder;
     }
 
-    event.mMessage->deliver();
+    return deliverEvents(&events, recorder, false, 0);
+}
 
-    // NOTE: It's important to note that at this point our "ALooper" object
-    // may no longer exist (its final reference may have gone away while
-    // delivering the message). We have made sure, however, that loop()
-    // won't be called again.
+//依次分发events。loop()中stop()之后、pollOnce()中超过endUs后，剩余的消息放回队列
+//返回false表示looper在分发中被析构
+bool ALooper::deliverEvents(std::list<Event> *batch, const sp<AMessageRecorder> &recorder, bool polling, int64_t endUs) {
+    std::list<Event> &events = *batch;
 
-    return true;
-}
+    // NOTE: the final reference of this looper may go away while delivering
+    // a message. Hold it until the whole batch is delivered, so that the
+    // looper can only be destroyed at the end of the batch.
+    sp<ALooper> self = mSelf.lock();
+    if (self == NULL) {
+        return false;
+    }
 
+    //连续发往同一个handler的消息复用已解析的handler，无需每条消息都lock()一次
+    handler_id cachedID = INVALID_HANDLER_ID;
+    sp<AHandler> cachedHandler;
+    bool delivered = false;
+    while (!events.empty()) {
+        if (polling ? (delivered && endUs > 0 && GetNowUs() >= endUs) : !mRun) {
+            Autolock l(mLock);
+            mEventQueue.splice(mEventQueue.begin(), events);
+            break;
+        }
 
-AMessage::AMessage()
-    : mWhat(0),
-    mTarget(INVALID_HANDLER_ID),
-    mNumItems(0) {
-}
+        if (mHasMigrations) {
+            processMigrations(&events);
+            cachedID = INVALID_HANDLER_ID;
+            cachedHandler.reset();
+            continue;
+        }
 
-AMessage::AMessage(uint32_t what, const sp<AHandler> &handler)
-    : mWhat(what),
-    mNumItems(0) {
-    setTarget(handler);
-}
+        Event event = events.front();
+        events.pop_front();
 
-sp<AMessage> AMessage::create() {
-    return sp<AMessage>(new AMessage);
-}
+        handler_id target = event.mMessage->mTarget;
+        //同一批中之前的消息可能已注销该handler，注销后id会变化，每条消息都检查一次
+        if (target == INVALID_HANDLER_ID || target != cachedID
+                || (cachedHandler != NULL && cachedHandler->id() != target)) {
+            cachedID = target;
+            cachedHandler = resolveHandler(event.mMessage, self);
+            if (cachedHandler == NULL && target != INVALID_HANDLER_ID) {
+                //handler已经迁移到其他looper上，转发过去
+                sp<ALooper> looper = ALooperRoster::instance().findLooper(target);
+                if (looper != NULL && looper != self) {
+                    //持久化记录随消息一起转发，由目标looper派发后标记完成
+                    Autolock l(looper->mLock);
+                    looper->insertEventLocked(event);
+                    cachedID = INVALID_HANDLER_ID;
+                    continue;
+                }
+            }
+            //已注销的handler不再接收消息，只有未指定id的消息才直接使用mHandler
+            if (cachedHandler == NULL && target == INVALID_HANDLER_ID) {
+                cachedHandler = event.mMessage->mHandler.lock();
+            }
+        }
 
-sp<AMessage> AMessage::createNull() {
-    return sp<AMessage>();
-}
+        if (recorder != NULL && cachedHandler != NULL) {
+            recorder->record(event.mMessage, GetNowUs());
+        }
+        event.mMessage->deliver(cachedHandler);
+        delivered = true;
+#ifdef __linux__
+        //handler处理完才标记完成，中途崩溃时重启后会再次投递；
+        //找不到handler的消息没有被处理，记录保持未完成
+        if (event.mRecord != 0 && cachedHandler != NULL) {
+            event.mQueue->complete(event.mRecord);
+        }
+#endif
+    }
+    cachedHandler.reset();
 
-sp<AMessage> AMessage::create(uint32_t what, const sp<AHandler> &handler) {
-    return sp<AMessage>(new AMessage(what, handler));
+    tDestroyedLooper = NULL;
+    ALooper *looper = this;
+    self.reset();
+    // We have made sure that loop() won't be called again if the looper was
+    // destroyed by the line above.
+    return tDestroyedLooper != looper;
 }
 
-void AMessage::setWhat(uint32_t what) {
-    mWhat = what;
+int64_t ALooper::pollOnce(size_t maxMessages, int64_t maxTimeUs) {
+    int64_t startUs = GetNowUs();
+    std::list<Event> events;
+    sp<AMessageRecorder> recorder;
+    //为0时不分发消息却返回0，宿主会一直重复调用
+    maxMessages = std::max(maxMessages, (size_t)1);
+
+    //与loop()相同，handler中提交的异步I/O留到这一轮结束时一起提交
+    struct LoopingScope {
+        ALooper *mPrevious;
+        explicit LoopingScope(ALooper *looper) : mPrevious(tLoopingLooper) {
+            tLoopingLooper = looper;
+        }
+        ~LoopingScope() {
+            tLoopingLooper = mPrevious;
+        }
+    } scope(this);
+
+    if (mHasMigrations) {
+        processMigrations(&events);
+    }
+#ifdef __linux__
+    if (mHasIoCompletions && !processIoCompletions()) {
+        return -1;
+    }
+#endif
+
+    {
+        Autolock l(mLock);
+        if (mRun) {
+            logw("pollOnce() can't be used on running looper %s", mName.c_str());
+            return -1;
+        }
+        //由外部驱动时，其他线程上的postAndAwaitResponse可以等待回复
+        mPolling = true;
+        auto it = mEventQueue.begin();
+        size_t count = 0;
+        while (it != mEventQueue.end() && (*it).mWhenUs <= startUs && count < maxMessages) {
+            ++it;
+            ++count;
+        }
+        events.splice(events.end(), mEventQueue, mEventQueue.begin(), it);
+        recorder = mRecorder;
+    }
+    if (!events.empty() && !deliverEvents(&events, recorder, true, maxTimeUs >= 0 ? startUs + maxTimeUs : 0)) {
+        return -1;
+    }
+
+    std::unique_lock<std::mutex> l(mLock);
+#ifdef __linux__
+    //处理已就绪的fd和异步I/O，并按下一条消息的到期时间设置定时，到期时wake fd可读
+    if (mEpollFd >= 0) {
+        int64_t deadlineUs = mEventQueue.empty() ? -1 : (*mEventQueue.begin()).mWhenUs;
+        l.unlock();
+        if (!waitEvents(deadlineUs, false)) {
+            return -1;
+        }
+        l.lock();
+    }
+#endif
+    //fd的回调中可能post了新消息，重新取队列头部
+    if (mEventQueue.empty()) {
+        return -1;
+    }
+    return std::max((*mEventQueue.begin()).mWhenUs - GetNowUs(), (int64_t)0);
+}
+
+
+#ifdef __linux__
+//epoll事件和io_uring请求的user data：最高位表示异步I/O，低位为请求的id；
+//epoll中其他的值为fd，io_uring中其他的值见下面
+static const uint64_t kIoTag = 1ull << 63;
+static const uint64_t kTimeoutTag = 1ull << 62;   // 低位为定时的序号
+static const uint64_t kWakeTag = 1;
+static const uint64_t kEpollTag = 2;
+static const uint64_t kIgnoreTag = 3;
+
+enum {
+    kIoRead,
+    kIoWrite,
+    kIoAccept,
+};
+
+//直接使用系统调用，不依赖liburing
+struct ALooper::IoRing {
+    int mFd;
+    unsigned mEntries;
+    void *mSqMap;
+    size_t mSqMapSize;
+    void *mCqMap;
+    size_t mCqMapSize;
+    struct io_uring_sqe *mSqes;
+    unsigned *mSqHead;
+    unsigned *mSqTail;
+    unsigned *mSqArray;
+    unsigned mSqMask;
+    unsigned *mCqHead;
+    unsigned *mCqTail;
+    unsigned mCqMask;
+    struct io_uring_cqe *mCqes;
+
+    // 以下只在looper线程上访问
+    bool mWakeArmed;
+    bool mEpollArmed;
+    uint64_t mTimeoutID;        // 当前定时的user data，0表示没有
+    uint64_t mTimeoutSeq;
+    int64_t mTimeoutDeadlineUs;
+    struct __kernel_timespec mTimeout;
+
+    IoRing()
+        : mFd(-1), mEntries(0), mSqMap(MAP_FAILED), mSqMapSize(0), mCqMap(MAP_FAILED), mCqMapSize(0),
+        mSqes((struct io_uring_sqe *)MAP_FAILED), mWakeArmed(false), mEpollArmed(false),
+        mTimeoutID(0), mTimeoutSeq(0), mTimeoutDeadlineUs(0) {
+    }
+
+    ~IoRing() {
+        if (mSqes != MAP_FAILED) {
+            munmap(mSqes, mEntries * sizeof(struct io_uring_sqe));
+        }
+        if (mCqMap != MAP_FAILED && mCqMap != mSqMap) {
+            munmap(mCqMap, mCqMapSize);
+        }
+        if (mSqMap != MAP_FAILED) {
+            munmap(mSqMap, mSqMapSize);
+        }
+        if (mFd >= 0) {
+            close(mFd);
+        }
+    }
+
+    bool init(unsigned entries) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        mFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (mFd < 0) {
+            logi("io_uring unavailable: %s", strerror(errno));
+            return false;
+        }
+        //需要5.7以上的内核，READ、WRITE、ACCEPT等操作才都可用
+        if (!(params.features & IORING_FEAT_FAST_POLL)) {
+            logi("io_uring is too old");
+            return false;
+        }
+
+        mEntries = params.sq_entries;
+        mSqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        mCqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) {
+            mSqMapSize = mCqMapSize = std::max(mSqMapSize, mCqMapSize);
+        }
+        mSqMap = mmap(NULL, mSqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+        if (mSqMap == MAP_FAILED) {
+            return false;
+        }
+        mCqMap = singleMap ? mSqMap
+            : mmap(NULL, mCqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+        if (mCqMap == MAP_FAILED) {
+            return false;
+        }
+        mSqes = (struct io_uring_sqe *)mmap(NULL, mEntries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+        if (mSqes == MAP_FAILED) {
+            return false;
+        }
+
+        uint8_t *sq = static_cast<uint8_t *>(mSqMap);
+        mSqHead = (unsigned *)(sq + params.sq_off.head);
+        mSqTail = (unsigned *)(sq + params.sq_off.tail);
+        mSqArray = (unsigned *)(sq + params.sq_off.array);
+        mSqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        uint8_t *cq = static_cast<uint8_t *>(mCqMap);
+        mCqHead = (unsigned *)(cq + params.cq_off.head);
+        mCqTail = (unsigned *)(cq + params.cq_off.tail);
+        mCqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        mCqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        int ret;
+        do {
+            ret = (int)syscall(__NR_io_uring_enter, mFd, toSubmit, minComplete, flags, NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+    //已加入但还未被内核取走的请求数
+    unsigned pending() const {
+        return *mSqTail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+    }
+
+    //取得一个空的请求，队列满时先提交。需要持有mIoLock
+    struct io_uring_sqe *prepare(uint8_t opcode, int fd, uint64_t userData) {
+        if (pending() >= mEntries) {
+            enter(pending(), 0, 0);
+            if (pending() >= mEntries) {
+                return NULL;
+            }
+        }
+        unsigned tail = *mSqTail;
+        struct io_uring_sqe *sqe = &mSqes[tail & mSqMask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = userData;
+        mSqArray[tail & mSqMask] = tail & mSqMask;
+        return sqe;
+    }
+
+    void commit() {
+        __atomic_store_n(mSqTail, *mSqTail + 1, __ATOMIC_RELEASE);
+    }
+
+    //取出所有完成的请求，只在looper线程上调用
+    template<class Func>
+    void reap(Func func) {
+        unsigned head = *mCqHead;
+        unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &mCqes[head & mCqMask];
+            func(cqe->user_data, cqe->res);
+            ++head;
+        }
+        __atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+    }
+};
+
+static uint32_t toEpollEvents(uint32_t events) {
+    uint32_t epollEvents = 0;
+    if (events & ALooper::EVENT_INPUT) {
+        epollEvents |= EPOLLIN;
+    }
+    if (events & ALooper::EVENT_OUTPUT) {
+        epollEvents |= EPOLLOUT;
+    }
+    return epollEvents;
+}
+
+static uint32_t fromEpollEvents(uint32_t epollEvents) {
+    uint32_t events = 0;
+    if (epollEvents & EPOLLIN) {
+        events |= ALooper::EVENT_INPUT;
+    }
+    if (epollEvents & EPOLLOUT) {
+        events |= ALooper::EVENT_OUTPUT;
+    }
+    if (epollEvents & EPOLLERR) {
+        events |= ALooper::EVENT_ERROR;
+    }
+    if (epollEvents & EPOLLHUP) {
+        events |= ALooper::EVENT_HANGUP;
+    }
+    return events;
+}
+
+bool ALooper::initEpollLocked() {
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    int wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    bool ok = epollFd >= 0 && wakeFd >= 0 && timerFd >= 0;
+    if (ok) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeFd;
+        ok = epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev) == 0;
+        ev.data.fd = timerFd;
+        ok = ok && epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev) == 0;
+    }
+    if (!ok) {
+        loge("failed to init epoll for looper %s: %s", mName.c_str(), strerror(errno));
+        for (int fd : {epollFd, wakeFd, timerFd}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        return false;
+    }
+
+    mEpollFd = epollFd;
+    mWakeFd = wakeFd;
+    mTimerFd = timerFd;
+    return true;
+}
+
+bool ALooper::ensureEpollLocked() {
+    if (mEpollFd >= 0) {
+        return true;
+    }
+    if (!initEpollLocked()) {
+        return false;
+    }
+    //looper可能正在条件变量上等待，唤醒后改为在epoll上等待
+    mQueueChangedCondition.notify_one();
+    return true;
+}
+
+status_t ALooper::addFd(int fd, uint32_t events, const sp<AHandler> &handler) {
+    if (fd < 0 || handler == NULL) {
+        return INVALID_OPERATION;
+    }
+    //回调与handler的消息在同一个线程上执行
+    if (handler->getLooper().lock().get() != this) {
+        return INVALID_OPERATION;
+    }
+
+    Autolock l(mLock);
+    if (!ensureEpollLocked()) {
+        return INVALID_OPERATION;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = toEpollEvents(events);
+    ev.data.fd = fd;
+    bool exists = mFdHandlers.find(fd) != mFdHandlers.end();
+    if (epoll_ctl(mEpollFd, exists ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) != 0) {
+        loge("failed to add fd %d to looper %s: %s", fd, mName.c_str(), strerror(errno));
+        return INVALID_OPERATION;
+    }
+    mFdHandlers[fd] = handler;
+    return OK;
+}
+
+status_t ALooper::removeFd(int fd) {
+    Autolock l(mLock);
+    auto it = mFdHandlers.find(fd);
+    if (it == mFdHandlers.end()) {
+        return NOT_FOUND;
+    }
+    mFdHandlers.erase(it);
+    //fd可能已经被关闭，此时内核已经自动移除
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, NULL);
+    return OK;
+}
+
+//deadlineUs：大于0时为下一条消息到期的时间，通过timerfd唤醒
+//wait：是否等待，为false时只处理已就绪的fd
+//返回false表示looper在回调中被析构
+bool ALooper::pollFds(int64_t deadlineUs, bool wait) {
+    int timeoutMs = wait ? -1 : 0;
+    //同一个到期时间只设置一次；不再需要的定时最多引起一次多余的唤醒
+    if (deadlineUs > 0 && deadlineUs != mTimerDeadlineUs) {
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = deadlineUs / 1000000;
+        spec.it_value.tv_nsec = deadlineUs % 1000000 * 1000;
+        if (timerfd_settime(mTimerFd, TFD_TIMER_ABSTIME, &spec, NULL) == 0) {
+            mTimerDeadlineUs = deadlineUs;
+        } else {
+            logw("failed to set timer for looper %s: %s", mName.c_str(), strerror(errno));
+            timeoutMs = wait ? 1 : 0;
+        }
+    }
+
+    static const int kMaxEvents = 16;
+    struct epoll_event events[kMaxEvents];
+    int n = epoll_wait(mEpollFd, events, kMaxEvents, timeoutMs);
+    if (n < 0) {
+        if (errno != EINTR) {
+            logw("epoll_wait failed on looper %s: %s", mName.c_str(), strerror(errno));
+        }
+        return true;
+    }
+
+    struct Ready {
+        int mFd;
+        uint32_t mEvents;
+        sp<AHandler> mHandler;
+    };
+    Ready ready[kMaxEvents];
+    int numReady = 0;
+    vector<IoCompletion> completions;
+    {
+        Autolock l(mLock);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u64 & kIoTag) {
+                //异步I/O的fd已就绪，在looper线程上执行
+                Autolock io(mIoLock);
+                auto it = mIoRequests.find(events[i].data.u64 & ~kIoTag);
+                if (it != mIoRequests.end()) {
+                    completions.push_back(IoCompletion{it->second, 0});
+                    mIoRequests.erase(it);
+                }
+                continue;
+            }
+
+            int fd = (int)events[i].data.u64;
+            uint64_t value;
+            if (fd == mWakeFd || fd == mTimerFd) {
+                if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                    logw("failed to read fd %d on looper %s: %s", fd, mName.c_str(), strerror(errno));
+                }
+                if (fd == mTimerFd) {
+                    mTimerDeadlineUs = 0;
+                }
+                continue;
+            }
+
+            auto it = mFdHandlers.find(fd);
+            if (it == mFdHandlers.end()) {
+                continue;
+            }
+            sp<AHandler> handler = it->second.lock();
+            if (handler == NULL) {
+                mFdHandlers.erase(it);
+                epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, NULL);
+                continue;
+            }
+            ready[numReady].mFd = fd;
+            ready[numReady].mEvents = fromEpollEvents(events[i].events);
+            ready[numReady].mHandler = handler;
+            ++numReady;
+        }
+    }
+
+    for (auto &completion : completions) {
+        IoRequest &request = completion.mRequest;
+        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, request.mDupFd, NULL);
+        close(request.mDupFd);
+        completion.mResult = performIo(request);
+    }
+    if (!completions.empty() && !completeIo(&completions)) {
+        return false;
+    }
+    if (numReady == 0) {
+        return true;
+    }
+
+    //与loop()相同，回调中可能释放looper的最后一个引用
+    sp<ALooper> self = mSelf.lock();
+    if (self == NULL) {
+        return false;
+    }
+    for (int i = 0; i < numReady; i++) {
+        //之前的回调可能已经移除了fd或换了handler
+        if (i > 0 && !isFdHandler(ready[i].mFd, ready[i].mHandler)) {
+            ready[i].mHandler.reset();
+            continue;
+        }
+        ready[i].mHandler->onFdEvent(ready[i].mFd, ready[i].mEvents);
+        ready[i].mHandler.reset();
+    }
+
+    tDestroyedLooper = NULL;
+    ALooper *looper = this;
+    self.reset();
+    return tDestroyedLooper != looper;
+}
+
+bool ALooper::isFdHandler(int fd, const sp<AHandler> &handler) {
+    Autolock l(mLock);
+    auto it = mFdHandlers.find(fd);
+    return it != mFdHandlers.end() && it->second.lock() == handler;
+}
+
+bool ALooper::waitEvents(int64_t deadlineUs, bool wait) {
+    return mRing != NULL ? ringWait(deadlineUs, wait) : pollFds(deadlineUs, wait);
+}
+
+status_t ALooper::enableIoUring(unsigned entries) {
+    Autolock l(mLock);
+    if (mRun || mRing != NULL) {
+        return INVALID_OPERATION;
+    }
+    std::unique_ptr<IoRing> ring(new IoRing);
+    if (!ring->init(std::max(entries, 8u))) {
+        return INVALID_OPERATION;
+    }
+    //eventfd用于唤醒，epoll fd用于addFd()，都通过ring等待；定时改用ring的timeout
+    if (!ensureEpollLocked()) {
+        return INVALID_OPERATION;
+    }
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, mWakeFd, NULL);
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, mTimerFd, NULL);
+    mRing = std::move(ring);
+    return OK;
+}
+
+bool ALooper::isIoUringEnabled() const {
+    return mRing != NULL;
+}
+
+int ALooper::getWakeFd() {
+    Autolock l(mLock);
+    if (!ensureEpollLocked()) {
+        return -1;
+    }
+    return mRing != NULL ? mRing->mFd : mEpollFd;
+}
+
+//参数同pollFds()。提交looper线程上积累的请求，等待并处理完成的请求
+bool ALooper::ringWait(int64_t deadlineUs, bool wait) {
+    IoRing *ring = mRing.get();
+    unsigned toSubmit;
+    {
+        Autolock l(mIoLock);
+        struct io_uring_sqe *sqe;
+        if (!ring->mWakeArmed && (sqe = ring->prepare(IORING_OP_POLL_ADD, mWakeFd, kWakeTag)) != NULL) {
+            sqe->poll32_events = POLLIN;
+            ring->commit();
+            ring->mWakeArmed = true;
+        }
+        if (!ring->mEpollArmed && (sqe = ring->prepare(IORING_OP_POLL_ADD, mEpollFd, kEpollTag)) != NULL) {
+            sqe->poll32_events = POLLIN;
+            ring->commit();
+            ring->mEpollArmed = true;
+        }
+        //同一个到期时间只设置一次，改变时先移除之前的定时
+        if (deadlineUs > 0 && deadlineUs != ring->mTimeoutDeadlineUs) {
+            if (ring->mTimeoutID != 0 && (sqe = ring->prepare(IORING_OP_TIMEOUT_REMOVE, -1, kIgnoreTag)) != NULL) {
+                sqe->addr = ring->mTimeoutID;
+                ring->commit();
+            }
+            uint64_t timeoutID = kTimeoutTag | ++ring->mTimeoutSeq;
+            if ((sqe = ring->prepare(IORING_OP_TIMEOUT, -1, timeoutID)) != NULL) {
+                ring->mTimeout.tv_sec = deadlineUs / 1000000;
+                ring->mTimeout.tv_nsec = deadlineUs % 1000000 * 1000;
+                sqe->addr = (uint64_t)(uintptr_t)&ring->mTimeout;
+                sqe->len = 1;
+                sqe->timeout_flags = IORING_TIMEOUT_ABS;
+                ring->commit();
+                ring->mTimeoutID = timeoutID;
+                ring->mTimeoutDeadlineUs = deadlineUs;
+            }
+        }
+        toSubmit = ring->pending();
+    }
+
+    //没有要提交的请求时，不等待的情况下直接从完成队列读取，不进入内核
+    wait = wait && ring->mWakeArmed;
+    if (wait || toSubmit > 0) {
+        if (ring->enter(toSubmit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0) < 0) {
+            logw("io_uring_enter failed on looper %s: %s", mName.c_str(), strerror(errno));
+        }
+    }
+
+    bool epollReady = false;
+    vector<IoCompletion> completions;
+    ring->reap([&](uint64_t userData, int32_t res) {
+        if (userData & kIoTag) {
+            Autolock l(mIoLock);
+            auto it = mIoRequests.find(userData & ~kIoTag);
+            if (it != mIoRequests.end()) {
+                completions.push_back(IoCompletion{it->second, res});
+                mIoRequests.erase(it);
+            }
+        } else if (userData == kWakeTag) {
+            uint64_t value;
+            if (read(mWakeFd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+                logw("failed to read wake fd on looper %s: %s", mName.c_str(), strerror(errno));
+            }
+            ring->mWakeArmed = false;
+        } else if (userData == kEpollTag) {
+            epollReady = true;
+            ring->mEpollArmed = false;
+        } else if (userData == ring->mTimeoutID) {
+            //定时到期或被移除
+            ring->mTimeoutID = 0;
+            ring->mTimeoutDeadlineUs = 0;
+        }
+    });
+
+    if (!completions.empty() && !completeIo(&completions)) {
+        return false;
+    }
+    return !epollReady || pollFds(0, false);
+}
+
+status_t ALooper::submitRead(int fd, const sp<ABuffer> &buffer, int64_t offset, const sp<AMessage> &notify) {
+    IoRequest request{kIoRead, fd, -1, offset, buffer, notify, IoCallback()};
+    return submitIo(request);
+}
+
+status_t ALooper::submitRead(int fd, const sp<ABuffer> &buffer, int64_t offset, const IoCallback &callback) {
+    IoRequest request{kIoRead, fd, -1, offset, buffer, sp<AMessage>(), callback};
+    return submitIo(request);
+}
+
+status_t ALooper::submitWrite(int fd, const sp<ABuffer> &buffer, int64_t offset, const sp<AMessage> &notify) {
+    IoRequest request{kIoWrite, fd, -1, offset, buffer, notify, IoCallback()};
+    return submitIo(request);
+}
+
+status_t ALooper::submitWrite(int fd, const sp<ABuffer> &buffer, int64_t offset, const IoCallback &callback) {
+    IoRequest request{kIoWrite, fd, -1, offset, buffer, sp<AMessage>(), callback};
+    return submitIo(request);
+}
+
+status_t ALooper::submitAccept(int fd, const sp<AMessage> &notify) {
+    IoRequest request{kIoAccept, fd, -1, -1, sp<ABuffer>(), notify, IoCallback()};
+    return submitIo(request);
+}
+
+status_t ALooper::submitAccept(int fd, const IoCallback &callback) {
+    IoRequest request{kIoAccept, fd, -1, -1, sp<ABuffer>(), sp<AMessage>(), callback};
+    return submitIo(request);
+}
+
+status_t ALooper::submitIo(IoRequest &request) {
+    if (request.mFd < 0 || (request.mOp != kIoAccept && request.mBuffer == NULL)
+            || (request.mNotify == NULL && !request.mCallback)) {
+        return INVALID_OPERATION;
+    }
+
+    if (mRing != NULL) {
+        IoRing *ring = mRing.get();
+        Autolock l(mIoLock);
+        uint64_t id = ++mNextIoID;
+        struct io_uring_sqe *sqe = ring->prepare(
+            request.mOp == kIoRead ? IORING_OP_READ : request.mOp == kIoWrite ? IORING_OP_WRITE : IORING_OP_ACCEPT,
+            request.mFd, kIoTag | id);
+        if (sqe == NULL) {
+            return INVALID_OPERATION;
+        }
+        if (request.mOp == kIoRead) {
+            sqe->addr = (uint64_t)(uintptr_t)request.mBuffer->base();
+            sqe->len = (uint32_t)request.mBuffer->capacity();
+            sqe->off = (uint64_t)request.mOffset;
+        } else if (request.mOp == kIoWrite) {
+            sqe->addr = (uint64_t)(uintptr_t)request.mBuffer->data();
+            sqe->len = (uint32_t)request.mBuffer->size();
+            sqe->off = (uint64_t)request.mOffset;
+        } else {
+            sqe->accept_flags = SOCK_CLOEXEC;
+        }
+        ring->commit();
+        mIoRequests[id] = request;
+
+        //looper线程上的请求留到这一轮结束时一起提交，其他线程立即提交
+        if (tLoopingLooper != this && ring->enter(ring->pending(), 0, 0) < 0) {
+            logw("io_uring_enter failed on looper %s: %s", mName.c_str(), strerror(errno));
+        }
+        return OK;
+    }
+
+    //没有io_uring时，在epoll中等待fd就绪。同一个fd可能同时有多个请求或已经addFd()，所以监听它的副本
+    {
+        Autolock l(mLock);
+        if (!ensureEpollLocked()) {
+            return INVALID_OPERATION;
+        }
+    }
+    int dupFd = fcntl(request.mFd, F_DUPFD_CLOEXEC, 0);
+    if (dupFd < 0) {
+        return INVALID_OPERATION;
+    }
+    {
+        Autolock l(mIoLock);
+        uint64_t id = ++mNextIoID;
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = (request.mOp == kIoWrite ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+        ev.data.u64 = kIoTag | id;
+        if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, dupFd, &ev) == 0) {
+            request.mDupFd = dupFd;
+            mIoRequests[id] = request;
+            return OK;
+        }
+    }
+    int err = errno;
+    close(dupFd);
+    if (err != EPERM) {
+        loge("failed to submit io on fd %d: %s", request.mFd, strerror(err));
+        return INVALID_OPERATION;
+    }
+
+    //普通文件不支持epoll，总是就绪，直接执行后交给looper线程回调
+    IoCompletion completion{request, performIo(request)};
+    {
+        Autolock l(mIoLock);
+        mIoCompletions.push_back(completion);
+        mHasIoCompletions = true;
+    }
+    Autolock l(mLock);
+    wakeLocked();
+    return OK;
+}
+
+int32_t ALooper::performIo(const IoRequest &request) {
+    ssize_t n;
+    if (request.mOp == kIoRead) {
+        ABuffer *buffer = request.mBuffer.get();
+        n = request.mOffset < 0 ? read(request.mFd, buffer->base(), buffer->capacity())
+            : pread(request.mFd, buffer->base(), buffer->capacity(), request.mOffset);
+    } else if (request.mOp == kIoWrite) {
+        ABuffer *buffer = request.mBuffer.get();
+        n = request.mOffset < 0 ? write(request.mFd, buffer->data(), buffer->size())
+            : pwrite(request.mFd, buffer->data(), buffer->size(), request.mOffset);
+    } else {
+        n = accept4(request.mFd, NULL, NULL, SOCK_CLOEXEC);
+    }
+    return n < 0 ? -errno : (int32_t)n;
+}
+
+bool ALooper::processIoCompletions() {
+    vector<IoCompletion> completions;
+    {
+        Autolock l(mIoLock);
+        completions.swap(mIoCompletions);
+        mHasIoCompletions = false;
+    }
+    return completions.empty() || completeIo(&completions);
+}
+
+//在looper线程上回调或post通知消息。返回false表示looper在回调中被析构
+bool ALooper::completeIo(vector<IoCompletion> *completions) {
+    sp<ALooper> self = mSelf.lock();
+    if (self == NULL) {
+        return false;
+    }
+    for (auto &completion : *completions) {
+        IoRequest &request = completion.mRequest;
+        if (request.mOp == kIoRead && completion.mResult >= 0) {
+            request.mBuffer->setRange(0, completion.mResult);
+        }
+        if (request.mCallback) {
+            request.mCallback(completion.mResult);
+        } else {
+            request.mNotify->setInt32("result", completion.mResult);
+            if (request.mBuffer != NULL) {
+                request.mNotify->setBuffer("buffer", request.mBuffer);
+            }
+            request.mNotify->post();
+        }
+    }
+    completions->clear();
+
+    tDestroyedLooper = NULL;
+    ALooper *looper = this;
+    self.reset();
+    return tDestroyedLooper != looper;
+}
+
+//析构时取消还未完成的请求。io_uring的请求要等内核返回后才能释放buffer
+void ALooper::cancelIo() {
+    if (mRing == NULL) {
+        for (auto &it : mIoRequests) {
+            close(it.second.mDupFd);
+        }
+        mIoRequests.clear();
+        return;
+    }
+
+    IoRing *ring = mRing.get();
+    {
+        Autolock l(mIoLock);
+        for (auto &it : mIoRequests) {
+            struct io_uring_sqe *sqe = ring->prepare(IORING_OP_ASYNC_CANCEL, -1, kIgnoreTag);
+            if (sqe != NULL) {
+                sqe->addr = kIoTag | it.first;
+                ring->commit();
+            }
+        }
+    }
+    while (!mIoRequests.empty()) {
+        if (ring->enter(ring->pending(), 1, IORING_ENTER_GETEVENTS) < 0) {
+            logw("failed to cancel io on looper %s: %s", mName.c_str(), strerror(errno));
+            break;
+        }
+        ring->reap([this](uint64_t userData, int32_t) {
+            if (userData & kIoTag) {
+                mIoRequests.erase(userData & ~kIoTag);
+            }
+        });
+    }
+}
+#endif
+
+status_t ALooper::migrateHandler(handler_id handlerID, const sp<ALooper> &target) {
+    if (target == NULL || target.get() == this) {
+        return INVALID_OPERATION;
+    }
+
+    {
+        Autolock l(mHandlersLock);
+        if (mHandlers.find(handlerID) == mHandlers.end()) {
+            return NOT_FOUND;
+        }
+    }
+
+    {
+        Autolock l(mLock);
+        if (mRun) {
+            //交给looper线程在两条消息之间执行，保证迁移时该handler不在处理消息
+            mMigrations.push_back(Migration{handlerID, target});
+            mHasMigrations = true;
+            wakeLocked();
+            return OK;
+        }
+    }
+
+    return doMigrateHandler(handlerID, target, NULL) ? OK : NOT_FOUND;
+}
+
+size_t ALooper::getQueueDepth() {
+    Autolock l(mLock);
+    return mEventQueue.size();
+}
+
+void ALooper::processMigrations(std::list<Event> *batch) {
+    std::vector<Migration> migrations;
+    {
+        Autolock l(mLock);
+        migrations.swap(mMigrations);
+        mHasMigrations = false;
+    }
+
+    for (auto &migration : migrations) {
+        if (!doMigrateHandler(migration.mHandlerID, migration.mTarget, batch)) {
+            logw("failed to migrate handler %lld from looper %s", (long long)migration.mHandlerID, mName.c_str());
+        }
+    }
+}
+
+bool ALooper::doMigrateHandler(handler_id handlerID, const sp<ALooper> &target, std::list<Event> *batch) {
+    sp<AHandler> handler;
+
+    //两个looper互相迁移时，std::lock保证不会死锁
+    std::unique_lock<std::mutex> l1(mLock, std::defer_lock);
+    std::unique_lock<std::mutex> l2(target->mLock, std::defer_lock);
+    std::lock(l1, l2);
+
+    if (!ALooperRoster::instance().rebindHandler(handlerID, this, target, &handler)) {
+        return false;
+    }
+
+    //按原有顺序把该handler还未处理的消息转到目标looper
+    std::list<Event> moved;
+    auto extract = [handlerID, &moved](std::list<Event> &events) {
+        auto it = events.begin();
+        while (it != events.end()) {
+            auto next = it;
+            ++next;
+            if ((*it).mMessage->mTarget == handlerID) {
+                moved.splice(moved.end(), events, it);
+            }
+            it = next;
+        }
+    };
+    if (batch != NULL) {
+        extract(*batch);
+    }
+    extract(mEventQueue);
+
+    //持久化记录随消息一起迁移，由目标looper派发后标记完成
+    for (auto &event : moved) {
+        target->insertEventLocked(event);
+    }
+    return true;
+}
+
+handler_id ALooper::getBusiestHandler(size_t *pending) {
+    unordered_map<handler_id, size_t> counts;
+    {
+        Autolock l(mLock);
+        for (auto &event : mEventQueue) {
+            counts[event.mMessage->mTarget]++;
+        }
+    }
+
+    handler_id busiest = INVALID_HANDLER_ID;
+    size_t max = 0;
+    for (auto &it : counts) {
+        if (it.first != INVALID_HANDLER_ID && it.second > max) {
+            busiest = it.first;
+            max = it.second;
+        }
+    }
+    *pending = max;
+    return busiest;
+}
+
+size_t ALooper::countHandlers() {
+    Autolock l(mHandlersLock);
+    return mHandlers.size();
+}
+
+//发往本looper的handler，且setTarget()之后handler没有迁移过时，直接使用消息中的handler，
+//不需要查注册表；否则不加锁地在注册表中查找。两条路径都要lock()一次handler的weak_ptr
+sp<AHandler> ALooper::resolveHandler(const sp<AMessage> &msg, const sp<ALooper> &self) {
+    handler_id target = msg->mTarget;
+    if (target == INVALID_HANDLER_ID) {
+        return NULL;
+    }
+    bool cached = !msg->mLooper.owner_before(self) && !self.owner_before(msg->mLooper);
+    if (cached) {
+        sp<AHandler> handler = msg->mHandler.lock();
+        if (handler != NULL && handler->id() == target
+                && handler->mMigrations.load(std::memory_order_acquire) == msg->mMigrations) {
+            return handler;
+        }
+    }
+    return ALooperRoster::instance().findHandler(target, self);
+}
+
+
+ALooperBalancer::ALooperBalancer(const vector<sp<ALooper>> &loopers, size_t threshold)
+    : mLoopers(loopers.begin(), loopers.end()),
+    mThreshold(threshold),
+    mGeneration(0),
+    mIntervalUs(0) {
+}
+
+handler_id ALooperBalancer::rebalance() {
+    sp<ALooper> hottest, coldest;
+    size_t maxDepth = 0, minDepth = SIZE_MAX;
+    for (auto &weak : mLoopers) {
+        sp<ALooper> looper = weak.lock();
+        if (looper == NULL) {
+            continue;
+        }
+
+        size_t depth = looper->getQueueDepth();
+        if (hottest == NULL || depth > maxDepth) {
+            hottest = looper;
+            maxDepth = depth;
+        }
+        if (coldest == NULL || depth < minDepth) {
+            coldest = looper;
+            minDepth = depth;
+        }
+    }
+
+    if (hottest == NULL || hottest == coldest || maxDepth - minDepth <= mThreshold) {
+        return INVALID_HANDLER_ID;
+    }
+
+    //只有一个handler时，迁移只是把热点换了个地方
+    if (hottest->countHandlers() < 2) {
+        return INVALID_HANDLER_ID;
+    }
+
+    size_t pending = 0;
+    handler_id busiest = hottest->getBusiestHandler(&pending);
+    if (busiest == INVALID_HANDLER_ID || hottest->migrateHandler(busiest, coldest) != OK) {
+        return INVALID_HANDLER_ID;
+    }
+
+    logi("migrate handler %lld (%zu pending) from %s to %s",
+        (long long)busiest, pending, hottest->getName(), coldest->getName());
+    return busiest;
+}
+
+status_t ALooperBalancer::start(int64_t intervalUs) {
+    if (id() == INVALID_HANDLER_ID) {
+        return NOT_FOUND;
+    }
+
+    mIntervalUs = intervalUs;
+    auto msg = AMessage::create(kWhatRebalance, id());
+    msg->setInt32("generation", ++mGeneration);
+    return msg->post(mIntervalUs);
+}
+
+void ALooperBalancer::stop() {
+    ++mGeneration;
+}
+
+void ALooperBalancer::onMessageReceived(const sp<AMessage> &msg) {
+    switch (msg->what()) {
+        case kWhatRebalance:{
+            int32_t generation = 0;
+            if (!msg->findInt32("generation", &generation) || generation != mGeneration) {
+                break;
+            }
+
+            rebalance();
+            msg->post(mIntervalUs);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+//全局的名字intern表。按hash分片加锁，减少不同线程之间的竞争；
+//每个线程另外缓存最近intern过的名字指针，字符串字面量这种地址固定的名字命中缓存时不需要加锁。
+//表中的名字不会释放：AKey总是intern，通过const char*设置或从wire读到的名字在表满后不再加入，
+//由item自己保存一份，避免动态生成的名字使表无限增长
+class AKeyTable {
+public:
+    //force为false且表已满时返回NULL
+    const char *intern(const char *name, size_t len, uint32_t hash, bool force) {
+        CacheEntry &cached = tCache[((uintptr_t)name >> 3) % kCacheSize];
+        if (cached.mKey == name && cached.mLength == len && !memcmp(cached.mInterned, name, len)) {
+            return cached.mInterned;
+        }
+
+        Shard &shard = mShards[hash % kShards];
+        const char *interned;
+        {
+            Autolock l(shard.mLock);
+            auto it = shard.mNames.find(Name{name, len, hash});
+            if (it != shard.mNames.end()) {
+                interned = it->mStr;
+            } else if (!force && mCount.load(std::memory_order_relaxed) >= kMaxNames) {
+                return NULL;
+            } else {
+                mCount.fetch_add(1, std::memory_order_relaxed);
+                char *str = new char[len + 1];
+                memcpy(str, name, len);
+                str[len] = '\0';
+                shard.mNames.insert(Name{str, len, hash});
+                interned = str;
+            }
+        }
+
+        cached.mKey = name;
+        cached.mLength = len;
+        cached.mInterned = interned;
+        return interned;
+    }
+
+    static AKeyTable &instance() {
+        //不析构，保证静态对象析构时仍可使用
+        static AKeyTable *table = new AKeyTable;
+        return *table;
+    }
+
+private:
+    enum {
+        kShards = 16,
+        kCacheSize = 64,
+        kMaxNames = 16384,
+    };
+
+    AKeyTable() : mCount(0) {}
+
+    struct Name {
+        const char *mStr;
+        size_t mLength;
+        uint32_t mHash;
+    };
+    struct NameHash {
+        size_t operator()(const Name &name) const { return name.mHash; }
+    };
+    struct NameEqual {
+        bool operator()(const Name &a, const Name &b) const {
+            return a.mLength == b.mLength && !memcmp(a.mStr, b.mStr, a.mLength);
+        }
+    };
+
+    struct Shard {
+        mutex mLock;
+        unordered_set<Name, NameHash, NameEqual> mNames;
+    };
+    Shard mShards[kShards];
+    std::atomic<size_t> mCount;
+
+    struct CacheEntry {
+        const char *mKey;
+        size_t mLength;
+        const char *mInterned;
+    };
+    static thread_local CacheEntry tCache[kCacheSize];
+};
+
+thread_local AKeyTable::CacheEntry AKeyTable::tCache[AKeyTable::kCacheSize];
+
+const char *AKey::intern(const char *name, size_t len, uint32_t hash) {
+    return AKeyTable::instance().intern(name, len, hash, true);
+}
+
+const char *AKey::tryIntern(const char *name, size_t len, uint32_t hash) {
+    return AKeyTable::instance().intern(name, len, hash, false);
+}
+
+//与Hash()结果相同，同时得到名字的长度
+uint32_t AKey::hashName(const char *name, size_t *len) {
+    uint32_t hash = 2166136261u;
+    const char *p = name;
+    for (; *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+    *len = p - name;
+    return hash;
+}
+
+AKey::AKey(const char *name) {
+    mHash = hashName(name, &mLength);
+    mName = intern(name, mLength, mHash);
+}
+
+AKey::AKey(const char *name, uint32_t hash)
+    : mLength(strlen(name)),
+    mHash(hash) {
+    mName = intern(name, mLength, mHash);
+}
+
+ABuffer::ABuffer(const sp<void> &storage, uint8_t *base, size_t capacity)
+    : mStorage(storage),
+    mBase(base),
+    mCapacity(capacity),
+    mRangeOffset(0),
+    mRangeLength(capacity) {
+}
+
+//供allocate_shared使用：控制块、ABuffer和数据在同一次分配中，数据紧跟在控制块后面
+template<class T>
+class BufferAllocator {
+public:
+    typedef T value_type;
+
+    BufferAllocator(size_t extra, uint8_t **data)
+        : mExtra(extra),
+        mData(data) {
+    }
+
+    template<class U>
+    BufferAllocator(const BufferAllocator<U> &other)
+        : mExtra(other.mExtra),
+        mData(other.mData) {
+    }
+
+    T *allocate(size_t n) {
+        uint8_t *p = static_cast<uint8_t *>(::operator new(n * sizeof(T) + mExtra));
+        *mData = p + n * sizeof(T);
+        return reinterpret_cast<T *>(p);
+    }
+
+    void deallocate(T *p, size_t) {
+        ::operator delete(p);
+    }
+
+    template<class U, class... Args>
+    void construct(U *p, Args&&... args) {
+        ::new((void *)p) U(std::forward<Args>(args)...);
+    }
+
+    template<class U>
+    void destroy(U *p) {
+        p->~U();
+    }
+
+    template<class U>
+    struct rebind {
+        typedef BufferAllocator<U> other;
+    };
+
+    size_t mExtra;
+    uint8_t **mData;
+};
+
+template<class T, class U>
+bool operator==(const BufferAllocator<T> &a, const BufferAllocator<U> &b) {
+    return a.mData == b.mData;
+}
+
+template<class T, class U>
+bool operator!=(const BufferAllocator<T> &a, const BufferAllocator<U> &b) {
+    return a.mData != b.mData;
+}
+
+//多分配alignment - 1字节，把数据的起始地址调整到对齐位置
+sp<ABuffer> ABuffer::create(size_t capacity, size_t alignment) {
+    if (alignment & (alignment - 1)) {
+        loge("buffer alignment %zu is not a power of 2", alignment);
+        return sp<ABuffer>();
+    }
+    size_t extra = alignment > 0 ? alignment - 1 : 0;
+    if (capacity > SIZE_MAX / 2 - extra) {
+        return sp<ABuffer>();
+    }
+
+    uint8_t *data = NULL;
+    sp<ABuffer> buffer = allocate_shared<ABuffer>(BufferAllocator<ABuffer>(capacity + extra, &data),
+        sp<void>(), (uint8_t *)NULL, capacity);
+    uintptr_t addr = reinterpret_cast<uintptr_t>(data);
+    if (alignment > 0) {
+        addr = (addr + extra) & ~(uintptr_t)extra;
+    }
+    buffer->mBase = reinterpret_cast<uint8_t *>(addr);
+    return buffer;
+}
+
+sp<ABuffer> ABuffer::wrap(void *data, size_t capacity, const sp<void> &owner) {
+    return sp<ABuffer>(new ABuffer(owner, static_cast<uint8_t *>(data), capacity));
+}
+
+status_t ABuffer::setRange(size_t offset, size_t size) {
+    if (offset > mCapacity || size > mCapacity - offset) {
+        return INVALID_OPERATION;
+    }
+    mRangeOffset = offset;
+    mRangeLength = size;
+    return OK;
+}
+
+sp<ABuffer> ABuffer::slice(size_t offset, size_t size) const {
+    if (offset > mRangeLength || size > mRangeLength - offset) {
+        return sp<ABuffer>();
+    }
+    sp<void> storage = mStorage;
+    if (storage == NULL) {
+        storage = const_pointer_cast<ABuffer>(shared_from_this());
+    }
+    return sp<ABuffer>(new ABuffer(storage, data() + offset, size));
+}
+
+//消息池：每个线程缓存一些释放的消息内存，缓存满时成批交给全局列表，
+//线程缓存为空时再成批取回，这样在A线程创建、在looper线程释放的消息也能回到A线程
+class MessagePool {
+public:
+    enum {
+        //allocate_shared把控制块和消息放在一起分配
+        kBlockSize = sizeof(AMessage) + 4 * sizeof(void *),
+        kLocalCacheSize = 64,
+        kTransferBatch = 32,
+        kGlobalCacheSize = 4096,
+    };
+
+    struct ThreadCache {
+        ThreadCache();
+        ~ThreadCache();
+
+        void *mBlocks[kLocalCacheSize];
+        //只由所在线程修改，统计时其他线程会读取
+        atomic<size_t> mCount;
+        atomic<uint64_t> mObtained;
+        atomic<uint64_t> mHits;
+        atomic<uint64_t> mRefills;
+        atomic<uint64_t> mRecycled;
+    };
+
+    MessagePool()
+        : mRetired() {
+    }
+
+    static MessagePool &instance() {
+        //不析构，静态对象析构时（如全局的消息、looper线程退出）仍可能分配、释放消息
+        static MessagePool *pool = new MessagePool;
+        return *pool;
+    }
+
+    void *allocate();
+    void deallocate(void *block);
+    MessagePoolStats getStats();
+
+private:
+    mutex mLock;
+    vector<void *> mBlocks;
+    vector<ThreadCache *> mCaches;
+    MessagePoolStats mRetired; //已退出线程的统计，以及released
+
+    void refill(ThreadCache *cache);
+    void spill(ThreadCache *cache);
+    void pushGlobal(void *block);
+};
+
+static thread_local MessagePool::ThreadCache tMessageCache;
+//线程退出时tMessageCache析构之后仍可能释放消息，此时直接使用全局列表
+static thread_local bool tMessageCacheGone = false;
+
+static inline void bumpCounter(atomic<uint64_t> &counter) {
+    counter.store(counter.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+MessagePool::ThreadCache::ThreadCache()
+    : mCount(0),
+    mObtained(0),
+    mHits(0),
+    mRefills(0),
+    mRecycled(0) {
+    MessagePool &pool = MessagePool::instance();
+    Autolock _l(pool.mLock);
+    pool.mCaches.push_back(this);
+}
+
+MessagePool::ThreadCache::~ThreadCache() {
+    tMessageCacheGone = true;
+
+    MessagePool &pool = MessagePool::instance();
+    Autolock _l(pool.mLock);
+    auto &caches = pool.mCaches;
+    caches.erase(std::find(caches.begin(), caches.end(), this));
+
+    MessagePoolStats &retired = pool.mRetired;
+    retired.obtained += mObtained;
+    retired.hits += mHits;
+    retired.refills += mRefills;
+    retired.recycled += mRecycled;
+
+    for (size_t i = 0; i < mCount; ++i) {
+        if (pool.mBlocks.size() < kGlobalCacheSize) {
+            pool.mBlocks.push_back(mBlocks[i]);
+        } else {
+            ::operator delete(mBlocks[i]);
+            ++retired.released;
+        }
+    }
+    mCount = 0;
+}
+
+void *MessagePool::allocate() {
+    if (tMessageCacheGone) {
+        Autolock _l(mLock);
+        ++mRetired.obtained;
+        if (!mBlocks.empty()) {
+            ++mRetired.hits;
+            void *block = mBlocks.back();
+            mBlocks.pop_back();
+            return block;
+        }
+        return ::operator new(kBlockSize);
+    }
+
+    ThreadCache *cache = &tMessageCache;
+    bumpCounter(cache->mObtained);
+    if (cache->mCount == 0) {
+        refill(cache);
+    }
+
+    size_t count = cache->mCount.load(memory_order_relaxed);
+    if (count > 0) {
+        bumpCounter(cache->mHits);
+        cache->mCount.store(count - 1, memory_order_relaxed);
+        return cache->mBlocks[count - 1];
+    }
+    return ::operator new(kBlockSize);
+}
+
+void MessagePool::deallocate(void *block) {
+    if (tMessageCacheGone) {
+        Autolock _l(mLock);
+        ++mRetired.recycled;
+        pushGlobal(block);
+        return;
+    }
+
+    ThreadCache *cache = &tMessageCache;
+    if (cache->mCount == kLocalCacheSize) {
+        spill(cache);
+    }
+
+    size_t count = cache->mCount.load(memory_order_relaxed);
+    cache->mBlocks[count] = block;
+    cache->mCount.store(count + 1, memory_order_relaxed);
+    bumpCounter(cache->mRecycled);
+}
+
+void MessagePool::refill(ThreadCache *cache) {
+    Autolock _l(mLock);
+    size_t n = std::min<size_t>(kTransferBatch, mBlocks.size());
+    if (n == 0) {
+        return;
+    }
+    memcpy(cache->mBlocks, &mBlocks[mBlocks.size() - n], n * sizeof(void *));
+    mBlocks.resize(mBlocks.size() - n);
+    cache->mCount.store(n, memory_order_relaxed);
+    bumpCounter(cache->mRefills);
+}
+
+//把最早缓存的一批交给全局列表，保留最近释放的（可能还在cache中）
+void MessagePool::spill(ThreadCache *cache) {
+    Autolock _l(mLock);
+    for (size_t i = 0; i < kTransferBatch; ++i) {
+        pushGlobal(cache->mBlocks[i]);
+    }
+    size_t count = cache->mCount.load(memory_order_relaxed) - kTransferBatch;
+    memmove(cache->mBlocks, cache->mBlocks + kTransferBatch, count * sizeof(void *));
+    cache->mCount.store(count, memory_order_relaxed);
+}
+
+void MessagePool::pushGlobal(void *block) {
+    if (mBlocks.size() < kGlobalCacheSize) {
+        mBlocks.push_back(block);
+    } else {
+        ::operator delete(block);
+        ++mRetired.released;
+    }
+}
+
+MessagePoolStats MessagePool::getStats() {
+    Autolock _l(mLock);
+    MessagePoolStats stats = mRetired;
+    stats.cached = mBlocks.size();
+    for (ThreadCache *cache : mCaches) {
+        stats.obtained += cache->mObtained.load(memory_order_relaxed);
+        stats.hits += cache->mHits.load(memory_order_relaxed);
+        stats.refills += cache->mRefills.load(memory_order_relaxed);
+        stats.recycled += cache->mRecycled.load(memory_order_relaxed);
+        stats.cached += cache->mCount.load(memory_order_relaxed);
+    }
+    return stats;
+}
+
+MessagePoolStats getMessagePoolStats() {
+    return MessagePool::instance().getStats();
+}
+
+//供allocate_shared使用，只有消息和控制块所在的那次分配走消息池
+template<class T>
+class MessageAllocator {
+public:
+    typedef T value_type;
+
+    MessageAllocator() {
+    }
+
+    template<class U>
+    MessageAllocator(const MessageAllocator<U> &) {
+    }
+
+    T *allocate(size_t n) {
+        if (n == 1 && sizeof(T) <= MessagePool::kBlockSize) {
+            return static_cast<T *>(MessagePool::instance().allocate());
+        }
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n) {
+        if (n == 1 && sizeof(T) <= MessagePool::kBlockSize) {
+            MessagePool::instance().deallocate(p);
+        } else {
+            ::operator delete(p);
+        }
+    }
+
+    template<class U, class... Args>
+    void construct(U *p, Args&&... args) {
+        ::new((void *)p) U(std::forward<Args>(args)...);
+    }
+
+    template<class U>
+    void destroy(U *p) {
+        p->~U();
+    }
+
+    template<class U>
+    struct rebind {
+        typedef MessageAllocator<U> other;
+    };
+};
+
+template<class T, class U>
+bool operator==(const MessageAllocator<T> &, const MessageAllocator<U> &) {
+    return true;
+}
+
+template<class T, class U>
+bool operator!=(const MessageAllocator<T> &, const MessageAllocator<U> &) {
+    return false;
+}
+
+AMessage::AMessage()
+    : mWhat(0),
+    mTarget(INVALID_HANDLER_ID),
+    mMigrations(0),
+    mItems(mInlineItems),
+    mHashes(mInlineHashes),
+    mNumItems(0),
+    mCapacity(kInlineItems),
+    mLayout(NULL),
+    mBase(NULL),
+    mNumShadowed(0),
+    mSnapshot(NULL),
+    mArena(NULL),
+    mArenaBlockSize(0) {
+}
+
+AMessage::AMessage(uint32_t what, const sp<AHandler> &handler)
+    : mWhat(what),
+    mMigrations(0),
+    mItems(mInlineItems),
+    mHashes(mInlineHashes),
+    mNumItems(0),
+    mCapacity(kInlineItems),
+    mLayout(NULL),
+    mBase(NULL),
+    mNumShadowed(0),
+    mSnapshot(NULL),
+    mArena(NULL),
+    mArenaBlockSize(0) {
+    setTarget(handler);
+}
+
+sp<AMessage> AMessage::create() {
+    return sp<AMessage>(new AMessage);
+}
+
+sp<AMessage> AMessage::createNull() {
+    return sp<AMessage>();
+}
+
+sp<AMessage> AMessage::obtain() {
+    return allocate_shared<AMessage>(MessageAllocator<AMessage>());
+}
+
+sp<AMessage> AMessage::obtain(uint32_t what, const sp<AHandler> &handler) {
+    return allocate_shared<AMessage>(MessageAllocator<AMessage>(), what, handler);
+}
+
+sp<AMessage> AMessage::obtain(uint32_t what, handler_id target) {
+    sp<AMessage> msg = obtain();
+    msg->mWhat = what;
+    msg->mTarget = target;
+    return msg;
+}
+
+sp<AMessage> AMessage::create(uint32_t what, const sp<AHandler> &handler) {
+    return sp<AMessage>(new AMessage(what, handler));
+}
+
+sp<AMessage> AMessage::create(uint32_t what, handler_id target) {
+    sp<AMessage> msg(new AMessage);
+    msg->mWhat = what;
+    msg->mTarget = target;
+    return msg;
+}
+
+void AMessage::setWhat(uint32_t what) {
+    mWhat = what;
+}
+
+uint32_t AMessage::what() const {
+    return mWhat;
+}
+
+handler_id AMessage::target() const {
+    return mTarget;
+}
+
+void AMessage::setTarget(const sp<AHandler> &handler) {
+    if (handler == NULL) {
+        mTarget = INVALID_HANDLER_ID;
+        mHandler.reset();
+        mLooper.reset();
+        mMigrations = 0;
+    } else {
+        mTarget = handler->id();
+        mHandler = wp<AHandler>(handler);
+        mLooper = handler->getLooper(&mMigrations);
+    }
+}
+
+void AMessage::setTarget(handler_id target) {
+    mTarget = target;
+    mHandler.reset();
+    mLooper.reset();
+    mMigrations = 0;
+}
+
+//setTarget()之后handler没有迁移过时直接使用缓存的looper，否则以注册表中的为准
+sp<ALooper> AMessage::getTargetLooper() const {
+    sp<ALooper> looper;
+    if (mTarget != INVALID_HANDLER_ID) {
+        sp<AHandler> handler = mHandler.lock();
+        if (handler != NULL && handler->mMigrations.load(std::memory_order_acquire) == mMigrations) {
+            looper = mLooper.lock();
+        }
+        if (looper == NULL) {
+            looper = ALooperRoster::instance().findLooper(mTarget);
+        }
+    }
+    if (looper == NULL) {
+        looper = mLooper.lock();
+    }
+    return looper;
+}
+
+struct AMessage::ArenaBlock {
+    ArenaBlock *mNext;
+    size_t mSize;
+    size_t mUsed;
+
+    char *data() {
+        return reinterpret_cast<char *>(this + 1);
+    }
+};
+
+void AMessage::clear() {
+    dropSnapshot();
+    for (size_t i = 0; i < mNumItems; ++i) {
+        Item *item = &mItems[i];
+        freeItemName(item);
+        freeItemValue(item);
+    }
+    mNumItems = 0;
+    mNumShadowed = 0;
+    if (mBase != NULL) {
+        releaseShared(mBase);
+        mBase = NULL;
+    }
+
+    //保留最大的一块供重复使用
+    if (mArena != NULL) {
+        freeArena(mArena->mNext);
+        mArena->mNext = NULL;
+        mArena->mUsed = 0;
+    }
+}
+
+void AMessage::enableArena(size_t initialSize) {
+    if (mArenaBlockSize == 0) {
+        mArenaBlockSize = initialSize > 0 ? initialSize : 1;
+    }
+}
+
+char *AMessage::allocateArena(size_t size) {
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (mArena == NULL || mArena->mSize - mArena->mUsed < size) {
+        size_t blockSize = std::max(mArenaBlockSize, size);
+        ArenaBlock *block = static_cast<ArenaBlock *>(
+            ::operator new(sizeof(ArenaBlock) + blockSize));
+        block->mNext = mArena;
+        block->mSize = blockSize;
+        block->mUsed = 0;
+        mArena = block;
+        mArenaBlockSize = blockSize * 2;
+    }
+
+    char *data = mArena->data() + mArena->mUsed;
+    mArena->mUsed += size;
+    return data;
+}
+
+void AMessage::freeArena(ArenaBlock *block) {
+    while (block != NULL) {
+        ArenaBlock *next = block->mNext;
+        ::operator delete(block);
+        block = next;
+    }
+}
+
+//setXXX(name, value), findXXX(name, &value)
+#define BASIC_TYPE_WITH_KEY(NAME,FIELDNAME,TYPENAME,KEYTYPE)            \
+void AMessage::set##NAME(KEYTYPE name, TYPENAME value) {                \
+    Item *item = allocateItem(name);                                    \
+                                                                        \
+    item->mType = kType##NAME;                                          \
+    item->u.FIELDNAME = value;                                          \
+}                                                                       \
+                                                                        \
+bool AMessage::find##NAME(KEYTYPE name, TYPENAME *value) const {        \
+    const Item *item = findItem(name, kType##NAME);                     \
+    if (item) {                                                         \
+        *value = item->u.FIELDNAME;                                     \
+        return true;                                                    \
+    }                                                                   \
+    return false;                                                       \
+}
+
+#define BASIC_TYPE(NAME,FIELDNAME,TYPENAME)                             \
+BASIC_TYPE_WITH_KEY(NAME,FIELDNAME,TYPENAME,const char *)               \
+BASIC_TYPE_WITH_KEY(NAME,FIELDNAME,TYPENAME,const AKey &)
+
+BASIC_TYPE(Int32,int32Value,int32_t)
+BASIC_TYPE(Int64,int64Value,int64_t)
+BASIC_TYPE(Size,sizeValue,size_t)
+BASIC_TYPE(Float,floatValue,float)
+BASIC_TYPE(Double,doubleValue,double)
+BASIC_TYPE(Pointer,ptrValue,void *)
+
+#define OBJECT_AND_STRING_TYPE(KEYTYPE)                                 \
+void AMessage::setObject(KEYTYPE name, const sp<void>& value) {         \
+    Item *item = allocateItem(name);                                    \
+    item->mType = kTypeObject;                                          \
+    new (&item->u.objectValue) sp<void>(value);                         \
+}                                                                       \
+                                                                        \
+void AMessage::setObject(KEYTYPE name, sp<void>&& value) {              \
+    Item *item = allocateItem(name);                                    \
+    item->mType = kTypeObject;                                          \
+    new (&item->u.objectValue) sp<void>(std::move(value));              \
+}                                                                       \
+                                                                        \
+void AMessage::setString(KEYTYPE name, const char *s, ssize_t len) {    \
+    StringValue value;                                                  \
+    buildString(&value, s, len <= 0 ? strlen(s) : len);                 \
+    Item *item = allocateItem(name);                                    \
+    item->mType = kTypeString;                                          \
+    item->u.stringValue = value;                                        \
+}                                                                       \
+                                                                        \
+void AMessage::setString(KEYTYPE name, const std::string &s){           \
+    setString(name, s.data(), s.size());                                \
+}                                                                       \
+                                                                        \
+void AMessage::setString(KEYTYPE name, std::string &&s){                \
+    if (s.size() <= kInlineStringSize) {                                \
+        setString(name, s.data(), s.size());                            \
+        return;                                                         \
+    }                                                                   \
+    auto str = new std::string(std::move(s));                           \
+    Item *item = allocateItem(name);                                    \
+    item->mType = kTypeString;                                          \
+    item->u.stringValue.mHeap = str;                                    \
+    item->u.stringValue.mStorage = kStringHeap;                         \
+}                                                                       \
+                                                                        \
+bool AMessage::findString(KEYTYPE name, std::string *value) const {     \
+    const Item *item = findItem(name, kTypeString);                     \
+    if (item) {                                                         \
+        size_t len;                                                     \
+        const char *s = getStringValue(item, &len);                     \
+        value->assign(s, len);                                          \
+        return true;                                                    \
+    }                                                                   \
+    return false;                                                       \
+}                                                                       \
+                                                                        \
+bool AMessage::findString(KEYTYPE name, const char **value, size_t *len) const {\
+    const Item *item = findItem(name, kTypeString);                     \
+    if (item) {                                                         \
+        size_t length;                                                  \
+        *value = getStringValue(item, &length);                         \
+        if (len != NULL) {                                              \
+            *len = length;                                              \
+        }                                                               \
+        return true;                                                    \
+    }                                                                   \
+    return false;                                                       \
+}                                                                       \
+                                                                        \
+void AMessage::setBuffer(KEYTYPE name, const sp<ABuffer> &buffer) {     \
+    Item *item = allocateItem(name);                                    \
+    item->mType = kTypeBuffer;                                          \
+    new (&item->u.objectValue) sp<void>(buffer);                        \
+}                                                                       \
+                                                                        \
+bool AMessage::findBuffer(KEYTYPE name, sp<ABuffer> *buffer) const {    \
+    const Item *item = findItem(name, kTypeBuffer);                     \
+    if (item) {                                                         \
+        *buffer = *castObject<ABuffer>(objectValue(item));              \
+        return true;                                                    \
+    }                                                                   \
+    return false;                                                       \
+}                                                                       \
+                                                                        \
+void AMessage::setMessage(KEYTYPE name, const sp<AMessage> &msg) {      \
+    Item *item = allocateItem(name);                                    \
+    item->mType = kTypeMessage;                                         \
+    new (&item->u.objectValue) sp<void>(msg);                           \
+}                                                                       \
+                                                                        \
+bool AMessage::findMessage(KEYTYPE name, sp<AMessage> *msg) const {     \
+    const Item *item = findItem(name, kTypeMessage);                    \
+    if (item) {                                                         \
+        *msg = *castObject<AMessage>(objectValue(item));                \
+        return true;                                                    \
+    }                                                                   \
+    return false;                                                       \
+}
+
+//数组保存在对齐的ABuffer中
+#define ARRAY_TYPE_WITH_KEY(NAME,TYPENAME,KEYTYPE)                      \
+void AMessage::set##NAME##Array(KEYTYPE name, const TYPENAME *values, size_t count) {\
+    sp<ABuffer> buffer = copyArray(values, count * sizeof(TYPENAME));   \
+    setArrayValue(allocateItem(name), kType##NAME##Array, std::move(buffer));\
+}                                                                       \
+                                                                        \
+bool AMessage::find##NAME##Array(KEYTYPE name, const TYPENAME **values, size_t *count) const {\
+    const Item *item = findItem(name, kType##NAME##Array);              \
+    if (item) {                                                         \
+        const ABuffer *buffer = castObject<ABuffer>(objectValue(item))->get();\
+        *values = reinterpret_cast<const TYPENAME *>(buffer->data());   \
+        *count = buffer->size() / sizeof(TYPENAME);                     \
+        return true;                                                    \
+    }                                                                   \
+    return false;                                                       \
+}
+
+#define ARRAY_TYPE(NAME,TYPENAME)                                       \
+ARRAY_TYPE_WITH_KEY(NAME,TYPENAME,const char *)                         \
+ARRAY_TYPE_WITH_KEY(NAME,TYPENAME,const AKey &)
+
+ARRAY_TYPE(Int32,int32_t)
+ARRAY_TYPE(Int64,int64_t)
+ARRAY_TYPE(Float,float)
+ARRAY_TYPE(Double,double)
+
+//在allocateItem()之前复制：values可能指向该项原来的数组，allocateItem()会释放它
+sp<ABuffer> AMessage::copyArray(const void *values, size_t size) {
+    sp<ABuffer> buffer = ABuffer::create(size, ABuffer::kSimdAlignment);
+    if (size > 0) {
+        memcpy(buffer->data(), values, size);
+    }
+    return buffer;
+}
+
+void AMessage::setArrayValue(Item *item, Type type, sp<ABuffer> &&buffer) {
+    item->mType = type;
+    new (&item->u.objectValue) sp<void>(std::move(buffer));
+}
+
+OBJECT_AND_STRING_TYPE(const char *)
+OBJECT_AND_STRING_TYPE(const AKey &)
+
+void AMessage::setStringValue(Item *item, const char *s, size_t len) {
+    item->mType = kTypeString;
+    initString(&item->u.stringValue, s, len);
+}
+
+void AMessage::initString(StringValue *stringValue, const char *s, size_t len) {
+    StringValue &value = *stringValue;
+    if (len <= kInlineStringSize) {
+        memcpy(value.mInline, s, len);
+        value.mInline[len] = '\0';
+        value.mLength = (uint8_t)len;
+        value.mStorage = kStringInline;
+    } else {
+        value.mHeap = new std::string(s, len);
+        value.mStorage = kStringHeap;
+    }
+}
+
+void AMessage::storeString(Item *item, const char *s, size_t len) {
+    item->mType = kTypeString;
+    buildString(&item->u.stringValue, s, len);
+}
+
+//启用arena时长字符串复制到arena中。
+//setString()在allocateItem()之前先构造好值：s可能指向该项原来的值（allocateItem()会释放它），
+//或其他item的内联字符串（扩容时会移动）
+void AMessage::buildString(StringValue *value, const char *s, size_t len) {
+    if (mArenaBlockSize == 0 || len <= kInlineStringSize) {
+        initString(value, s, len);
+        return;
+    }
+
+    char *data = allocateArena(len + 1);
+    memcpy(data, s, len);
+    data[len] = '\0';
+    value->mArena.mData = data;
+    value->mArena.mSize = len;
+    value->mStorage = kStringArena;
+}
+
+const char *AMessage::getStringValue(const Item *item, size_t *len) {
+    const StringValue &value = item->u.stringValue;
+    if (value.mStorage == kStringInline) {
+        *len = value.mLength;
+        return value.mInline;
+    }
+    if (value.mStorage == kStringArena) {
+        *len = value.mArena.mSize;
+        return value.mArena.mData;
+    }
+    *len = value.mHeap->size();
+    return value.mHeap->c_str();
+}
+
+bool AMessage::contains(const char *name) const {
+    size_t len;
+    uint32_t hash = AKey::hashName(name, &len);
+    return lookupItem(name, len, hash) != NULL;
+}
+
+bool AMessage::contains(const AKey &key) const {
+    return lookupItem(key) != NULL;
+}
+
+status_t AMessage::post(int64_t delayUs){
+    sp<ALooper> looper = getTargetLooper();
+    if (!looper) {
+        logw("failed to post message as target looper for handler %lld is gone.", (long long)mTarget);
+        return NOT_FOUND;
+    }
+
+    looper->post(shared_from_this(), delayUs);
+    return OK;
+}
+
+// Posts the message to its target and waits for a response (or error)
+// before returning.
+status_t AMessage::postAndAwaitResponse(sp<AMessage> *response){
+    sp<ALooper> looper = getTargetLooper();
+    if (!looper) {
+        logw("failed to post message as target looper for handler %lld is gone.", (long long)mTarget);
+        return NOT_FOUND;
+    }
+
+    sp<AReplyToken> token = looper->createReplyToken();
+    if (!token) {
+        loge("failed to create reply token");
+        return NOT_FOUND;
+    }
+    setObject("replyID", token);
+
+    looper->post(shared_from_this(), 0 /* delayUs */);
+    return looper->awaitResponse(token, response);
+}
+
+// If this returns true, the sender of this message is synchronously
+// awaiting a response and the reply token is consumed from the message
+// and stored into replyID. The reply token must be used to send the response
+// using "postReply" below.
+bool AMessage::senderAwaitsResponse(sp<AReplyToken> *replyToken){
+    bool found = findObject("replyID", replyToken);
+
+    if (!found) {
+        return false;
+    }
+
+    return (*replyToken)!=nullptr;
+}
+
+// Posts the message as a response to a reply token.  A reply token can
+// only be used once. Returns OK if the response could be posted; otherwise,
+// an error.
+status_t AMessage::postReply(const sp<AReplyToken> &replyToken){
+    if (replyToken == nullptr) {
+        logw("failed to post reply to a NULL token");
+        return NOT_FOUND;
+    }
+    if (replyToken->mForward) {
+        Autolock l(replyToken->mForwardLock);
+        if (replyToken->mReplied) {
+            loge("trying to post a duplicate reply");
+            return -EBUSY;
+        }
+        replyToken->mReplied = true;
+        return replyToken->mForward(shared_from_this());
+    }
+    sp<ALooper> looper = replyToken->getLooper();
+    if (looper == NULL) {
+        logw("failed to post reply as target looper is gone.");
+        return NOT_FOUND;
+    }
+    return looper->postReply(replyToken, shared_from_this());
+}
+
+//dup()出来的消息共享同一份只读数据，各自的修改写在自己的items里覆盖共享数据
+struct AMessage::SharedItems {
+    std::atomic<int32_t> mRefs;
+    Item *mItems;
+    uint32_t *mHashes;
+    size_t mNumItems;
+    size_t mNumMessages; // 嵌套消息的数量，dup()时需要逐个dup()
+    ArenaBlock *mArena; // 自己的items移入时一起移入
+};
+
+// Performs a deep-copy of "this", contained messages are in turn "dup'ed".
+// Warning: RefBase items, i.e. "objects" are _not_ copied but only have
+// their refcount incremented.
+sp<AMessage> AMessage::dup() const {
+    auto msg = mLayout != NULL ? mLayout->mCreate() : AMessage::obtain();
+    msg->mWhat = mWhat;
+    msg->mTarget = mTarget;
+    msg->mHandler = mHandler;
+    msg->mLooper = mLooper;
+    msg->mMigrations = mMigrations;
+
+    //独占对象不能复制，共享数据中不会有独占对象
+    for (size_t i = 0; i < mNumItems; ++i) {
+        if (mItems[i].mType == kTypeUnique) {
+            loge("can't dup message %u with unique item %s", mWhat, mItems[i].mName);
+            return AMessage::createNull();
+        }
+    }
+
+    //不修改自己的items：有自己的items时复制出一份只读的快照，缓存到下次修改前，
+    //之后的dup()直接共享。多个线程同时dup()时只有一份快照会被缓存
+    SharedItems *shared = mBase;
+    if (mNumItems > 0) {
+        shared = mSnapshot.load(std::memory_order_acquire);
+        if (shared == NULL) {
+            SharedItems *snapshot = snapshotItems();
+            if (mSnapshot.compare_exchange_strong(shared, snapshot, std::memory_order_acq_rel)) {
+                shared = snapshot;
+            } else {
+                releaseShared(snapshot);
+            }
+        }
+    }
+    if (shared != NULL) {
+        shared->mRefs.fetch_add(1, std::memory_order_relaxed);
+        msg->mBase = shared;
+    }
+
+    //嵌套的消息各自dup()，覆盖共享数据中的同名项
+    if (shared != NULL && shared->mNumMessages > 0) {
+        for (size_t i = 0; i < shared->mNumItems; ++i) {
+            const Item *from = &shared->mItems[i];
+            if (from->mType != kTypeMessage) {
+                continue;
+            }
+            const sp<AMessage> *nested = castObject<AMessage>(objectValue(from));
+            sp<AMessage> copy = *nested != NULL ? (*nested)->dup() : sp<AMessage>();
+            if (*nested != NULL && copy == NULL) {
+                return AMessage::createNull();
+            }
+            Item *to = msg->appendItem(from->mName, from->mNameLength, shared->mHashes[i]);
+            copyItemName(to, from);
+            to->mType = kTypeMessage;
+            new (&to->u.objectValue) sp<void>(std::move(copy));
+        }
+    }
+
+    if (mLayout != NULL) {
+        mLayout->mCopy(msg.get(), this);
+    }
+
+    return msg;
+}
+
+//把共享数据和自己的items复制成新的共享数据，自己保持不变
+AMessage::SharedItems *AMessage::snapshotItems() const {
+    size_t count = mNumItems + (mBase != NULL ? mBase->mNumItems - mNumShadowed : 0);
+    SharedItems *shared = new SharedItems;
+    shared->mRefs = 1;
+    shared->mItems = new Item[count];
+    shared->mHashes = new uint32_t[count];
+    shared->mNumItems = 0;
+    shared->mNumMessages = 0;
+    shared->mArena = NULL;
+
+    forEachItem([shared](const Item *from, uint32_t hash) {
+        Item *to = &shared->mItems[shared->mNumItems];
+        copyItemName(to, from);
+        copyItemValue(to, from);
+        if (to->mType == kTypeMessage) {
+            ++shared->mNumMessages;
+        }
+        shared->mHashes[shared->mNumItems++] = hash;
+    });
+    return shared;
+}
+
+//修改items前调用，丢弃dup()缓存的快照
+void AMessage::dropSnapshot() {
+    if (mSnapshot.load(std::memory_order_relaxed) == NULL) {
+        return;
+    }
+    SharedItems *snapshot = mSnapshot.exchange(NULL, std::memory_order_acq_rel);
+    if (snapshot != NULL) {
+        releaseShared(snapshot);
+    }
+}
+
+//把共享数据和自己的items合并成新的共享数据，自己的items直接移入，不复制
+void AMessage::shareItems() {
+    size_t count = mNumItems + (mBase != NULL ? mBase->mNumItems - mNumShadowed : 0);
+    SharedItems *shared = new SharedItems;
+    shared->mRefs = 1;
+    shared->mItems = new Item[count];
+    shared->mHashes = new uint32_t[count];
+    shared->mNumItems = 0;
+    shared->mArena = mArena;
+    mArena = NULL;
+
+    if (mBase != NULL) {
+        for (size_t i = 0; i < mBase->mNumItems; ++i) {
+            const Item *from = &mBase->mItems[i];
+            Item *to = &shared->mItems[shared->mNumItems];
+            size_t own = mNumShadowed > 0
+                ? findInternedIndex(mItems, mHashes, mNumItems, from->mName, mBase->mHashes[i])
+                : mNumItems;
+            if (own < mNumItems) {
+                //被覆盖的保持原来的位置
+                memcpy(to, &mItems[own], sizeof(Item));
+                mItems[own].mName = NULL;
+            } else {
+                copyItemName(to, from);
+                copyItemValue(to, from);
+            }
+            shared->mHashes[shared->mNumItems++] = mBase->mHashes[i];
+        }
+        releaseShared(mBase);
+    }
+
+    for (size_t i = 0; i < mNumItems; ++i) {
+        if (mItems[i].mName != NULL) {
+            memcpy(&shared->mItems[shared->mNumItems], &mItems[i], sizeof(Item));
+            shared->mHashes[shared->mNumItems++] = mHashes[i];
+        }
+    }
+
+    shared->mNumMessages = 0;
+    for (size_t i = 0; i < shared->mNumItems; ++i) {
+        if (shared->mItems[i].mType == kTypeMessage) {
+            ++shared->mNumMessages;
+        }
+    }
+
+    mNumItems = 0;
+    mNumShadowed = 0;
+    mBase = shared;
+}
+
+void AMessage::releaseShared(SharedItems *shared) {
+    if (shared->mRefs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    for (size_t i = 0; i < shared->mNumItems; ++i) {
+        freeItemName(&shared->mItems[i]);
+        freeItemValue(&shared->mItems[i]);
+    }
+    delete[] shared->mItems;
+    delete[] shared->mHashes;
+    freeArena(shared->mArena);
+    delete shared;
+}
+
+template<class Func>
+void AMessage::forEachItem(Func func) const {
+    if (mBase != NULL) {
+        for (size_t i = 0; i < mBase->mNumItems; ++i) {
+            const Item *item = &mBase->mItems[i];
+            if (mNumShadowed > 0) {
+                size_t own = findInternedIndex(mItems, mHashes, mNumItems,
+                    item->mName, mBase->mHashes[i]);
+                if (own < mNumItems) {
+                    item = &mItems[own];
+                }
+            }
+            func(item, mBase->mHashes[i]);
+        }
+    }
+
+    for (size_t i = 0; i < mNumItems; ++i) {
+        if (mBase != NULL && mNumShadowed > 0
+                && findInternedIndex(mBase->mItems, mBase->mHashes, mBase->mNumItems,
+                    mItems[i].mName, mHashes[i]) < mBase->mNumItems) {
+            continue;
+        }
+        func(&mItems[i], mHashes[i]);
+    }
+}
+
+//共享数据中被覆盖的item由自己的item在原位置替代，其余自己的item排在后面
+const AMessage::Item *AMessage::getItemAt(size_t index) const {
+    if (mBase == NULL) {
+        return index < mNumItems ? &mItems[index] : NULL;
+    }
+
+    if (index < mBase->mNumItems) {
+        const Item *item = &mBase->mItems[index];
+        if (mNumShadowed > 0) {
+            size_t i = findInternedIndex(mItems, mHashes, mNumItems,
+                item->mName, mBase->mHashes[index]);
+            if (i < mNumItems) {
+                return &mItems[i];
+            }
+        }
+        return item;
+    }
+
+    index -= mBase->mNumItems;
+    for (size_t i = 0; i < mNumItems; ++i) {
+        if (mNumShadowed > 0
+                && findInternedIndex(mBase->mItems, mBase->mHashes, mBase->mNumItems,
+                    mItems[i].mName, mHashes[i]) < mBase->mNumItems) {
+            continue;
+        }
+        if (index-- == 0) {
+            return &mItems[i];
+        }
+    }
+    return NULL;
+}
+
+AMessage::~AMessage() {
+    clear();
+    if (mItems != mInlineItems) {
+        delete[] mItems;
+        delete[] mHashes;
+    }
+    freeArena(mArena);
+}
+
+//clear()不释放已扩容的空间，消息被重复使用时不需要再次扩容
+void AMessage::reserveItems(size_t capacity) {
+    if (capacity <= mCapacity) {
+        return;
+    }
+
+    Item *items = new Item[capacity];
+    uint32_t *hashes = new uint32_t[capacity];
+    memcpy(items, mItems, mNumItems * sizeof(Item));
+    memcpy(hashes, mHashes, mNumItems * sizeof(uint32_t));
+    if (mItems != mInlineItems) {
+        delete[] mItems;
+        delete[] mHashes;
+    }
+    mItems = items;
+    mHashes = hashes;
+    mCapacity = capacity;
+}
+
+AMessage::Item *AMessage::allocateItem(const char *name){
+    size_t len;
+    uint32_t hash = AKey::hashName(name, &len);
+    return allocateItem(name, len, hash);
+}
+
+//name不要求以'\0'结尾
+AMessage::Item *AMessage::allocateItem(const char *name, size_t len, uint32_t hash){
+    dropSnapshot();
+    size_t i = findItemIndex(mItems, mHashes, mNumItems, name, len, hash);
+
+    if (i < mNumItems) {
+        Item *item = &mItems[i];
+        freeItemValue(item);
+        return item;
+    }
+
+    const char *interned = AKey::tryIntern(name, len, hash);
+    if (interned != NULL) {
+        return appendItem(interned, len, hash);
+    }
+    Item *item = appendItem(copyName(name, len), len, hash);
+    item->mOwnedName = 1;
+    return item;
+}
+
+char *AMessage::copyName(const char *name, size_t len) {
+    char *copy = new char[len + 1];
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void AMessage::freeItemName(Item *item) {
+    if (item->mOwnedName) {
+        delete[] item->mName;
+        item->mOwnedName = 0;
+    }
+    item->mName = NULL;
+}
+
+//复制item的名字，自己保存的名字需要另外复制一份
+void AMessage::copyItemName(Item *to, const Item *from) {
+    to->mNameLength = from->mNameLength;
+    to->mOwnedName = from->mOwnedName;
+    to->mName = from->mOwnedName ? copyName(from->mName, from->mNameLength) : from->mName;
+}
+
+AMessage::Item *AMessage::allocateItem(const AKey &key){
+    dropSnapshot();
+    size_t i = findInternedIndex(mItems, mHashes, mNumItems, key.mName, key.mHash);
+
+    if (i < mNumItems) {
+        Item *item = &mItems[i];
+        freeItemValue(item);
+        return item;
+    }
+
+    return appendItem(key.mName, key.mLength, key.mHash);
+}
+
+AMessage::Item *AMessage::appendItem(const char *internedName, size_t len, uint32_t hash) {
+    if (mNumItems == mCapacity) {
+        reserveItems(mCapacity * 2);
+    }
+
+    //共享数据中的同名item不能修改，由新的item覆盖
+    if (mBase != NULL
+            && findInternedIndex(mBase->mItems, mBase->mHashes, mBase->mNumItems,
+                internedName, hash) < mBase->mNumItems) {
+        ++mNumShadowed;
+    }
+
+    mHashes[mNumItems] = hash;
+    Item *item = &mItems[mNumItems++];
+    item->mName = internedName;
+    item->mNameLength = (uint32_t)len;
+    item->mOwnedName = 0;
+    return item;
+}
+
+void AMessage::freeItemValue(Item *item){
+    switch (item->mType) {
+        case kTypeString:{
+            if (item->u.stringValue.mStorage == kStringHeap) {
+                delete item->u.stringValue.mHeap;
+            }
+            break;
+        }
+
+        case kTypeObject:
+        case kTypeBuffer:
+        case kTypeMessage:
+        case kTypeInt32Array:
+        case kTypeInt64Array:
+        case kTypeFloatArray:
+        case kTypeDoubleArray:{
+            objectValue(item)->~shared_ptr();
+            break;
+        }
+
+        case kTypeUnique:{
+            item->u.uniqueValue.mDelete(item->u.uniqueValue.mValue);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+//复制item的值，字符串和对象各自持有一份
+void AMessage::copyItemValue(Item *to, const Item *from) {
+    switch (from->mType) {
+        case kTypeString:{
+            size_t len;
+            const char *str = getStringValue(from, &len);
+            setStringValue(to, str, len);
+            break;
+        }
+
+        case kTypeObject:
+        case kTypeBuffer:
+        case kTypeMessage:
+        case kTypeInt32Array:
+        case kTypeInt64Array:
+        case kTypeFloatArray:
+        case kTypeDoubleArray:{
+            to->mType = from->mType;
+            new (&to->u.objectValue) sp<void>(*objectValue(from));
+            break;
+        }
+
+        default:{
+            to->mType = from->mType;
+            to->u = from->u;
+            break;
+        }
+    }
+}
+
+const AMessage::Item *AMessage::findItem(const char *name, Type type) const {
+    size_t len;
+    uint32_t hash = AKey::hashName(name, &len);
+    const Item *item = lookupItem(name, len, hash);
+    return item != NULL && item->mType == type ? item : NULL;
+}
+
+const AMessage::Item *AMessage::findItem(const AKey &key, Type type) const {
+    const Item *item = lookupItem(key);
+    return item != NULL && item->mType == type ? item : NULL;
+}
+
+//取出item的值前调用，返回的item属于自己，可以移走值后eraseItem()
+AMessage::Item *AMessage::detachItem(const char *name, Type type) {
+    if (findItem(name, type) == NULL) {
+        return NULL;
+    }
+    if (mBase != NULL) {
+        detachBase();
+    }
+    size_t len;
+    uint32_t hash = AKey::hashName(name, &len);
+    return &mItems[findItemIndex(mItems, mHashes, mNumItems, name, len, hash)];
+}
+
+AMessage::Item *AMessage::detachItem(const AKey &key, Type type) {
+    if (findItem(key, type) == NULL) {
+        return NULL;
+    }
+    if (mBase != NULL) {
+        detachBase();
+    }
+    return &mItems[findInternedIndex(mItems, mHashes, mNumItems, key.mName, key.mHash)];
+}
+
+//把共享数据合并进自己的items，之后不再有被覆盖的item
+void AMessage::detachBase() {
+    dropSnapshot();
+    shareItems();
+    SharedItems *shared = mBase;
+    mBase = NULL;
+
+    //新合并的数据只有自己引用，直接接管
+    if (mItems != mInlineItems) {
+        delete[] mItems;
+        delete[] mHashes;
+    }
+    mItems = shared->mItems;
+    mHashes = shared->mHashes;
+    mNumItems = shared->mNumItems;
+    mCapacity = shared->mNumItems;
+    mArena = shared->mArena;
+    delete shared;
+}
+
+void AMessage::setUniqueValue(Item *item, void *value, UniqueDeleter deleter) {
+    item->mType = kTypeUnique;
+    item->u.uniqueValue.mValue = value;
+    item->u.uniqueValue.mDelete = deleter;
+}
+
+//类型不符时保留该项
+void *AMessage::takeUniqueValue(Item *item, UniqueDeleter deleter) {
+    if (item == NULL || item->u.uniqueValue.mDelete != deleter) {
+        return NULL;
+    }
+    void *value = item->u.uniqueValue.mValue;
+    eraseItem(item);
+    return value;
+}
+
+//删除值已被移走的item
+void AMessage::eraseItem(Item *item) {
+    dropSnapshot();
+    freeItemName(item);
+    size_t i = item - mItems;
+    memmove(&mItems[i], &mItems[i + 1], (mNumItems - i - 1) * sizeof(Item));
+    memmove(&mHashes[i], &mHashes[i + 1], (mNumItems - i - 1) * sizeof(uint32_t));
+    --mNumItems;
+}
+
+//先找自己的item，再找共享数据
+const AMessage::Item *AMessage::lookupItem(const char *name, size_t len, uint32_t hash) const {
+    size_t i = findItemIndex(mItems, mHashes, mNumItems, name, len, hash);
+    if (i < mNumItems) {
+        return &mItems[i];
+    }
+    if (mBase != NULL) {
+        i = findItemIndex(mBase->mItems, mBase->mHashes, mBase->mNumItems, name, len, hash);
+        if (i < mBase->mNumItems) {
+            return &mBase->mItems[i];
+        }
+    }
+    return NULL;
+}
+
+const AMessage::Item *AMessage::lookupItem(const AKey &key) const {
+    size_t i = findInternedIndex(mItems, mHashes, mNumItems, key.mName, key.mHash);
+    if (i < mNumItems) {
+        return &mItems[i];
+    }
+    if (mBase != NULL) {
+        i = findInternedIndex(mBase->mItems, mBase->mHashes, mBase->mNumItems, key.mName, key.mHash);
+        if (i < mBase->mNumItems) {
+            return &mBase->mItems[i];
+        }
+    }
+    return NULL;
+}
+
+//先比较hash，hash相同时一般名字都是interned，指针相同即可；
+//指针不同时可能是item自己保存的名字，再比较字符串
+size_t AMessage::findInternedIndex(const Item *items, const uint32_t *hashes, size_t n,
+        const char *internedName, uint32_t hash) {
+    size_t i = findHash(hashes, n, hash, 0);
+    while (i < n && items[i].mName != internedName && strcmp(items[i].mName, internedName)) {
+        i = findHash(hashes, n, hash, i + 1);
+    }
+    return i;
+}
+
+size_t AMessage::findItemIndex(const Item *items, const uint32_t *hashes, size_t n,
+        const char *name, size_t len, uint32_t hash) {
+    size_t i = findHash(hashes, n, hash, 0);
+    while (i < n
+            && (items[i].mNameLength != len || memcmp(items[i].mName, name, len))) {
+        i = findHash(hashes, n, hash, i + 1);
+    }
+    return i;
+}
+
+//从from开始找到第一个hash相同的item，没有则返回n
+size_t AMessage::findHash(const uint32_t *hashes, size_t n, uint32_t hash, size_t from) {
+    size_t i = from;
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi32((int)hash);
+    for (; i + 4 <= n; i += 4) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hashes + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(block, needle)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (hashes[i] == hash) {
+            break;
+        }
+    }
+    return i;
+}
+
+void AMessage::deliver(const sp<AHandler> &handler) {
+    if (handler == NULL) {
+        logw("failed to deliver message as target handler %lld is gone.", (long long)mTarget);
+        return;
+    }
+
+    handler->deliverMessage(shared_from_this());
+}
+
+size_t AMessage::countEntries() const {
+    size_t count = mLayout != NULL ? mLayout->mNumFields : 0;
+    if (mBase != NULL) {
+        return count + mBase->mNumItems + mNumItems - mNumShadowed;
+    }
+    return count + mNumItems;
+}
+
+const char *AMessage::getEntryNameAt(size_t index, Type *type) const {
+    if (mLayout != NULL) {
+        if (index < mLayout->mNumFields) {
+            *type = mLayout->mTypes[index];
+            return mLayout->mNames[index];
+        }
+        index -= mLayout->mNumFields;
+    }
+
+    const Item *item = getItemAt(index);
+    if (item == NULL) {
+        *type = kTypeInt32;
+
+        return NULL;
+    }
+
+    *type = item->mType;
+
+    return item->mName;
+}
+
+// 二进制格式，所有整数均为小端：
+//  消息头（20字节）：
+//      magic       4字节 "AMSG"
+//      version     u8    当前为1，不认识的版本不解析
+//      flags       u8    保留，写0
+//      reserved    u16   保留，写0
+//      what        u32
+//      numItems    u32
+//      payloadSize u32   消息头之后所有item的字节数
+//  每一项：
+//      hash        u32   名字的FNV-1a hash，与AKey相同
+//      type        u8    WireType
+//      reserved    u8
+//      nameLen     u16
+//      valueLen    u32
+//      name        nameLen字节，不以'\0'结尾
+//      value       valueLen字节。int32/float 4字节，int64/size/double 8字节，string为原始内容，
+//                  buffer为有效范围内的数据，嵌套消息为完整的消息（包括消息头），数组为小端的各个元素
+//  读取时根据valueLen跳过不认识的type，以后可以在同一版本内增加新的类型
+enum {
+    kWireVersion = 1,
+    kWireHeaderSize = 20,
+    kWireItemHeaderSize = 12,
+};
+
+enum WireType {
+    kWireInt32 = 0,
+    kWireInt64 = 1,
+    kWireSize = 2,
+    kWireFloat = 3,
+    kWireDouble = 4,
+    kWireString = 6,
+    kWireBuffer = 7,
+    kWireMessage = 8,
+    kWireInt32Array = 9,
+    kWireInt64Array = 10,
+    kWireFloatArray = 11,
+    kWireDoubleArray = 12,
+};
+
+static const uint8_t kWireMagic[4] = {'A', 'M', 'S', 'G'};
+
+static inline void putLE16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void putLE32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline void putLE64(uint8_t *p, uint64_t v) {
+    putLE32(p, (uint32_t)v);
+    putLE32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint16_t getLE16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t getLE32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t getLE64(const uint8_t *p) {
+    return (uint64_t)getLE32(p) | ((uint64_t)getLE32(p + 4) << 32);
+}
+
+static inline int32_t getInt32(const uint8_t *p) {
+    return (int32_t)getLE32(p);
+}
+
+static inline int64_t getInt64(const uint8_t *p) {
+    return (int64_t)getLE64(p);
+}
+
+//size_t按64位传输
+static inline size_t getSize(const uint8_t *p) {
+    return (size_t)getLE64(p);
+}
+
+static inline float getFloat(const uint8_t *p) {
+    uint32_t bits = getLE32(p);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline double getDouble(const uint8_t *p) {
+    uint64_t bits = getLE64(p);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+//与AKey::hashName相同，name不要求以'\0'结尾
+static uint32_t hashBytes(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+//数组元素按小端写出，小端机器上直接复制；读写都用这个函数
+static void copyArrayLE(uint8_t *to, const uint8_t *from, size_t size, size_t elemSize) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (size_t i = 0; i < size; i += elemSize) {
+        for (size_t j = 0; j < elemSize; j++) {
+            to[i + j] = from[i + elemSize - 1 - j];
+        }
+    }
+#else
+    (void)elemSize;
+    memcpy(to, from, size);
+#endif
+}
+
+//嵌套的层数限制，避免循环引用和恶意数据导致递归过深
+static const int kMaxWireDepth = 32;
+
+static size_t arrayElemSize(uint8_t wireType) {
+    switch (wireType) {
+        case kWireInt32Array:
+        case kWireFloatArray:
+            return 4;
+        case kWireInt64Array:
+        case kWireDoubleArray:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+static uint8_t arrayWireType(AMessage::Type type) {
+    switch (type) {
+        case AMessage::kTypeInt32Array:
+            return kWireInt32Array;
+        case AMessage::kTypeInt64Array:
+            return kWireInt64Array;
+        case AMessage::kTypeFloatArray:
+            return kWireFloatArray;
+        default:
+            return kWireDoubleArray;
+    }
+}
+
+status_t AMessage::writeToBuffer(std::vector<uint8_t> *out, bool skipUnsupported) const {
+    //先算出总长度，只扩容一次
+    size_t size = 0;
+    if (!wireSize(&size, skipUnsupported, 0)) {
+        loge("message %u can't be serialized", mWhat);
+        return INVALID_OPERATION;
+    }
+
+    size_t offset = out->size();
+    out->resize(offset + size);
+    writeWire(&(*out)[offset], skipUnsupported);
+    return OK;
+}
+
+bool AMessage::canSerialize(const Item *item) {
+    switch (item->mType) {
+        case kTypePointer:
+        case kTypeObject:
+        case kTypeUnique:
+            return false;
+        case kTypeMessage:
+            return *castObject<AMessage>(objectValue(item)) != NULL;
+        default:
+            return true;
+    }
+}
+
+//计算包括消息头在内的总长度，同时检查是否都能序列化
+bool AMessage::wireSize(size_t *size, bool skipUnsupported, int depth) const {
+    if (depth >= kMaxWireDepth) {
+        return false;
+    }
+    //TypedMessage的字段不能序列化，不能悄悄丢掉
+    if (mLayout != NULL && mLayout->mNumFields > 0 && !skipUnsupported) {
+        return false;
+    }
+
+    size_t payloadSize = 0;
+    bool ok = true;
+    forEachItem([&](const Item *item, uint32_t) {
+        if (skipUnsupported && !canSerialize(item)) {
+            return;
+        }
+        size_t valueLen = 0;
+        switch (item->mType) {
+            case kTypeInt32:
+            case kTypeFloat:
+                valueLen = 4;
+                break;
+            case kTypeInt64:
+            case kTypeSize:
+            case kTypeDouble:
+                valueLen = 8;
+                break;
+            case kTypeString:
+                getStringValue(item, &valueLen);
+                break;
+            case kTypeBuffer:
+            case kTypeInt32Array:
+            case kTypeInt64Array:
+            case kTypeFloatArray:
+            case kTypeDoubleArray:{
+                const ABuffer *buffer = castObject<ABuffer>(objectValue(item))->get();
+                valueLen = buffer != NULL ? buffer->size() : 0;
+                break;
+            }
+            case kTypeMessage:{
+                const AMessage *nested = castObject<AMessage>(objectValue(item))->get();
+                if (nested == NULL || !nested->wireSize(&valueLen, skipUnsupported, depth + 1)) {
+                    ok = false;
+                }
+                break;
+            }
+            default:
+                ok = false;
+                break;
+        }
+        if (item->mNameLength > 0xffff || valueLen > 0xffffffffu) {
+            ok = false;
+        }
+        payloadSize += kWireItemHeaderSize + item->mNameLength + valueLen;
+    });
+    if (!ok || payloadSize > 0xffffffffu) {
+        return false;
+    }
+
+    *size = kWireHeaderSize + payloadSize;
+    return true;
+}
+
+//wireSize()检查通过后调用，返回写入后的位置。嵌套消息写完后再回填长度
+uint8_t *AMessage::writeWire(uint8_t *p, bool skipUnsupported) const {
+    uint8_t *header = p;
+    memcpy(p, kWireMagic, 4);
+    p[4] = kWireVersion;
+    p[5] = 0;
+    putLE16(p + 6, 0);
+    putLE32(p + 8, mWhat);
+    p += kWireHeaderSize;
+
+    uint32_t numItems = 0;
+    forEachItem([&](const Item *item, uint32_t hash) {
+        if (skipUnsupported && !canSerialize(item)) {
+            return;
+        }
+        const char *str = NULL;
+        size_t valueLen = 0;
+        uint8_t type = 0;
+        uint8_t value[8];
+        uint8_t *itemHeader = p;
+        p += kWireItemHeaderSize;
+        memcpy(p, item->mName, item->mNameLength);
+        p += item->mNameLength;
+
+        switch (item->mType) {
+            case kTypeInt32:
+                type = kWireInt32;
+                valueLen = 4;
+                putLE32(value, (uint32_t)item->u.int32Value);
+                break;
+            case kTypeInt64:
+                type = kWireInt64;
+                valueLen = 8;
+                putLE64(value, (uint64_t)item->u.int64Value);
+                break;
+            case kTypeSize:
+                type = kWireSize;
+                valueLen = 8;
+                putLE64(value, (uint64_t)item->u.sizeValue);
+                break;
+            case kTypeFloat:{
+                uint32_t bits;
+                memcpy(&bits, &item->u.floatValue, 4);
+                type = kWireFloat;
+                valueLen = 4;
+                putLE32(value, bits);
+                break;
+            }
+            case kTypeDouble:{
+                uint64_t bits;
+                memcpy(&bits, &item->u.doubleValue, 8);
+                type = kWireDouble;
+                valueLen = 8;
+                putLE64(value, bits);
+                break;
+            }
+            case kTypeBuffer:{
+                const ABuffer *buffer = castObject<ABuffer>(objectValue(item))->get();
+                type = kWireBuffer;
+                if (buffer != NULL) {
+                    str = (const char *)buffer->data();
+                    valueLen = buffer->size();
+                }
+                break;
+            }
+            case kTypeInt32Array:
+            case kTypeInt64Array:
+            case kTypeFloatArray:
+            case kTypeDoubleArray:{
+                const ABuffer *buffer = castObject<ABuffer>(objectValue(item))->get();
+                type = arrayWireType((Type)item->mType);
+                valueLen = buffer->size();
+                copyArrayLE(p, buffer->data(), valueLen, arrayElemSize(type));
+                p += valueLen;
+                valueLen = 0;
+                break;
+            }
+            case kTypeMessage:{
+                const AMessage *nested = castObject<AMessage>(objectValue(item))->get();
+                type = kWireMessage;
+                p = nested->writeWire(p, skipUnsupported);
+                break;
+            }
+            default:
+                type = kWireString;
+                str = getStringValue(item, &valueLen);
+                break;
+        }
+
+        if (valueLen > 0) {
+            memcpy(p, str != NULL ? str : (const char *)value, valueLen);
+            p += valueLen;
+        }
+        putLE32(itemHeader, hash);
+        itemHeader[4] = type;
+        itemHeader[5] = 0;
+        putLE16(itemHeader + 6, (uint16_t)item->mNameLength);
+        putLE32(itemHeader + 8, (uint32_t)(p - itemHeader - kWireItemHeaderSize - item->mNameLength));
+        ++numItems;
+    });
+
+    putLE32(header + 12, numItems);
+    putLE32(header + 16, (uint32_t)(p - header - kWireHeaderSize));
+    return p;
+}
+
+sp<AMessage> AMessage::readFromBuffer(const void *data, size_t size) {
+    return readWire(data, size, 0);
+}
+
+sp<AMessage> AMessage::readWire(const void *data, size_t size, int depth) {
+    AMessageView view;
+    if (depth >= kMaxWireDepth || !view.init(data, size)) {
+        return createNull();
+    }
+
+    auto msg = AMessage::obtain();
+    msg->mWhat = view.what();
+    msg->reserveItems(view.countEntries());
+
+    const uint8_t *p = static_cast<const uint8_t *>(data) + kWireHeaderSize;
+    const uint8_t *end = p + view.size() - kWireHeaderSize;
+    while (p < end) {
+        uint8_t type = p[4];
+        size_t nameLen = getLE16(p + 6);
+        size_t valueLen = getLE32(p + 8);
+        const char *name = (const char *)p + kWireItemHeaderSize;
+        const uint8_t *value = p + kWireItemHeaderSize + nameLen;
+        p = value + valueLen;
+
+        //hash重新计算，不信任数据中的值；跳过不认识的类型
+        Item *item = NULL;
+        switch (type) {
+            case kWireInt32:
+            case kWireFloat:
+                if (valueLen == 4) {
+                    item = msg->allocateItem(name, nameLen, hashBytes(name, nameLen));
+                }
+                break;
+            case kWireInt64:
+            case kWireSize:
+            case kWireDouble:
+                if (valueLen == 8) {
+                    item = msg->allocateItem(name, nameLen, hashBytes(name, nameLen));
+                }
+                break;
+            case kWireString:
+                item = msg->allocateItem(name, nameLen, hashBytes(name, nameLen));
+                msg->storeString(item, (const char *)value, valueLen);
+                break;
+            case kWireBuffer:{
+                sp<ABuffer> buffer = ABuffer::create(valueLen);
+                if (buffer == NULL) {
+                    break;
+                }
+                memcpy(buffer->data(), value, valueLen);
+                item = msg->allocateItem(name, nameLen, hashBytes(name, nameLen));
+                item->mType = kTypeBuffer;
+                new (&item->u.objectValue) sp<void>(std::move(buffer));
+                break;
+            }
+            case kWireInt32Array:
+            case kWireInt64Array:
+            case kWireFloatArray:
+            case kWireDoubleArray:{
+                size_t elemSize = arrayElemSize(type);
+                sp<ABuffer> buffer = valueLen % elemSize == 0
+                    ? ABuffer::create(valueLen, ABuffer::kSimdAlignment) : sp<ABuffer>();
+                if (buffer == NULL) {
+                    break;
+                }
+                copyArrayLE(buffer->data(), value, valueLen, elemSize);
+                item = msg->allocateItem(name, nameLen, hashBytes(name, nameLen));
+                item->mType = type == kWireInt32Array ? kTypeInt32Array
+                    : type == kWireInt64Array ? kTypeInt64Array
+                    : type == kWireFloatArray ? kTypeFloatArray : kTypeDoubleArray;
+                new (&item->u.objectValue) sp<void>(std::move(buffer));
+                break;
+            }
+            case kWireMessage:{
+                sp<AMessage> nested = readWire(value, valueLen, depth + 1);
+                if (nested == NULL) {
+                    break;
+                }
+                item = msg->allocateItem(name, nameLen, hashBytes(name, nameLen));
+                item->mType = kTypeMessage;
+                new (&item->u.objectValue) sp<void>(std::move(nested));
+                break;
+            }
+            default:
+                break;
+        }
+        if (item == NULL) {
+            continue;
+        }
+
+        switch (type) {
+            case kWireInt32:
+                item->mType = kTypeInt32;
+                item->u.int32Value = getInt32(value);
+                break;
+            case kWireInt64:
+                item->mType = kTypeInt64;
+                item->u.int64Value = getInt64(value);
+                break;
+            case kWireSize:
+                item->mType = kTypeSize;
+                item->u.sizeValue = getSize(value);
+                break;
+            case kWireFloat:
+                item->mType = kTypeFloat;
+                item->u.floatValue = getFloat(value);
+                break;
+            case kWireDouble:
+                item->mType = kTypeDouble;
+                item->u.doubleValue = getDouble(value);
+                break;
+            default:
+                break;
+        }
+    }
+
+    return msg;
+}
+
+AMessageView::AMessageView()
+    : mData(NULL),
+    mSize(0),
+    mWhat(0),
+    mNumItems(0) {
+}
+
+bool AMessageView::init(const void *data, size_t size) {
+    mData = NULL;
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    if (size < kWireHeaderSize || memcmp(p, kWireMagic, 4) || p[4] != kWireVersion) {
+        return false;
+    }
+
+    uint32_t numItems = getLE32(p + 12);
+    size_t payloadSize = getLE32(p + 16);
+    if (payloadSize > size - kWireHeaderSize) {
+        return false;
+    }
+
+    //检查每一项都在payload之内，之后查找时不需要再检查
+    const uint8_t *item = p + kWireHeaderSize;
+    const uint8_t *end = item + payloadSize;
+    for (uint32_t i = 0; i < numItems; ++i) {
+        if ((size_t)(end - item) < kWireItemHeaderSize) {
+            return false;
+        }
+        size_t len = kWireItemHeaderSize + getLE16(item + 6) + (size_t)getLE32(item + 8);
+        if ((size_t)(end - item) < len) {
+            return false;
+        }
+        item += len;
+    }
+    if (item != end) {
+        return false;
+    }
+
+    mData = p;
+    mSize = kWireHeaderSize + payloadSize;
+    mWhat = getLE32(p + 8);
+    mNumItems = numItems;
+    return true;
+}
+
+uint32_t AMessageView::what() const {
+    return mWhat;
+}
+
+size_t AMessageView::countEntries() const {
+    return mNumItems;
+}
+
+size_t AMessageView::size() const {
+    return mSize;
+}
+
+//顺序扫描，先比较hash，再比较名字
+const uint8_t *AMessageView::findValue(const char *name, size_t len, uint32_t hash,
+        int type, size_t *valueLen) const {
+    if (mData == NULL) {
+        return NULL;
+    }
+
+    const uint8_t *p = mData + kWireHeaderSize;
+    const uint8_t *end = mData + mSize;
+    while (p < end) {
+        size_t nameLen = getLE16(p + 6);
+        size_t length = getLE32(p + 8);
+        const uint8_t *next = p + kWireItemHeaderSize + nameLen + length;
+        if (getLE32(p) == hash && nameLen == len
+                && !memcmp(p + kWireItemHeaderSize, name, len)) {
+            if (type >= 0 && p[4] != type) {
+                return NULL;
+            }
+            *valueLen = length;
+            return p + kWireItemHeaderSize + nameLen;
+        }
+        p = next;
+    }
+    return NULL;
+}
+
+const uint8_t *AMessageView::findValue(const char *name, int type, size_t *valueLen) const {
+    size_t len;
+    uint32_t hash = AKey::hashName(name, &len);
+    return findValue(name, len, hash, type, valueLen);
+}
+
+const uint8_t *AMessageView::findValue(const AKey &key, int type, size_t *valueLen) const {
+    return findValue(key.mName, key.mLength, key.mHash, type, valueLen);
+}
+
+#define VIEW_TYPE_WITH_KEY(NAME,TYPENAME,WIRETYPE,SIZE,KEYTYPE)          \
+bool AMessageView::find##NAME(KEYTYPE name, TYPENAME *value) const {    \
+    size_t valueLen;                                                    \
+    const uint8_t *p = findValue(name, WIRETYPE, &valueLen);            \
+    if (p == NULL || valueLen != SIZE) {                                \
+        return false;                                                   \
+    }                                                                   \
+    *value = get##NAME(p);                                              \
+    return true;                                                        \
+}
+
+#define VIEW_TYPE(NAME,TYPENAME,WIRETYPE,SIZE)                          \
+VIEW_TYPE_WITH_KEY(NAME,TYPENAME,WIRETYPE,SIZE,const char *)            \
+VIEW_TYPE_WITH_KEY(NAME,TYPENAME,WIRETYPE,SIZE,const AKey &)
+
+VIEW_TYPE(Int32,int32_t,kWireInt32,4)
+VIEW_TYPE(Int64,int64_t,kWireInt64,8)
+VIEW_TYPE(Size,size_t,kWireSize,8)
+VIEW_TYPE(Float,float,kWireFloat,4)
+VIEW_TYPE(Double,double,kWireDouble,8)
+
+#define VIEW_STRING_TYPE(KEYTYPE)                                       \
+bool AMessageView::findString(KEYTYPE name, const char **value, size_t *len) const {\
+    const uint8_t *p = findValue(name, kWireString, len);               \
+    if (p == NULL) {                                                    \
+        return false;                                                   \
+    }                                                                   \
+    *value = (const char *)p;                                           \
+    return true;                                                        \
+}                                                                       \
+                                                                        \
+bool AMessageView::findString(KEYTYPE name, std::string *value) const { \
+    size_t len;                                                         \
+    const uint8_t *p = findValue(name, kWireString, &len);              \
+    if (p == NULL) {                                                    \
+        return false;                                                   \
+    }                                                                   \
+    value->assign((const char *)p, len);                                \
+    return true;                                                        \
+}                                                                       \
+                                                                        \
+bool AMessageView::contains(KEYTYPE name) const {                       \
+    size_t len;                                                         \
+    return findValue(name, -1, &len) != NULL;                           \
+}
+
+#define VIEW_BUFFER_TYPE(KEYTYPE)                                       \
+bool AMessageView::findBuffer(KEYTYPE name, const uint8_t **data, size_t *size) const {\
+    const uint8_t *p = findValue(name, kWireBuffer, size);              \
+    if (p == NULL) {                                                    \
+        return false;                                                   \
+    }                                                                   \
+    *data = p;                                                          \
+    return true;                                                        \
+}                                                                       \
+                                                                        \
+bool AMessageView::findMessage(KEYTYPE name, AMessageView *msg) const { \
+    size_t len;                                                         \
+    const uint8_t *p = findValue(name, kWireMessage, &len);             \
+    return p != NULL && msg->init(p, len);                              \
+}
+
+VIEW_STRING_TYPE(const char *)
+VIEW_STRING_TYPE(const AKey &)
+VIEW_BUFFER_TYPE(const char *)
+VIEW_BUFFER_TYPE(const AKey &)
+
+#ifdef __linux__
+//共享内存的开头，之后是数据区。读写位置单调递增，对容量取模得到偏移
+//每条记录为u32长度加数据，按8字节对齐；数据区末尾放不下时写入kWrapMarker，从头开始
+//控制信息对两端都可写，容量在映射时复制一份，读写都只信任这份
+struct ASharedRing::Control {
+    uint32_t mMagic;
+    uint32_t mCapacity;
+    std::atomic<uint32_t> mClosed;
+
+    alignas(64) std::atomic<uint64_t> mHead;    //写端修改
+    std::atomic<uint32_t> mDataSeq;             //futex，写入后读端在等待时递增并唤醒
+    std::atomic<uint32_t> mReaderWaiting;
+
+    alignas(64) std::atomic<uint64_t> mTail;    //读端修改
+    std::atomic<uint32_t> mSpaceSeq;            //futex，读取后写端在等待时递增并唤醒
+    std::atomic<uint32_t> mWriterWaiting;
+};
+
+static const uint32_t kRingMagic = 0x474e5241; // "ARNG"
+static const uint32_t kWrapMarker = 0xffffffffu;
+
+static inline size_t ringRecordSize(size_t size) {
+    return (sizeof(uint32_t) + size + 7) & ~(size_t)7;
+}
+
+//跨进程使用，不能用FUTEX_PRIVATE_FLAG
+static void futexWait(std::atomic<uint32_t> *addr, uint32_t expected, int64_t timeoutUs) {
+    struct timespec ts;
+    struct timespec *pts = NULL;
+    if (timeoutUs >= 0) {
+        ts.tv_sec = timeoutUs / 1000000;
+        ts.tv_nsec = (timeoutUs % 1000000) * 1000;
+        pts = &ts;
+    }
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT, expected, pts, NULL, 0);
+}
+
+static void futexWake(std::atomic<uint32_t> *addr) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+//先标记waiting再检查条件，对端先更新位置再检查waiting，两者至少有一方能看到对方的修改
+template<class Ready>
+static bool waitRing(std::atomic<uint32_t> *waiting, std::atomic<uint32_t> *seq,
+        Ready ready, int64_t timeoutUs) {
+    int64_t deadlineUs = timeoutUs < 0 ? -1 : ALooper::GetNowUs() + timeoutUs;
+    while (!ready()) {
+        waiting->store(1);
+        uint32_t value = seq->load();
+        if (ready()) {
+            waiting->store(0, memory_order_relaxed);
+            break;
+        }
+
+        int64_t waitUs = -1;
+        if (deadlineUs >= 0) {
+            waitUs = deadlineUs - ALooper::GetNowUs();
+            if (waitUs <= 0) {
+                waiting->store(0, memory_order_relaxed);
+                return false;
+            }
+        }
+        futexWait(seq, value, waitUs);
+        waiting->store(0, memory_order_relaxed);
+    }
+    return true;
+}
+
+static void wakeRing(std::atomic<uint32_t> *waiting, std::atomic<uint32_t> *seq) {
+    if (waiting->load()) {
+        seq->fetch_add(1);
+        futexWake(seq);
+    }
+}
+
+ASharedRing::ASharedRing(void *map, size_t mapSize)
+    : mControl(static_cast<Control *>(map)),
+    mData(static_cast<uint8_t *>(map) + kControlSize),
+    mMapSize(mapSize),
+    mCapacity(mapSize - kControlSize) {
+    static_assert(sizeof(Control) <= kControlSize, "ring control too large");
+}
+
+ASharedRing::~ASharedRing() {
+    munmap(mControl, mMapSize);
+}
+
+sp<ASharedRing> ASharedRing::create(const char *name, size_t capacity) {
+    size_t cap = 64;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+    if (cap > 0x80000000u) {
+        loge("ring capacity %zu too large", capacity);
+        return sp<ASharedRing>();
+    }
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        loge("failed to create shared memory %s: %s", name, strerror(errno));
+        return sp<ASharedRing>();
+    }
+    size_t mapSize = kControlSize + cap;
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, mapSize) == 0) {
+        map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        loge("failed to map shared memory %s: %s", name, strerror(errno));
+        return sp<ASharedRing>();
+    }
+
+    Control *control = new (map) Control;
+    control->mCapacity = (uint32_t)cap;
+    control->mClosed = 0;
+    control->mHead = 0;
+    control->mDataSeq = 0;
+    control->mReaderWaiting = 0;
+    control->mTail = 0;
+    control->mSpaceSeq = 0;
+    control->mWriterWaiting = 0;
+    atomic_thread_fence(memory_order_release);
+    control->mMagic = kRingMagic;
+
+    return sp<ASharedRing>(new ASharedRing(map, mapSize));
+}
+
+sp<ASharedRing> ASharedRing::open(const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        loge("failed to open shared memory %s: %s", name, strerror(errno));
+        return sp<ASharedRing>();
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > kControlSize) {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        loge("failed to map shared memory %s", name);
+        return sp<ASharedRing>();
+    }
+
+    Control *control = static_cast<Control *>(map);
+    uint32_t cap = control->mCapacity;
+    if (control->mMagic != kRingMagic || cap < 64 || (cap & (cap - 1)) != 0
+            || kControlSize + cap != (size_t)st.st_size) {
+        loge("invalid shared ring %s", name);
+        munmap(map, st.st_size);
+        return sp<ASharedRing>();
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    return sp<ASharedRing>(new ASharedRing(map, st.st_size));
+}
+
+void ASharedRing::unlink(const char *name) {
+    shm_unlink(name);
+}
+
+status_t ASharedRing::write(const void *data, size_t size, int64_t timeoutUs) {
+    Control *c = mControl;
+    const uint64_t cap = mCapacity;
+    size_t record = ringRecordSize(size);
+    if (record > cap / 2) {
+        return NO_MEM;
+    }
+
+    uint64_t head = c->mHead.load(memory_order_relaxed);
+    size_t offset = head & (cap - 1);
+    size_t skip = cap - offset < record ? cap - offset : 0;
+    auto ready = [&]{
+        return c->mClosed.load(memory_order_acquire)
+            || head + skip + record - c->mTail.load(memory_order_acquire) <= cap;
+    };
+    if (!waitRing(&c->mWriterWaiting, &c->mSpaceSeq, ready, timeoutUs)) {
+        return BUSY;
+    }
+    if (c->mClosed.load(memory_order_acquire)) {
+        return NOT_FOUND;
+    }
+
+    if (skip > 0) {
+        memcpy(mData + offset, &kWrapMarker, sizeof(uint32_t));
+        head += skip;
+        offset = 0;
+    }
+    uint32_t len = (uint32_t)size;
+    memcpy(mData + offset, &len, sizeof(len));
+    memcpy(mData + offset + sizeof(len), data, size);
+
+    c->mHead.store(head + record);
+    wakeRing(&c->mReaderWaiting, &c->mDataSeq);
+    return OK;
+}
+
+status_t ASharedRing::read(const function<void(const void *data, size_t size)> &func,
+        int64_t timeoutUs) {
+    Control *c = mControl;
+    const uint64_t cap = mCapacity;
+    uint64_t tail = c->mTail.load(memory_order_relaxed);
+    auto ready = [&]{
+        return c->mHead.load(memory_order_acquire) != tail
+            || c->mClosed.load(memory_order_acquire);
+    };
+    if (!waitRing(&c->mReaderWaiting, &c->mDataSeq, ready, timeoutUs)) {
+        return BUSY;
+    }
+    if (c->mHead.load(memory_order_acquire) == tail) {
+        return NOT_FOUND;
+    }
+
+    //对端写坏了数据：记录没有对齐，或超出数据区剩余的空间
+    size_t offset = tail & (cap - 1);
+    uint32_t len = kWrapMarker;
+    if ((offset & 7) == 0) {
+        memcpy(&len, mData + offset, sizeof(len));
+    }
+    if (len == kWrapMarker && offset > 0) {
+        tail += cap - offset;
+        offset = 0;
+        memcpy(&len, mData, sizeof(len));
+    }
+    if (len == kWrapMarker || ringRecordSize(len) > cap / 2 || ringRecordSize(len) > cap - offset) {
+        loge("corrupted shared ring");
+        close();
+        return NOT_FOUND;
+    }
+
+    func(mData + offset + sizeof(len), len);
+
+    c->mTail.store(tail + ringRecordSize(len));
+    wakeRing(&c->mWriterWaiting, &c->mSpaceSeq);
+    return OK;
+}
+
+void ASharedRing::close() {
+    Control *c = mControl;
+    c->mClosed.store(1);
+    c->mDataSeq.fetch_add(1);
+    futexWake(&c->mDataSeq);
+    c->mSpaceSeq.fetch_add(1);
+    futexWake(&c->mSpaceSeq);
+}
+
+static void replyError(const sp<AReplyToken> &token, status_t err) {
+    auto reply = AMessage::create();
+    reply->setInt32("err", err);
+    reply->postReply(token);
+}
+
+//ring中的记录：u32 port，u32 保留，之后是writeToBuffer()的数据
+static const size_t kRingHeaderSize = 8;
+
+ARingSender::ARingSender(const sp<ASharedRing> &ring, uint32_t port, int64_t timeoutUs)
+    : mRing(ring),
+    mPort(port),
+    mTimeoutUs(timeoutUs) {
+}
+
+//复用mBuffer，序列化后一次拷贝进共享内存。ring不传递回复，等待回复的发送者在写入后得到结果
+void ARingSender::onMessageReceived(const sp<AMessage> &msg) {
+    sp<AReplyToken> token;
+    msg->takeObject("replyID", &token);
+
+    mBuffer.assign(kRingHeaderSize, 0);
+    putLE32(mBuffer.data(), mPort);
+    status_t err = msg->writeToBuffer(&mBuffer);
+    if (err == OK) {
+        err = mRing->write(mBuffer.data(), mBuffer.size(), mTimeoutUs);
+    }
+    if (err != OK) {
+        logw("failed to send message %u to ring port %u: %d", msg->what(), mPort, err);
+    }
+    if (token != NULL) {
+        replyError(token, err);
+    }
+}
+
+ARingReceiver::ARingReceiver(const sp<ASharedRing> &ring, const sp<AHandler> &target)
+    : mRing(ring) {
+    if (target != NULL) {
+        mExports[0] = target;
+    }
+}
+
+void ARingReceiver::exportHandler(uint32_t port, const sp<AHandler> &handler) {
+    Autolock l(mExportLock);
+    mExports[port] = handler;
+}
+
+ARingReceiver::~ARingReceiver() {
+    stop();
+}
+
+status_t ARingReceiver::start() {
+    if (mThread.joinable()) {
+        return INVALID_OPERATION;
+    }
+    mThread = thread(&ARingReceiver::pump, this);
+    return OK;
+}
+
+void ARingReceiver::stop() {
+    if (mThread.joinable()) {
+        mRing->close();
+        mThread.join();
+    }
+}
+
+//直接从共享内存解码，ring关闭且读完后退出
+void ARingReceiver::pump() {
+    auto deliver = [this](const void *data, size_t size) {
+        if (size < kRingHeaderSize) {
+            logw("drop truncated record from ring");
+            return;
+        }
+        const uint8_t *p = static_cast<const uint8_t *>(data);
+        uint32_t port = getLE32(p);
+        auto msg = AMessage::readFromBuffer(p + kRingHeaderSize, size - kRingHeaderSize);
+        sp<AHandler> target;
+        {
+            Autolock l(mExportLock);
+            auto it = mExports.find(port);
+            if (it != mExports.end()) {
+                target = it->second.lock();
+            }
+        }
+        if (msg == NULL || target == NULL) {
+            logw("drop message from ring to port %u", port);
+            return;
+        }
+        msg->setTarget(target);
+        msg->post();
+    };
+    while (mRing->read(deliver) == OK) {
+    }
+}
+
+//socket上的帧：u32 数据长度，u32 port，u32 replyID，u8 类型，3字节保留，之后是writeToBuffer()的数据
+//请求帧的replyID不为0，对端用同一个replyID发回回复帧
+enum FrameKind {
+    kFrameMessage = 0,
+    kFrameRequest = 1,
+    kFrameReply = 2,
+};
+
+static const size_t kFrameHeaderSize = 16;
+static const size_t kSegmentSize = 64 * 1024;
+static const size_t kMaxFrameSize = 64 * 1024 * 1024;
+static const size_t kMaxSpareSegments = 4;
+
+class ASocketBridge::Proxy : public AHandler {
+public:
+    Proxy(const wp<ASocketBridge> &bridge, uint32_t port)
+        : mBridge(bridge),
+        mPort(port) {
+    }
+
+protected:
+    virtual void onMessageReceived(const sp<AMessage> &msg) {
+        auto bridge = mBridge.lock();
+        if (bridge == NULL) {
+            logw("drop message %u to remote port %u as bridge is gone", msg->what(), mPort);
+            return;
+        }
+        bridge->sendRequest(mPort, msg);
+    }
+
+private:
+    wp<ASocketBridge> mBridge;
+    uint32_t mPort;
+};
+
+//在代理handler之后处理，把这期间编码的所有帧一次写出；socket的fd事件也由它接收
+class ASocketBridge::Writer : public AHandler {
+public:
+    explicit Writer(const wp<ASocketBridge> &bridge)
+        : mBridge(bridge) {
+    }
+
+protected:
+    virtual void onMessageReceived(const sp<AMessage> &) {
+        auto bridge = mBridge.lock();
+        if (bridge != NULL) {
+            bridge->flush();
+        }
+    }
+
+    virtual void onFdEvent(int, uint32_t events) {
+        auto bridge = mBridge.lock();
+        if (bridge == NULL) {
+            return;
+        }
+        if (events & (ALooper::EVENT_INPUT | ALooper::EVENT_HANGUP | ALooper::EVENT_ERROR)) {
+            bridge->receive();
+        }
+        if (events & ALooper::EVENT_OUTPUT) {
+            bridge->flush();
+        }
+    }
+
+private:
+    wp<ASocketBridge> mBridge;
+};
+
+ASocketBridge::ASocketBridge(int fd, const sp<ALooper> &looper)
+    : mFd(fd),
+    mLooper(looper),
+    mStarted(false),
+    mStopped(false),
+    mReadFilled(0),
+    mPendingMessages(0),
+    mFlushPending(false),
+    mWaitWritable(false),
+    mUnsentOffset(0),
+    mMessagesWritten(0),
+    mWrites(0),
+    mNextReplyID(1) {
+}
+
+sp<ASocketBridge> ASocketBridge::create(int fd, const sp<ALooper> &looper) {
+    //读写都在looper上执行，不能阻塞
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        logw("failed to make socket bridge fd %d non-blocking: %s", fd, strerror(errno));
+    }
+    sp<ASocketBridge> bridge(new ASocketBridge(fd, looper));
+    bridge->mSelf = bridge;
+    bridge->mWriter.reset(new Writer(bridge));
+    looper->registerHandler(bridge->mWriter);
+    return bridge;
+}
+
+ASocketBridge::~ASocketBridge() {
+    stop();
+    ::close(mFd);
+}
+
+void ASocketBridge::exportHandler(uint32_t port, const sp<AHandler> &handler) {
+    Autolock l(mExportLock);
+    mExports[port] = handler;
+}
+
+sp<AHandler> ASocketBridge::getRemoteHandler(uint32_t port) {
+    Autolock l(mExportLock);
+    auto it = mProxies.find(port);
+    if (it != mProxies.end()) {
+        return it->second;
+    }
+    auto looper = mLooper.lock();
+    if (looper == NULL) {
+        return sp<AHandler>();
+    }
+    sp<Proxy> proxy(new Proxy(mSelf, port));
+    looper->registerHandler(proxy);
+    mProxies[port] = proxy;
+    return proxy;
+}
+
+status_t ASocketBridge::start() {
+    Autolock l(mSendLock);
+    if (mStarted || mStopped) {
+        return INVALID_OPERATION;
+    }
+    mStarted = true;
+    mReadBuffer.resize(kSegmentSize);
+    return updateFdEventsLocked();
+}
+
+void ASocketBridge::stop() {
+    {
+        Autolock l(mSendLock);
+        mStopped = true;
+        updateFdEventsLocked();
+    }
+    ::shutdown(mFd, SHUT_RDWR);
+    failReplies();
+}
+
+//启动后监听可读，有没写完的数据时监听可写，停止后不再监听
+status_t ASocketBridge::updateFdEventsLocked() {
+    auto looper = mLooper.lock();
+    if (looper == NULL) {
+        return NOT_FOUND;
+    }
+    uint32_t events = 0;
+    if (!mStopped) {
+        events |= mStarted ? ALooper::EVENT_INPUT : 0;
+        events |= mWaitWritable ? ALooper::EVENT_OUTPUT : 0;
+    }
+    if (events == 0) {
+        looper->removeFd(mFd);
+        return OK;
+    }
+    return looper->addFd(mFd, events, mWriter);
+}
+
+void ASocketBridge::getWriteStats(uint64_t *messages, uint64_t *writes) const {
+    *messages = mMessagesWritten.load(memory_order_relaxed);
+    *writes = mWrites.load(memory_order_relaxed);
+}
+
+//帧直接编码到段缓冲的末尾；每轮只投递一个flush消息
+status_t ASocketBridge::send(uint8_t kind, uint32_t port, uint32_t replyID, const sp<AMessage> &msg) {
+    bool schedule;
+    {
+        Autolock l(mSendLock);
+        if (mStopped) {
+            return NOT_FOUND;
+        }
+        if (mSegments.empty() || mSegments.back().size() >= kSegmentSize) {
+            if (mSpareSegments.empty()) {
+                mSegments.emplace_back();
+                mSegments.back().reserve(kSegmentSize);
+            } else {
+                mSegments.push_back(std::move(mSpareSegments.back()));
+                mSpareSegments.pop_back();
+            }
+        }
+
+        vector<uint8_t> &segment = mSegments.back();
+        size_t offset = segment.size();
+        segment.resize(offset + kFrameHeaderSize);
+        if (msg->writeToBuffer(&segment) != OK) {
+            segment.resize(offset);
+            return INVALID_OPERATION;
+        }
+        uint8_t *p = &segment[offset];
+        putLE32(p, (uint32_t)(segment.size() - offset - kFrameHeaderSize));
+        putLE32(p + 4, port);
+        putLE32(p + 8, replyID);
+        p[12] = kind;
+        p[13] = p[14] = p[15] = 0;
+
+        ++mPendingMessages;
+        schedule = !mFlushPending;
+        mFlushPending = true;
+    }
+    if (schedule) {
+        AMessage::create(0, mWriter)->post();
+    }
+    return OK;
+}
+
+//postAndAwaitResponse带来的token留在本端，用replyID代替
+void ASocketBridge::sendRequest(uint32_t port, const sp<AMessage> &msg) {
+    sp<AReplyToken> token;
+    if (!msg->takeObject("replyID", &token) || token == NULL) {
+        status_t err = send(kFrameMessage, port, 0, msg);
+        if (err != OK) {
+            logw("failed to send message %u to remote port %u: %d", msg->what(), port, err);
+        }
+        return;
+    }
+
+    uint32_t replyID;
+    {
+        Autolock l(mReplyLock);
+        replyID = mNextReplyID++;
+        if (replyID == 0) {
+            replyID = mNextReplyID++;
+        }
+        mReplies[replyID] = token;
+    }
+    status_t err = send(kFrameRequest, port, replyID, msg);
+    //先登记再检查是否已停止，与failReplies()之间不会漏掉token
+    if (err == OK && mStopped) {
+        err = NOT_FOUND;
+    }
+    if (err != OK && removeReply(replyID, &token)) {
+        logw("failed to send request %u to remote port %u: %d", msg->what(), port, err);
+        replyError(token, err);
+    }
+}
+
+bool ASocketBridge::removeReply(uint32_t replyID, sp<AReplyToken> *token) {
+    Autolock l(mReplyLock);
+    auto it = mReplies.find(replyID);
+    if (it == mReplies.end()) {
+        return false;
+    }
+    *token = std::move(it->second);
+    mReplies.erase(it);
+    return true;
+}
+
+void ASocketBridge::failReplies() {
+    unordered_map<uint32_t, sp<AReplyToken>> replies;
+    {
+        Autolock l(mReplyLock);
+        replies.swap(mReplies);
+    }
+    for (auto &it : replies) {
+        replyError(it.second, NOT_FOUND);
+    }
+}
+
+//在looper上执行，同一时间只有一个flush。socket写满时保留没写完的段，可写时继续
+void ASocketBridge::flush() {
+    size_t messages;
+    {
+        Autolock l(mSendLock);
+        if (mStopped) {
+            mSegments.clear();
+            mUnsent.clear();
+            mUnsentOffset = 0;
+            mFlushPending = false;
+            return;
+        }
+        for (auto &segment : mSegments) {
+            mUnsent.push_back(std::move(segment));
+        }
+        mSegments.clear();
+        messages = mPendingMessages;
+        mPendingMessages = 0;
+        mFlushPending = false;
+    }
+    mMessagesWritten.fetch_add(messages, memory_order_relaxed);
+
+    vector<struct iovec> iov;
+    iov.reserve(mUnsent.size());
+    for (size_t i = 0; i < mUnsent.size(); ++i) {
+        size_t offset = i == 0 ? mUnsentOffset : 0;
+        if (mUnsent[i].size() > offset) {
+            struct iovec v = {mUnsent[i].data() + offset, mUnsent[i].size() - offset};
+            iov.push_back(v);
+        }
+    }
+
+    //相当于writev，MSG_NOSIGNAL避免对端关闭时触发SIGPIPE；处理部分写入
+    size_t index = 0;
+    size_t written = 0;
+    int err = 0;
+    while (index < iov.size()) {
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = &iov[index];
+        hdr.msg_iovlen = std::min(iov.size() - index, (size_t)IOV_MAX);
+        ssize_t n = ::sendmsg(mFd, &hdr, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err = errno;
+            break;
+        }
+        mWrites.fetch_add(1, memory_order_relaxed);
+        written += n;
+        size_t left = n;
+        while (index < iov.size() && left >= iov[index].iov_len) {
+            left -= iov[index].iov_len;
+            ++index;
+        }
+        if (left > 0) {
+            iov[index].iov_base = static_cast<uint8_t *>(iov[index].iov_base) + left;
+            iov[index].iov_len -= left;
+        }
+    }
+    if (err != 0 && err != EAGAIN && err != EWOULDBLOCK) {
+        logw("failed to write socket bridge: %s", strerror(err));
+        mUnsent.clear();
+        mUnsentOffset = 0;
+        stop();
+        return;
+    }
+
+    //去掉已经写完的段
+    size_t done = 0;
+    written += mUnsentOffset;
+    while (done < mUnsent.size() && written >= mUnsent[done].size()) {
+        written -= mUnsent[done].size();
+        ++done;
+    }
+    mUnsentOffset = written;
+
+    Autolock l(mSendLock);
+    for (size_t i = 0; i < done; ++i) {
+        vector<uint8_t> &segment = mUnsent[i];
+        if (mSpareSegments.size() < kMaxSpareSegments && segment.capacity() <= 2 * kSegmentSize) {
+            segment.clear();
+            mSpareSegments.push_back(std::move(segment));
+        }
+    }
+    mUnsent.erase(mUnsent.begin(), mUnsent.begin() + done);
+    bool waitWritable = !mUnsent.empty();
+    if (waitWritable != mWaitWritable) {
+        mWaitWritable = waitWritable;
+        updateFdEventsLocked();
+    }
+}
+
+//fd可读时在looper上执行。每次读取尽量多的数据，解码其中所有完整的帧，剩余的不完整帧移到缓冲开头
+void ASocketBridge::receive() {
+    vector<uint8_t> &buffer = mReadBuffer;
+    ssize_t n;
+    do {
+        n = ::read(mFd, &buffer[mReadFilled], buffer.size() - mReadFilled);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    //连接断开，之后的请求直接失败
+    if (n <= 0) {
+        stop();
+        return;
+    }
+    size_t filled = mReadFilled + n;
+
+    size_t offset = 0;
+    size_t need = 0;
+    while (filled - offset >= kFrameHeaderSize) {
+        const uint8_t *p = &buffer[offset];
+        size_t len = getLE32(p);
+        if (len > kMaxFrameSize) {
+            loge("invalid frame of %zu bytes from socket bridge", len);
+            stop();
+            return;
+        }
+        if (filled - offset - kFrameHeaderSize < len) {
+            need = kFrameHeaderSize + len;
+            break;
+        }
+        onFrame(p[12], getLE32(p + 4), getLE32(p + 8), p + kFrameHeaderSize, len);
+        offset += kFrameHeaderSize + len;
+    }
+
+    if (offset > 0) {
+        memmove(&buffer[0], &buffer[offset], filled - offset);
+        filled -= offset;
+    }
+    mReadFilled = filled;
+    if (need > buffer.size()) {
+        buffer.resize(need);
+    } else if (buffer.size() > kSegmentSize && filled <= kSegmentSize && need <= kSegmentSize) {
+        //超大的帧处理完后释放多余的内存
+        buffer.resize(kSegmentSize);
+        buffer.shrink_to_fit();
+    }
+}
+
+//在looper上执行
+void ASocketBridge::onFrame(uint8_t kind, uint32_t port, uint32_t replyID,
+        const uint8_t *data, size_t size) {
+    auto msg = AMessage::readFromBuffer(data, size);
+    if (msg == NULL) {
+        logw("drop invalid message from socket bridge");
+        return;
+    }
+
+    if (kind == kFrameReply) {
+        sp<AReplyToken> token;
+        if (removeReply(replyID, &token)) {
+            msg->postReply(token);
+        }
+        return;
+    }
+
+    sp<AHandler> target;
+    {
+        Autolock l(mExportLock);
+        auto it = mExports.find(port);
+        if (it != mExports.end()) {
+            target = it->second.lock();
+        }
+    }
+    if (target == NULL) {
+        logw("drop message %u to port %u as no handler is exported", msg->what(), port);
+        if (kind == kFrameRequest) {
+            auto reply = AMessage::create();
+            reply->setInt32("err", NOT_FOUND);
+            send(kFrameReply, 0, replyID, reply);
+        }
+        return;
+    }
+
+    if (kind == kFrameRequest) {
+        wp<ASocketBridge> weak = mSelf;
+        sp<AReplyToken> token(new AReplyToken([weak, replyID](const sp<AMessage> &reply) -> status_t {
+            auto bridge = weak.lock();
+            if (bridge == NULL) {
+                return NOT_FOUND;
+            }
+            return bridge->send(kFrameReply, 0, replyID, reply);
+        }));
+        msg->setObject("replyID", token);
+    }
+    msg->setTarget(target);
+    msg->post();
 }
+//日志文件的格式，整数均为小端：
+//  文件头（16字节）：magic "AJNL"，version u32，reserved u64
+//  之后是按8字节对齐的记录：
+//      size    u32   消息数据的字节数
+//      reserved u32
+//      target  i64   记录时的handler id
+//      timeUs  i64   分发的时间
+//      data    size字节，writeToBuffer()的格式
+//  块的剩余空间放不下下一条记录时写入跳过标记：u32 0xffffffff，u32 跳过的字节数（包括标记）
+//  size为0表示日志结束，进程异常退出时文件末尾是还没写入的0
+static const uint8_t kJournalMagic[4] = {'A', 'J', 'N', 'L'};
+static const uint32_t kJournalVersion = 2;
+static const size_t kJournalHeaderSize = 16;
+static const size_t kRecordHeaderSize = 24;
+static const uint32_t kJournalSkip = 0xffffffffu;
+
+static inline size_t roundUp(size_t size, size_t align) {
+    return (size + align - 1) / align * align;
+}
+
+AJournalRecorder::AJournalRecorder(int fd, size_t chunkSize)
+    : mFd(fd),
+    mChunkSize(chunkSize),
+    mChunk(NULL),
+    mChunkLength(0),
+    mChunkOffset(0),
+    mPosition(0),
+    mCount(0) {
+}
+
+sp<AJournalRecorder> AJournalRecorder::create(const char *path, size_t chunkSize) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    chunkSize = roundUp(std::max(chunkSize, pageSize), pageSize);
+
+    int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        loge("failed to create journal %s: %s", path, strerror(errno));
+        return sp<AJournalRecorder>();
+    }
+
+    sp<AJournalRecorder> recorder(new AJournalRecorder(fd, chunkSize));
+    if (!recorder->mapChunk(0, chunkSize)) {
+        return sp<AJournalRecorder>();
+    }
+    uint8_t *p = recorder->mChunk;
+    memcpy(p, kJournalMagic, 4);
+    putLE32(p + 4, kJournalVersion);
+    putLE64(p + 8, 0);
+    recorder->mPosition = kJournalHeaderSize;
+    return recorder;
+}
+
+AJournalRecorder::~AJournalRecorder() {
+    close();
+}
+
+//扩展文件并映射新的块，替换当前的块
+bool AJournalRecorder::mapChunk(uint64_t offset, size_t length) {
+    if (ftruncate(mFd, offset + length) != 0) {
+        loge("failed to extend journal: %s", strerror(errno));
+        return false;
+    }
+    void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, offset);
+    if (map == MAP_FAILED) {
+        loge("failed to map journal: %s", strerror(errno));
+        return false;
+    }
 
-uint32_t AMessage::what() const {
-    return mWhat;
+    if (mChunk != NULL) {
+        munmap(mChunk, mChunkLength);
+    }
+    mChunk = static_cast<uint8_t *>(map);
+    mChunkLength = length;
+    mChunkOffset = offset;
+    mPosition = 0;
+    return true;
 }
 
-void AMessage::setTarget(const sp<AHandler> &handler) {
-    if (handler == NULL) {
-        mTarget = INVALID_HANDLER_ID;
-        mHandler.reset();
-        mLooper.reset();
-    } else {
-        mTarget = handler->id();
-        mHandler = wp<AHandler>(handler);
-        mLooper = handler->getLooper();
+//在锁外编码，锁内只做拷贝
+void AJournalRecorder::record(const sp<AMessage> &msg, int64_t timeUs) {
+    static thread_local vector<uint8_t> tBuffer;
+    tBuffer.clear();
+    if (msg->writeToBuffer(&tBuffer, true) != OK || tBuffer.size() >= kJournalSkip) {
+        return;
     }
-}
+    size_t size = tBuffer.size();
+    size_t need = roundUp(kRecordHeaderSize + size, 8);
 
-void AMessage::clear() {
-    for (size_t i = 0; i < mNumItems; ++i) {
-        Item *item = &mItems[i];
-        delete[] item->mName;
-        item->mName = NULL;
-        freeItemValue(item);
+    Autolock l(mLock);
+    if (mChunk == NULL) {
+        return;
     }
-    mNumItems = 0;
+    if (mChunkLength - mPosition < need) {
+        if (mPosition < mChunkLength) {
+            putLE32(mChunk + mPosition, kJournalSkip);
+            putLE32(mChunk + mPosition + 4, (uint32_t)(mChunkLength - mPosition));
+        }
+        //新块至少放得下这条记录
+        if (!mapChunk(mChunkOffset + mChunkLength, roundUp(need, mChunkSize))) {
+            return;
+        }
+    }
+
+    uint8_t *p = mChunk + mPosition;
+    putLE32(p + 4, 0);
+    putLE64(p + 8, (uint64_t)msg->target());
+    putLE64(p + 16, (uint64_t)timeUs);
+    memcpy(p + kRecordHeaderSize, tBuffer.data(), size);
+    putLE32(p, (uint32_t)size);
+    mPosition += need;
+    ++mCount;
 }
 
-//setXXX(name, value), findXXX(name, &value)
-#define BASIC_TYPE(NAME,FIELDNAME,TYPENAME)                             \
-void AMessage::set##NAME(const char *name, TYPENAME value) {            \
-    Item *item = allocateItem(name);                                    \
-                                                                        \
-    item->mType = kType##NAME;                                          \
-    item->u.FIELDNAME = value;                                          \
-}                                                                       \
-                                                                        \
-bool AMessage::find##NAME(const char *name, TYPENAME *value) const {    \
-    const Item *item = findItem(name, kType##NAME);                     \
-    if (item) {                                                         \
-        *value = item->u.FIELDNAME;                                     \
-        return true;                                                    \
-    }                                                                   \
-    return false;                                                       \
+void AJournalRecorder::close() {
+    Autolock l(mLock);
+    if (mFd < 0) {
+        return;
+    }
+    uint64_t length = mChunkOffset + mPosition;
+    if (mChunk != NULL) {
+        munmap(mChunk, mChunkLength);
+        mChunk = NULL;
+    }
+    if (ftruncate(mFd, length) != 0) {
+        logw("failed to truncate journal: %s", strerror(errno));
+    }
+    ::close(mFd);
+    mFd = -1;
 }
 
-BASIC_TYPE(Int32,int32Value,int32_t)
-BASIC_TYPE(Int64,int64Value,int64_t)
-BASIC_TYPE(Size,sizeValue,size_t)
-BASIC_TYPE(Float,floatValue,float)
-BASIC_TYPE(Double,doubleValue,double)
-BASIC_TYPE(Pointer,ptrValue,void *)
+uint64_t AJournalRecorder::count() const {
+    Autolock l(mLock);
+    return mCount;
+}
 
-void AMessage::setObject(const char* name, const sp<void>& value) {
-    auto ref = new RefHolder(value);
-    Item *item = allocateItem(name);
-    item->mType = kTypeObject;      
-    item->u.refValue = ref;
+AJournalReplayer::AJournalReplayer(uint8_t *data, size_t size)
+    : mData(data),
+    mSize(size) {
 }
 
-void AMessage::setString(const char *name, const char *s, ssize_t len) {
-    auto str = new std::string(s, len <= 0 ? strlen(s) : len);
-    Item *item = allocateItem(name);
-    item->mType = kTypeString;
-    item->u.stringValue = str;
+sp<AJournalReplayer> AJournalReplayer::open(const char *path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        loge("failed to open journal %s: %s", path, strerror(errno));
+        return sp<AJournalReplayer>();
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < kJournalHeaderSize) {
+        loge("invalid journal %s", path);
+        ::close(fd);
+        return sp<AJournalReplayer>();
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        loge("failed to map journal %s: %s", path, strerror(errno));
+        return sp<AJournalReplayer>();
+    }
+
+    uint8_t *data = static_cast<uint8_t *>(map);
+    if (memcmp(data, kJournalMagic, 4) || getLE32(data + 4) != kJournalVersion) {
+        loge("invalid journal %s", path);
+        munmap(map, st.st_size);
+        return sp<AJournalReplayer>();
+    }
+    return sp<AJournalReplayer>(new AJournalReplayer(data, st.st_size));
 }
 
-void AMessage::setString(const char *name, const std::string &s){
-    auto str = new std::string(s);
-    Item *item = allocateItem(name);
-    item->mType = kTypeString;
-    item->u.stringValue = str;
+AJournalReplayer::~AJournalReplayer() {
+    munmap(mData, mSize);
 }
 
-bool AMessage::findString(const char *name, std::string *value) const {
-    const Item *item = findItem(name, kTypeString);
-    if (item) {                                    
-        *value = *(item->u.stringValue);
-        return true;                               
-    }                                              
-    return false;
+void AJournalReplayer::setTarget(handler_id recorded, const sp<AHandler> &handler) {
+    mTargets[recorded] = handler;
 }
-    
-bool AMessage::contains(const char *name) const {
-    size_t i = findItemIndex(name, strlen(name));
-    return i < mNumItems;
+
+void AJournalReplayer::setDefaultTarget(const sp<AHandler> &handler) {
+    mDefaultTarget = handler;
 }
 
-status_t AMessage::post(int64_t delayUs){
-    sp<ALooper> looper = mLooper.lock();
-    if (!looper) {
-        logw("failed to post message as target looper for handler %d is gone.", mTarget);
-        return NOT_FOUND;
+//func(target, timeUs, data, size)，遇到结束标记或不完整的记录时停止
+template<class Func>
+void AJournalReplayer::forEachRecord(Func func) const {
+    size_t pos = kJournalHeaderSize;
+    while (mSize - pos >= 8) {
+        const uint8_t *p = mData + pos;
+        uint32_t size = getLE32(p);
+        if (size == kJournalSkip) {
+            uint32_t skip = getLE32(p + 4);
+            if (skip < 8 || skip > mSize - pos) {
+                break;
+            }
+            pos += skip;
+            continue;
+        }
+        if (size == 0 || mSize - pos < kRecordHeaderSize
+                || size > mSize - pos - kRecordHeaderSize) {
+            break;
+        }
+        func((handler_id)getLE64(p + 8), (int64_t)getLE64(p + 16), p + kRecordHeaderSize, size);
+        pos += roundUp(kRecordHeaderSize + size, 8);
     }
+}
 
-    looper->post(shared_from_this(), delayUs);
-    return OK;
+size_t AJournalReplayer::count() const {
+    size_t count = 0;
+    forEachRecord([&count](handler_id, int64_t, const uint8_t *, size_t) {
+        ++count;
+    });
+    return count;
 }
 
-// Posts the message to its target and waits for a response (or error)
-// before returning.
-status_t AMessage::postAndAwaitResponse(sp<AMessage> *response){
-    sp<ALooper> looper = mLooper.lock();
-    if (!looper) {
-        logw("failed to post message as target looper for handler %d is gone.", mTarget);
-        return NOT_FOUND;
-    }
+size_t AJournalReplayer::replay(bool realtime) {
+    size_t posted = 0;
+    int64_t firstUs = 0;
+    int64_t startUs = 0;
+    forEachRecord([&](handler_id recorded, int64_t timeUs, const uint8_t *data, size_t size) {
+        auto it = mTargets.find(recorded);
+        sp<AHandler> target = it != mTargets.end() ? it->second.lock() : mDefaultTarget.lock();
+        auto msg = AMessage::readFromBuffer(data, size);
+        if (target == NULL || msg == NULL) {
+            return;
+        }
 
-    sp<AReplyToken> token = looper->createReplyToken();
-    if (!token) {
-        loge("failed to create reply token");
-        return NOT_FOUND;
-    }
-    setObject("replyID", token);
+        //按第一条记录对齐时间，之后保持相同的间隔
+        if (realtime) {
+            int64_t nowUs = ALooper::GetNowUs();
+            if (startUs == 0) {
+                firstUs = timeUs;
+                startUs = nowUs;
+            }
+            int64_t waitUs = startUs + (timeUs - firstUs) - nowUs;
+            if (waitUs > 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(waitUs));
+            }
+        }
 
-    looper->post(shared_from_this(), 0 /* delayUs */);
-    return looper->awaitResponse(token, response);
+        msg->setTarget(target);
+        if (msg->post() == OK) {
+            ++posted;
+        }
+    });
+    return posted;
 }
+//持久化队列的段文件格式，整数均为小端：
+//  段头（16字节）：magic "AQSG"，version u32，checkpoint u32，reserved u32
+//      checkpoint之前的记录都已完成，恢复时从这里开始扫描
+//  之后是按8字节对齐的记录：
+//      size    u32   消息数据的字节数，最后写入，为0表示段结束
+//      port    u32   接收者绑定的port
+//      state   u32   0 未完成；1 已完成
+//      reserved u32
+//      dueUs   i64   应当分发的时间（系统时间），重启后据此计算剩余的延迟
+//      data    size字节，writeToBuffer()的格式
+//  记录的位置为段序号 << 32 | 段内偏移
+static const uint8_t kSegmentMagic[4] = {'A', 'Q', 'S', 'G'};
+static const uint32_t kSegmentVersion = 1;
+static const size_t kSegmentHeaderSize = 16;
+static const size_t kQueueRecordHeaderSize = 24;
+static const uint32_t kRecordPending = 0;
+static const uint32_t kRecordDone = 1;
 
-// If this returns true, the sender of this message is synchronously
-// awaiting a response and the reply token is consumed from the message
-// and stored into replyID. The reply token must be used to send the response
-// using "postReply" below.
-bool AMessage::senderAwaitsResponse(sp<AReplyToken> *replyToken){
-    bool found = findObject("replyID", replyToken);
+static int64_t getRealtimeUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
 
-    if (!found) {
-        return false;
+struct APersistentQueue::Segment {
+    uint32_t mIndex;
+    int mFd;
+    uint8_t *mData;
+    size_t mSize;
+    size_t mUsed;       // 下一条记录的位置
+    size_t mSynced;     // 已经msync的长度，只在mSyncLock下修改
+    size_t mPending;    // 未完成的记录数
+
+    Segment() : mIndex(0), mFd(-1), mData(NULL), mSize(0), mUsed(0), mSynced(0), mPending(0) {}
+    ~Segment() {
+        if (mData != NULL) {
+            munmap(mData, mSize);
+        }
+        if (mFd >= 0) {
+            ::close(mFd);
+        }
     }
+};
 
-    return (*replyToken)!=nullptr;
+static string segmentPath(const string &dir, uint32_t index) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%010u.aqs", index);
+    return dir + name;
 }
 
-// Posts the message as a response to a reply token.  A reply token can
-// only be used once. Returns OK if the response could be posted; otherwise,
-// an error.
-status_t AMessage::postReply(const sp<AReplyToken> &replyToken){
-    if (replyToken == nullptr) {
-        logw("failed to post reply to a NULL token");
-        return NOT_FOUND;
+APersistentQueue::APersistentQueue(const char *dir, size_t syncBatch, size_t segmentSize)
+    : mDir(dir),
+    mSyncBatch(syncBatch),
+    mSegmentSize(segmentSize),
+    mNextIndex(0),
+    mAttached(false),
+    mPending(0),
+    mAppended(0),
+    mScheduled(0),
+    mSynced(0),
+    mSyncs(0) {
+}
+
+sp<APersistentQueue> APersistentQueue::open(const char *dir, size_t syncBatch, size_t segmentSize) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    segmentSize = roundUp(std::max(segmentSize, pageSize), pageSize);
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        loge("failed to create queue %s: %s", dir, strerror(errno));
+        return sp<APersistentQueue>();
     }
-    sp<ALooper> looper = replyToken->getLooper();
-    if (looper == NULL) {
-        logw("failed to post reply as target looper is gone.");
-        return NOT_FOUND;
+    sp<APersistentQueue> queue(new APersistentQueue(dir, syncBatch, segmentSize));
+    if (!queue->load()) {
+        return sp<APersistentQueue>();
     }
-    return looper->postReply(replyToken, shared_from_this());
+    return queue;
 }
 
-// Performs a deep-copy of "this", contained messages are in turn "dup'ed".
-// Warning: RefBase items, i.e. "objects" are _not_ copied but only have
-// their refcount incremented.
-sp<AMessage> AMessage::dup() const {
-    auto msg = AMessage::create(mWhat, mHandler.lock());
-    msg->mNumItems = mNumItems;
+APersistentQueue::~APersistentQueue() {
+    sync();
+}
 
-    for (size_t i = 0; i < mNumItems; ++i) {
-        const Item *from = &mItems[i];
-        Item *to = &msg->mItems[i];
+//映射已有的段，统计未完成的记录，全部完成的段直接删除
+bool APersistentQueue::load() {
+    DIR *d = opendir(mDir.c_str());
+    if (d == NULL) {
+        loge("failed to open queue %s: %s", mDir.c_str(), strerror(errno));
+        return false;
+    }
+    vector<uint32_t> indexes;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        uint32_t index = 0;
+        int length = 0;
+        if (sscanf(entry->d_name, "%10u.aqs%n", &index, &length) == 1
+                && entry->d_name[length] == '\0') {
+            indexes.push_back(index);
+        }
+    }
+    closedir(d);
+    std::sort(indexes.begin(), indexes.end());
 
-        to->setName(from->mName, from->mNameLength);
-        to->mType = from->mType;
+    for (uint32_t index : indexes) {
+        mNextIndex = index + 1;
+        string path = segmentPath(mDir, index);
+        sp<Segment> segment(new Segment);
+        segment->mIndex = index;
+        segment->mFd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if (segment->mFd < 0 || fstat(segment->mFd, &st) != 0 || (size_t)st.st_size < kSegmentHeaderSize) {
+            logw("skip invalid segment %s", path.c_str());
+            continue;
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->mFd, 0);
+        if (map == MAP_FAILED) {
+            loge("failed to map segment %s: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+        segment->mData = static_cast<uint8_t *>(map);
+        segment->mSize = st.st_size;
+        if (memcmp(segment->mData, kSegmentMagic, 4) || getLE32(segment->mData + 4) != kSegmentVersion) {
+            logw("skip invalid segment %s", path.c_str());
+            continue;
+        }
 
-        switch (from->mType) {
-            case kTypeString:{
-                to->u.stringValue =
-                    new std::string(*from->u.stringValue);
+        size_t pos = getLE32(segment->mData + 8);
+        if (pos < kSegmentHeaderSize || pos > segment->mSize) {
+            pos = kSegmentHeaderSize;
+        }
+        while (segment->mSize - pos >= kQueueRecordHeaderSize) {
+            const uint8_t *p = segment->mData + pos;
+            uint32_t size = getLE32(p);
+            if (size == 0 || size > segment->mSize - pos - kQueueRecordHeaderSize) {
                 break;
             }
-            default:{
-                to->u = from->u;
-                break;
+            if (getLE32(p + 8) != kRecordDone) {
+                ++segment->mPending;
             }
+            pos += roundUp(kQueueRecordHeaderSize + size, 8);
         }
-    }
+        segment->mUsed = std::min(pos, segment->mSize);
+        segment->mSynced = segment->mUsed;
 
-    return msg;
+        if (segment->mPending == 0) {
+            unlink(path.c_str());
+            continue;
+        }
+        mPending += segment->mPending;
+        mSegments[index] = segment;
+    }
+    return true;
 }
 
-AMessage::~AMessage() {
-    clear();
+sp<APersistentQueue::Segment> APersistentQueue::createSegmentLocked(size_t size) {
+    sp<Segment> segment(new Segment);
+    segment->mIndex = mNextIndex;
+    string path = segmentPath(mDir, segment->mIndex);
+    segment->mFd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (segment->mFd < 0 || ftruncate(segment->mFd, size) != 0) {
+        loge("failed to create segment %s: %s", path.c_str(), strerror(errno));
+        return sp<Segment>();
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->mFd, 0);
+    if (map == MAP_FAILED) {
+        loge("failed to map segment %s: %s", path.c_str(), strerror(errno));
+        unlink(path.c_str());
+        return sp<Segment>();
+    }
+    segment->mData = static_cast<uint8_t *>(map);
+    segment->mSize = size;
+    memcpy(segment->mData, kSegmentMagic, 4);
+    putLE32(segment->mData + 4, kSegmentVersion);
+    putLE32(segment->mData + 8, kSegmentHeaderSize);
+    segment->mUsed = kSegmentHeaderSize;
+
+    //目录项也要落盘，否则系统崩溃后可能找不到新的段
+    if (mSyncBatch > 0) {
+        int fd = ::open(mDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            fsync(fd);
+            ::close(fd);
+        }
+    }
+
+    ++mNextIndex;
+    mSegments[segment->mIndex] = segment;
+    return segment;
 }
 
-// assumes item's name was uninitialized or NULL
-void AMessage::Item::setName(const char *name, size_t len) {
-    mNameLength = len;
-    mName = new char[len + 1];
-    memcpy((void*)mName, name, len + 1);
+void APersistentQueue::removeSegmentLocked(const sp<Segment> &segment) {
+    unlink(segmentPath(mDir, segment->mIndex).c_str());
+    mSegments.erase(segment->mIndex);
 }
 
-AMessage::Item *AMessage::allocateItem(const char *name){
-    size_t len = strlen(name);
-    size_t i = findItemIndex(name, len);
-    Item *item;
+status_t APersistentQueue::bindHandler(uint32_t port, const sp<AHandler> &handler) {
+    if (handler == NULL || handler->id() == INVALID_HANDLER_ID) {
+        return INVALID_OPERATION;
+    }
 
-    if (i < mNumItems) {
-        item = &mItems[i];
-        freeItemValue(item);
-    } else {
-        CHECK(mNumItems < kMaxNumItems);
-        i = mNumItems++;
-        item = &mItems[i];
-        item->setName(name, len);
+    sp<ALooper> looper;
+    vector<Restored> restored;
+    {
+        Autolock l(mLock);
+        //原来绑定的handler已经析构时视为未绑定
+        auto it = mHandlers.find(port);
+        if (it != mHandlers.end() && it->second.expired()) {
+            unbindLocked(port);
+        }
+        if (mHandlers.find(port) != mHandlers.end() || mPorts.find(handler->id()) != mPorts.end()) {
+            return INVALID_OPERATION;
+        }
+        mHandlers[port] = handler;
+        mPorts[handler->id()] = port;
+
+        //与绑定在同一个锁内收集，之后追加的消息已经在looper的队列中
+        looper = mLooper.lock();
+        if (looper != NULL) {
+            collectLocked(&port, &restored);
+        }
     }
+    if (looper != NULL) {
+        insertRestored(looper, &restored);
+    }
+    return OK;
+}
 
-    return item;
+status_t APersistentQueue::unbindHandler(uint32_t port) {
+    Autolock l(mLock);
+    return unbindLocked(port) ? OK : NOT_FOUND;
 }
 
-void AMessage::freeItemValue(Item *item){
-    switch (item->mType) {
-        case kTypeString:{
-            delete item->u.stringValue;
+bool APersistentQueue::unbindLocked(uint32_t port) {
+    if (mHandlers.erase(port) == 0) {
+        return false;
+    }
+    for (auto it = mPorts.begin(); it != mPorts.end(); ++it) {
+        if (it->second == port) {
+            mPorts.erase(it);
             break;
         }
+    }
+    return true;
+}
 
-        case kTypeObject:{
-            delete item->u.refValue;
-            break;
+bool APersistentQueue::attach(const sp<ALooper> &looper) {
+    vector<Restored> restored;
+    {
+        Autolock l(mLock);
+        if (mAttached) {
+            return false;
         }
-
-        default:
-            break;
+        mAttached = true;
+        mLooper = looper;
+        collectLocked(NULL, &restored);
     }
+    insertRestored(looper, &restored);
+    return true;
 }
 
-const AMessage::Item *AMessage::findItem(const char *name, Type type) const {
-    size_t i = findItemIndex(name, strlen(name));
+//按段的顺序收集已绑定port的未完成消息，port为NULL时收集所有已绑定的port
+void APersistentQueue::collectLocked(const uint32_t *port, vector<Restored> *restored) {
+    vector<uint32_t> indexes;
+    for (auto &it : mSegments) {
+        indexes.push_back(it.first);
+    }
+    std::sort(indexes.begin(), indexes.end());
 
-    if (i < mNumItems) {
-        const Item *item = &mItems[i];
-        return item->mType == type ? item : NULL;
+    int64_t nowUs = getRealtimeUs();
+    for (uint32_t index : indexes) {
+        Segment *segment = mSegments[index].get();
+        size_t pos = getLE32(segment->mData + 8);
+        while (pos < segment->mUsed) {
+            const uint8_t *p = segment->mData + pos;
+            uint32_t size = getLE32(p);
+            uint64_t record = (uint64_t)index << 32 | pos;
+            pos += roundUp(kQueueRecordHeaderSize + size, 8);
+
+            uint32_t recordPort = getLE32(p + 4);
+            if (getLE32(p + 8) == kRecordDone || (port != NULL && recordPort != *port)) {
+                continue;
+            }
+            auto it = mHandlers.find(recordPort);
+            sp<AHandler> handler = it != mHandlers.end() ? it->second.lock() : NULL;
+            if (handler == NULL) {
+                continue;
+            }
+            sp<AMessage> msg = AMessage::readFromBuffer(p + kQueueRecordHeaderSize, size);
+            if (msg == NULL) {
+                logw("drop corrupted record %u:%zu", index, (size_t)(record & 0xffffffff));
+                continue;
+            }
+            msg->setTarget(handler);
+            restored->push_back(Restored{msg, (int64_t)getLE64(p + 16) - nowUs, record});
+        }
+    }
+}
+
+//恢复的消息可能很多，排序后与队列合并，避免逐条插入
+void APersistentQueue::insertRestored(const sp<ALooper> &looper, vector<Restored> *restored) {
+    if (restored->empty()) {
+        return;
+    }
+    int64_t nowUs = ALooper::GetNowUs();
+    std::list<ALooper::Event> events;
+    for (auto &r : *restored) {
+        events.push_back(ALooper::Event{nowUs + std::max(r.mDelayUs, (int64_t)0), r.mMessage, r.mRecord, shared_from_this()});
     }
+    auto earlier = [](const ALooper::Event &a, const ALooper::Event &b) {
+        return a.mWhenUs < b.mWhenUs;
+    };
+    events.sort(earlier);
 
-    return NULL;
+    Autolock l(looper->mLock);
+    looper->mEventQueue.merge(events, earlier);
+    looper->wakeLocked();
 }
 
-size_t AMessage::findItemIndex(const char *name, size_t len) const {
-    size_t i = 0;
-    for (; i < mNumItems; i++) {
-        if (len != mItems[i].mNameLength) {
-            continue;
+uint64_t APersistentQueue::append(const sp<AMessage> &msg, int64_t delayUs) {
+    uint32_t port;
+    {
+        Autolock l(mLock);
+        auto it = mPorts.find(msg->target());
+        if (it == mPorts.end()) {
+            return 0;
         }
-        if (!memcmp(mItems[i].mName, name, len)) {
-            break;
+        port = it->second;
+    }
+
+    static thread_local vector<uint8_t> tBuffer;
+    tBuffer.clear();
+    if (msg->writeToBuffer(&tBuffer) != OK) {
+        logw("message %d to port %u can't be persisted", msg->what(), port);
+        return 0;
+    }
+    size_t size = tBuffer.size();
+    size_t need = roundUp(kQueueRecordHeaderSize + size, 8);
+    int64_t dueUs = getRealtimeUs() + std::max(delayUs, (int64_t)0);
+
+    uint64_t record;
+    uint64_t appended;
+    {
+        Autolock l(mLock);
+        if (mCurrent == NULL || mCurrent->mSize - mCurrent->mUsed < need) {
+            sp<Segment> segment = createSegmentLocked(roundUp(kSegmentHeaderSize + need, mSegmentSize));
+            if (segment == NULL) {
+                return 0;
+            }
+            if (mCurrent != NULL && mCurrent->mPending == 0) {
+                removeSegmentLocked(mCurrent);
+            }
+            mCurrent = segment;
+        }
+
+        Segment *segment = mCurrent.get();
+        uint8_t *p = segment->mData + segment->mUsed;
+        putLE32(p + 4, port);
+        putLE32(p + 8, kRecordPending);
+        putLE32(p + 12, 0);
+        putLE64(p + 16, (uint64_t)dueUs);
+        memcpy(p + kQueueRecordHeaderSize, tBuffer.data(), size);
+        putLE32(p, (uint32_t)size);
+
+        record = (uint64_t)segment->mIndex << 32 | segment->mUsed;
+        segment->mUsed += need;
+        ++segment->mPending;
+        ++mPending;
+        appended = ++mAppended;
+        if (mSyncBatch == 0 || appended - mScheduled < mSyncBatch) {
+            return record;
         }
+        mScheduled = appended;
     }
-    return i;
+    syncTo(appended);
+    return record;
 }
 
-void AMessage::deliver() {
-    sp<AHandler> handler = mHandler.lock();
-    if (handler == NULL) {
-        logw("failed to deliver message as target handler %d is gone.", mTarget);
+void APersistentQueue::complete(uint64_t record) {
+    Autolock l(mLock);
+    auto it = mSegments.find((uint32_t)(record >> 32));
+    if (it == mSegments.end()) {
         return;
     }
+    sp<Segment> segment = it->second;
+    size_t offset = (size_t)(record & 0xffffffff);
+    uint8_t *p = segment->mData + offset;
+    if (getLE32(p + 8) == kRecordDone) {
+        return;
+    }
+    putLE32(p + 8, kRecordDone);
+    --segment->mPending;
+    --mPending;
 
-    handler->deliverMessage(shared_from_this());
-}
+    //推进检查点，跳过连续已完成的记录
+    if (offset == getLE32(segment->mData + 8)) {
+        size_t pos = offset;
+        while (pos < segment->mUsed && getLE32(segment->mData + pos + 8) == kRecordDone) {
+            pos += roundUp(kQueueRecordHeaderSize + getLE32(segment->mData + pos), 8);
+        }
+        putLE32(segment->mData + 8, (uint32_t)pos);
+    }
 
-size_t AMessage::countEntries() const {
-    return mNumItems;
+    if (segment->mPending == 0 && segment != mCurrent) {
+        removeSegmentLocked(segment);
+    }
 }
 
-const char *AMessage::getEntryNameAt(size_t index, Type *type) const {
-    if (index >= mNumItems) {
-        *type = kTypeInt32;
+//group commit：等待mSyncLock期间其他线程追加的消息由同一次msync覆盖
+void APersistentQueue::syncTo(uint64_t appended) {
+    Autolock s(mSyncLock);
+    uint64_t target;
+    vector<std::pair<sp<Segment>, size_t>> dirty;
+    {
+        Autolock l(mLock);
+        if (mSynced >= appended) {
+            return;
+        }
+        target = mAppended;
+        for (auto &it : mSegments) {
+            if (it.second->mSynced < it.second->mUsed) {
+                dirty.push_back(std::make_pair(it.second, it.second->mUsed));
+            }
+        }
+    }
 
-        return NULL;
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    for (auto &d : dirty) {
+        size_t from = d.first->mSynced / pageSize * pageSize;
+        if (msync(d.first->mData + from, d.second - from, MS_SYNC) != 0) {
+            logw("failed to sync segment %u: %s", d.first->mIndex, strerror(errno));
+        }
+    }
+
+    Autolock l(mLock);
+    for (auto &d : dirty) {
+        d.first->mSynced = d.second;
+    }
+    mSynced = target;
+    ++mSyncs;
+}
+
+void APersistentQueue::sync() {
+    uint64_t appended;
+    {
+        Autolock l(mLock);
+        appended = mAppended;
     }
+    syncTo(appended);
+}
 
-    *type = mItems[index].mType;
+size_t APersistentQueue::getPendingCount() const {
+    Autolock l(mLock);
+    return mPending;
+}
 
-    return mItems[index].mName;
+void APersistentQueue::getStats(uint64_t *appended, uint64_t *syncs) const {
+    Autolock l(mLock);
+    *appended = mAppended;
+    *syncs = mSyncs;
 }
+#endif
 
-}
\ No newline at end of file
+}
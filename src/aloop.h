@@ -9,11 +9,15 @@
 #include <list>
 #include <atomic>
 #include <map>
+#include <vector>
+#include <unordered_map>
 #include <thread>
 #include <chrono>
 #include <cassert>
 #include <string.h>
 #include <functional>
+#include <type_traits>
+#include <tuple>
 
 #define ALOOP_LOG_LEVEL_INFO 0
 #define ALOOP_LOG_LEVEL_WARN 1
@@ -34,16 +38,32 @@ enum{
     NO_MEM         = -ENOMEM,
     BUSY           = -EBUSY
 };
-typedef int32_t handler_id;
+typedef int64_t handler_id;
 extern const handler_id INVALID_HANDLER_ID;
 
 class AMessage;
+class ABuffer;
 class AReplyToken;
 class AHandler;
 class ALooper;
+class AMessageRecorder;
+class APersistentQueue;
 
 void setPrintFunc(std::function<void(int level, const char* msg)> doPrint);
 
+/**
+ * @brief handler注册表的统计信息，可定期采样观察注册表规模的变化
+ */
+struct RosterStats {
+    size_t liveHandlers;    // 当前已注册的handler数量
+    size_t slotCapacity;    // 已分配的slot数量（历史最大并发注册数）
+    uint64_t registered;    // 累计注册次数
+    uint64_t unregistered;  // 累计注销次数，包括下面的自动清理
+    uint64_t pruned;        // handler未注销就析构时被自动清理的次数
+};
+
+RosterStats getRosterStats();
+
 
 /**
  * @brief 消息处理类。需要用户继承，并实现onMessageReceived方法，根据消息类型进行处理
@@ -52,6 +72,11 @@ class AHandler{
 public:
     AHandler();
 
+    /**
+     * @brief 如果析构时仍处于注册状态，会自动从所在looper上注销
+     */
+    virtual ~AHandler();
+
     handler_id id() const;
 
     std::weak_ptr<ALooper> getLooper() const;
@@ -59,14 +84,28 @@ public:
 protected:
     virtual void onMessageReceived(const std::shared_ptr<AMessage> &msg) = 0;
 
+    /**
+     * @brief 通过ALooper::addFd()监听的fd就绪时，在该looper的线程上调用
+     * @param events ALooper::EVENT_INPUT等的组合
+     */
+    virtual void onFdEvent(int /*fd*/, uint32_t /*events*/) {}
+
 private:
     friend class AMessage;      // deliverMessage()
     friend class ALooperRoster; // setID()
+    friend class ALooper;       // onFdEvent()
 
     std::atomic<handler_id> mID;
+
+    // 所在looper的缓存，由ALooperRoster在注册、注销、迁移时更新，mLooperLock保护
+    mutable std::atomic_flag mLooperLock;
     std::weak_ptr<ALooper> mLooper;
+    // 迁移次数，消息创建时记录，不变时消息中缓存的looper仍然有效
+    std::atomic<uint32_t> mMigrations;
 
-    void setID(handler_id id, std::weak_ptr<ALooper> looper);
+    void setID(handler_id id);
+    std::weak_ptr<ALooper> getLooper(uint32_t *migrations) const;
+    void setLooper(const std::weak_ptr<ALooper> &looper, bool migrated);
 
     void deliverMessage(const std::shared_ptr<AMessage> &msg);
 
@@ -104,6 +143,35 @@ public:
      */
     void unregisterHandler(handler_id handlerID);
 
+    /**
+     * @brief 批量注册handler。比逐个调用registerHandler开销更小，适合一次性创建大量handler的场景
+     * @param handlers 要注册的handler
+     * @return 与handlers一一对应的id，注册失败的位置为INVALID_HANDLER_ID
+     */
+    std::vector<handler_id> registerHandlers(const std::vector<std::shared_ptr<AHandler>> &handlers);
+
+    /**
+     * @brief 批量注销handler
+     * @param handlerIDs 要注销的handler的id
+     */
+    void unregisterHandlers(const std::vector<handler_id> &handlerIDs);
+
+    /**
+     * @brief 将注册在该looper上的handler迁移到另一个looper，handler的id保持不变
+     *      该handler还未处理的消息会按原有顺序转到目标looper上；
+     *      之前创建的消息在post时会发往新的looper。
+     *      looper运行中时，迁移会在looper线程上处理完当前消息后异步完成，保证迁移时该handler不在处理消息
+     * @param handlerID 要迁移的handler的id
+     * @param target 目标looper
+     * @return OK,迁移成功或已提交；NOT_FOUND,handler没有注册在该looper上；INVALID_OPERATION,目标looper无效
+     */
+    status_t migrateHandler(handler_id handlerID, const std::shared_ptr<ALooper> &target);
+
+    /**
+     * @return 当前消息队列中的消息数量
+     */
+    size_t getQueueDepth();
+
     /**
      * @brief 启动looper，开始等待消息
      * @param runOnCallingThread true,在调用线程上执行loop循环; false,使用内部新建的线程
@@ -113,14 +181,123 @@ public:
 
     /**
      * @brief 停止loop循环。
-     *      需要当前在处理消息执行完成才会停止。
-     *      未处理的消息会滞留在消息队列中。
+     *      需要当前在处理消息执行完成才会停止。由pollOnce()驱动时，宿主不再调用pollOnce()前需要调用stop()，
+     *      停止后其他线程上等待回复的postAndAwaitResponse返回错误。
+     *      未处理的消息会滞留在消息队列中，开启持久化队列时进程重启后还会恢复，见setPersistentQueue()。
      * @return OK，停止成功
      */
     status_t stop();
 
     static int64_t GetNowUs();
 
+    /**
+     * @brief 不启动looper，由外部的事件循环驱动：分发已到期的消息后立即返回，不会等待
+     *      在调用线程上分发，同一时刻只能有一个线程调用。linux上会同时处理addFd()的fd和异步I/O，
+     *      并设置好下一条消息的定时，宿主等待getWakeFd()可读后再次调用即可。
+     *      调用过之后，其他线程可以对该looper上的handler使用postAndAwaitResponse，直到stop()。
+     *      looper并不知道宿主何时不再调用pollOnce()，宿主停止驱动时必须调用stop()，
+     *      否则等待回复的线程会一直阻塞（looper析构时也会调用stop()）
+     * @param maxMessages 本次最多分发的消息数量，为0时按1处理
+     * @param maxTimeUs 本次分发的时间预算，超过后剩余消息留到下次；为-1时不限制。至少会分发一条
+     * @return 距下一条消息到期的时间（us），0表示还有已到期的消息需要再次调用；
+     *      -1表示队列为空，或looper已通过start()启动
+     */
+    int64_t pollOnce(size_t maxMessages = (size_t)-1, int64_t maxTimeUs = -1);
+
+    /**
+     * @brief 设置消息记录器，之后分发的每条消息在交给handler前先交给recorder
+     * @param recorder 为NULL时停止记录
+     */
+    void setRecorder(const std::shared_ptr<AMessageRecorder> &recorder);
+
+#ifdef __linux__
+    enum {
+        EVENT_INPUT = 1 << 0,   // 可读
+        EVENT_OUTPUT = 1 << 1,  // 可写
+        EVENT_ERROR = 1 << 2,   // 出错，总是会报告
+        EVENT_HANGUP = 1 << 3,  // 对端关闭，总是会报告
+    };
+
+    /**
+     * @brief 监听fd，就绪时在looper线程上调用handler->onFdEvent()，不经过消息队列
+     *      第一次调用后looper改为在epoll上等待，消息的唤醒和定时分别通过eventfd和timerfd。
+     *      水平触发，fd一直就绪时每轮都会回调；同一个fd再次添加时替换原来的events和handler
+     * @param events EVENT_INPUT、EVENT_OUTPUT的组合
+     * @param handler 必须已经注册到该looper。只保存弱引用，handler析构后自动移除fd
+     * @return OK,添加成功；INVALID_OPERATION,参数无效、handler没有注册到该looper或epoll_ctl失败
+     */
+    status_t addFd(int fd, uint32_t events, const std::shared_ptr<AHandler> &handler);
+
+    /**
+     * @brief 停止监听fd。在回调中调用也是安全的
+     * @return OK,移除成功；NOT_FOUND,没有监听该fd
+     */
+    status_t removeFd(int fd);
+
+    /**
+     * @brief 异步I/O完成时在looper线程上调用
+     * @param result 成功时为读写的字节数或accept得到的fd，失败时为-errno
+     */
+    typedef std::function<void(int32_t result)> IoCallback;
+
+    /**
+     * @brief 改用io_uring作为looper的后端，需要在start()前调用
+     *      消息的唤醒、定时、addFd()的fd以及submitRead()等异步I/O都通过同一个ring等待。
+     *      内核不支持或被禁止时返回失败，looper保持原来的条件变量/epoll方式，submitRead()等仍然可用
+     * @param entries 提交队列的大小
+     * @return OK,已启用；INVALID_OPERATION,looper已启动、已启用或io_uring不可用
+     */
+    status_t enableIoUring(unsigned entries = 256);
+
+    bool isIoUringEnabled() const;
+
+    /**
+     * @brief 异步读取到buffer，从base()开始最多读capacity()字节，成功后range为读到的数据
+     *      启用io_uring时由内核执行；否则用epoll等待fd可读后在looper线程上读，普通文件直接读。
+     *      在looper线程上提交时，io_uring的请求会在本轮消息处理完后一起提交
+     * @param offset 文件偏移，为-1时使用fd当前的位置（socket、pipe等必须为-1）
+     * @param notify 完成时设置"result"（int32）和"buffer"后post
+     * @return OK,已提交；INVALID_OPERATION,参数无效或提交失败
+     */
+    status_t submitRead(int fd, const std::shared_ptr<ABuffer> &buffer, int64_t offset,
+        const std::shared_ptr<AMessage> &notify);
+    status_t submitRead(int fd, const std::shared_ptr<ABuffer> &buffer, int64_t offset,
+        const IoCallback &callback);
+
+    /**
+     * @brief 异步写出buffer的data()到size()，其他同submitRead()
+     */
+    status_t submitWrite(int fd, const std::shared_ptr<ABuffer> &buffer, int64_t offset,
+        const std::shared_ptr<AMessage> &notify);
+    status_t submitWrite(int fd, const std::shared_ptr<ABuffer> &buffer, int64_t offset,
+        const IoCallback &callback);
+
+    /**
+     * @brief 异步accept，result为新连接的fd（带有FD_CLOEXEC），其他同submitRead()
+     */
+    status_t submitAccept(int fd, const std::shared_ptr<AMessage> &notify);
+    status_t submitAccept(int fd, const IoCallback &callback);
+
+    /**
+     * @brief 开启持久化队列，需要在start()和post之前调用，且只能设置一次
+     *      之后post给queue中已绑定handler的消息先追加到queue再入队，分发完成后才标记为已完成；
+     *      handler迁移到其他looper时，记录随消息一起转移，由目标looper分发后标记完成；
+     *      handler已注销、找不到接收者的消息不会标记完成，port再次绑定时恢复。
+     *      上次进程退出时未完成的消息会被恢复到该looper的消息队列中
+     * @return OK,设置成功；INVALID_OPERATION,looper已启动、已设置过或queue已被其他looper使用
+     */
+    status_t setPersistentQueue(const std::shared_ptr<APersistentQueue> &queue);
+
+    /**
+     * @brief 返回可加入外部epoll/poll等待的fd，可读时调用pollOnce()
+     *      消息入队、下一条消息到期、addFd()的fd就绪及异步I/O完成时都会变为可读。
+     *      第一次调用后looper改为epoll方式（启用io_uring时返回ring的fd），
+     *      之后需要先调用一次pollOnce()再开始等待，使定时等设置生效
+     * @return fd由looper持有，不要关闭；失败时返回-1
+     */
+    int getWakeFd();
+#endif
+
     /**
      * @return looper名字
      */
@@ -131,15 +308,66 @@ public:
 
 private:
     friend class AMessage;       // post()
+    friend class ALooperRoster;  // mHandlers
+    friend class ALooperBalancer; // getBusiestHandler()
+    friend class APersistentQueue; // insertEventLocked()
     bool mRun;
 
     struct Event {
         int64_t mWhenUs;
         std::shared_ptr<AMessage> mMessage;
+        uint64_t mRecord;   // 在持久化队列中的位置，0表示没有持久化
+        // mRecord所在的队列。消息转发、迁移到其他looper后，由最终派发的looper通过它标记完成
+        std::shared_ptr<APersistentQueue> mQueue;
     };
 
     std::mutex mLock;
     std::condition_variable mQueueChangedCondition;
+    std::shared_ptr<AMessageRecorder> mRecorder; // mLock
+#ifdef __linux__
+    std::shared_ptr<APersistentQueue> mPersistentQueue; // 在start()前设置，mLock
+
+    // 第一次addFd()时创建，之后loop()在epoll上等待，mLock
+    int mEpollFd;
+    int mWakeFd;    // eventfd，消息队列头部变化时唤醒
+    int mTimerFd;   // timerfd，队列头部消息的到期时间
+    int64_t mTimerDeadlineUs;   // timerfd当前设置的时间，只在looper线程上访问
+    std::unordered_map<int, std::weak_ptr<AHandler>> mFdHandlers; // mLock
+
+    struct IoRequest {
+        uint8_t mOp;
+        int mFd;
+        int mDupFd;         // 没有io_uring时，在epoll中等待就绪的fd副本
+        int64_t mOffset;
+        std::shared_ptr<ABuffer> mBuffer;
+        std::shared_ptr<AMessage> mNotify;
+        IoCallback mCallback;
+    };
+    struct IoCompletion {
+        IoRequest mRequest;
+        int32_t mResult;
+    };
+    struct IoRing;
+
+    std::unique_ptr<IoRing> mRing;  // 在start()前设置，之后只读
+    std::mutex mIoLock;             // 保护下面的成员和ring的提交队列
+    uint64_t mNextIoID;
+    std::unordered_map<uint64_t, IoRequest> mIoRequests;
+    std::vector<IoCompletion> mIoCompletions;   // 没有io_uring时，直接完成的普通文件读写
+    std::atomic<bool> mHasIoCompletions;
+
+    bool initEpollLocked();
+    bool ensureEpollLocked();
+    bool waitEvents(int64_t deadlineUs, bool wait);
+    bool pollFds(int64_t deadlineUs, bool wait);
+    bool isFdHandler(int fd, const std::shared_ptr<AHandler> &handler);
+    bool ringWait(int64_t deadlineUs, bool wait);
+    status_t submitIo(IoRequest &request);
+    bool processIoCompletions();
+    bool completeIo(std::vector<IoCompletion> *completions);
+    void cancelIo();
+    static int32_t performIo(const IoRequest &request);
+#endif
 
     std::string mName;
 
@@ -147,6 +375,39 @@ private:
 
     std::thread mThread;
     bool mRunningLocally;
+    bool mPolling; // 由pollOnce()驱动，只由stop()清除，mLock
+
+    // handlers registered on this looper, maintained by ALooperRoster.
+    // only used for bookkeeping (teardown, counting); delivery looks ids up in the roster
+    std::mutex mHandlersLock;
+    std::unordered_map<handler_id, std::weak_ptr<AHandler>> mHandlers;
+
+    std::weak_ptr<ALooper> mSelf;
+
+    // resolves the target of a message being delivered on this looper
+    std::shared_ptr<AHandler> resolveHandler(const std::shared_ptr<AMessage> &msg, const std::shared_ptr<ALooper> &self);
+
+    struct Migration {
+        handler_id mHandlerID;
+        std::shared_ptr<ALooper> mTarget;
+    };
+
+    // pending migrations, executed on the looper thread between two messages
+    std::vector<Migration> mMigrations;
+    std::atomic<bool> mHasMigrations;
+
+    void processMigrations(std::list<Event> *batch);
+    bool doMigrateHandler(handler_id handlerID, const std::shared_ptr<ALooper> &target, std::list<Event> *batch);
+
+    // the handler with the most pending messages, used by ALooperBalancer
+    handler_id getBusiestHandler(size_t *pending);
+    size_t countHandlers();
+
+    // inserts an event by its time, mLock must be held
+    void insertEventLocked(const Event &event);
+
+    // wakes up loop() waiting for messages or fds, mLock must be held
+    void wakeLocked();
 
     // use a separate lock for reply handling, as it is always on another thread
     // use a central lock, however, to avoid creating a mutex for each reply
@@ -171,10 +432,192 @@ private:
     // END --- methods used only by AMessage
 
     bool loop();
+    bool deliverEvents(std::list<Event> *batch, const std::shared_ptr<AMessageRecorder> &recorder,
+        bool polling, int64_t endUs);
 
     DISALLOW_EVIL_CONSTRUCTORS(ALooper);
 };
 
+/**
+ * @brief 记录ALooper分发的消息，见ALooper::setRecorder()
+ */
+class AMessageRecorder {
+public:
+    virtual ~AMessageRecorder() {}
+
+    /**
+     * @brief 在looper线程上、消息交给handler之前调用。多个looper共用时需要自己保证线程安全
+     * @param timeUs 分发的时间，与ALooper::GetNowUs()相同
+     */
+    virtual void record(const std::shared_ptr<AMessage> &msg, int64_t timeUs) = 0;
+};
+
+/**
+ * @brief 简单的负载均衡器。比较各looper的队列深度，
+ *      当最忙与最闲的looper队列深度相差超过阈值时，把最忙looper上积压消息最多的handler迁移到最闲的looper上
+ * 
+ * 可以直接调用rebalance()，也可以注册到某个looper上后调用start()定期执行
+ */
+class ALooperBalancer : public AHandler {
+public:
+    /**
+     * @param loopers 参与均衡的looper
+     * @param threshold 队列深度相差超过该值才迁移
+     */
+    ALooperBalancer(const std::vector<std::shared_ptr<ALooper>> &loopers, size_t threshold = 64);
+
+    /**
+     * @brief 执行一次均衡
+     * @return 被迁移的handler的id，没有迁移则返回INVALID_HANDLER_ID
+     */
+    handler_id rebalance();
+
+    /**
+     * @brief 每隔intervalUs执行一次rebalance()，需要先注册到looper上
+     * @return OK,启动成功；NOT_FOUND,还未注册
+     */
+    status_t start(int64_t intervalUs);
+
+    void stop();
+
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage> &msg);
+
+private:
+    enum {
+        kWhatRebalance = 1,
+    };
+
+    std::vector<std::weak_ptr<ALooper>> mLoopers;
+    size_t mThreshold;
+    std::atomic<int32_t> mGeneration;//start/stop时递增，使之前的定时消息失效
+    int64_t mIntervalUs;
+
+    DISALLOW_EVIL_CONSTRUCTORS(ALooperBalancer);
+};
+
+/**
+ * @brief 附加数据的名字。
+ *      同名的AKey共享全局intern表中的同一份名字，AMessage通过AKey设置附加数据时不需要复制名字，查找时只需比较指针。
+ *      一般定义成静态常量重复使用，如：static const AKey kWidth("width");
+ *      intern表中的名字不会释放，不要用不断变化的动态字符串创建AKey（AKey不受表大小的上限限制）
+ */
+class AKey {
+public:
+    AKey(const char *name);
+
+    /**
+     * @brief 使用预先计算好的hash创建，一般通过AKEY宏在编译期计算字面量的hash
+     */
+    AKey(const char *name, uint32_t hash);
+
+    const char *name() const { return mName; }
+    size_t length() const { return mLength; }
+    uint32_t hash() const { return mHash; }
+
+    /**
+     * @brief 名字的hash（FNV-1a），可在编译期计算
+     */
+    static constexpr uint32_t Hash(const char *name, uint32_t hash = 2166136261u) {
+        return *name ? Hash(name + 1, (hash ^ (uint8_t)*name) * 16777619u) : hash;
+    }
+
+    bool operator==(const AKey &other) const { return mName == other.mName; }
+    bool operator!=(const AKey &other) const { return mName != other.mName; }
+
+private:
+    friend class AMessage;
+    friend class AMessageView;
+
+    const char *mName;
+    size_t mLength;
+    uint32_t mHash;
+
+    static const char *intern(const char *name, size_t len, uint32_t hash);
+    // 表已满时不再加入新名字，返回NULL
+    static const char *tryIntern(const char *name, size_t len, uint32_t hash);
+    static uint32_t hashName(const char *name, size_t *len);
+};
+
+// 在编译期计算字面量的hash，如：static const AKey kWidth = AKEY("width");
+#define AKEY(literal) aloop::AKey(literal, std::integral_constant<uint32_t, aloop::AKey::Hash(literal)>::value)
+
+template<class T> class BufferAllocator;
+
+/**
+ * @brief 引用计数的数据缓冲区，用于在消息中传递媒体帧等大块数据
+ *      slice()得到的ABuffer与原buffer共享同一块内存，只是范围不同，不复制数据；内存在最后一个引用释放时释放
+ */
+class ABuffer : public std::enable_shared_from_this<ABuffer> {
+public:
+    enum {
+        kSimdAlignment = 64
+    };
+
+    /**
+     * @brief 分配capacity字节，有效范围为整个buffer
+     * @param alignment 起始地址的对齐，必须是2的幂，0表示默认对齐。SIMD处理的数据可用kSimdAlignment
+     * @return alignment非法时返回NULL
+     */
+    static std::shared_ptr<ABuffer> create(size_t capacity, size_t alignment = 0);
+
+    /**
+     * @brief 包装已有的内存，不复制。如共享内存中的数据
+     * @param owner 持有data所在的内存，所有引用data的ABuffer释放后才释放。为NULL时调用者保证data有效
+     */
+    static std::shared_ptr<ABuffer> wrap(void *data, size_t capacity,
+        const std::shared_ptr<void> &owner = std::shared_ptr<void>());
+
+    uint8_t *base() const { return mBase; }
+    uint8_t *data() const { return mBase + mRangeOffset; }
+    size_t capacity() const { return mCapacity; }
+    size_t size() const { return mRangeLength; }
+    size_t offset() const { return mRangeOffset; }
+
+    /**
+     * @brief 设置有效数据的范围
+     * @return OK；INVALID_OPERATION 超出capacity
+     */
+    status_t setRange(size_t offset, size_t size);
+
+    /**
+     * @brief 取当前有效范围内从offset开始的size字节，与当前buffer共享内存
+     * @return 超出有效范围时返回NULL
+     */
+    std::shared_ptr<ABuffer> slice(size_t offset, size_t size) const;
+
+private:
+    template<class T> friend class BufferAllocator; // 构造ABuffer
+
+    std::shared_ptr<void> mStorage; // create()分配的buffer持有自己的内存，为NULL
+    uint8_t *mBase;
+    size_t mCapacity;
+    size_t mRangeOffset;
+    size_t mRangeLength;
+
+    ABuffer(const std::shared_ptr<void> &storage, uint8_t *base, size_t capacity);
+
+    DISALLOW_EVIL_CONSTRUCTORS(ABuffer);
+};
+
+/**
+ * @brief AMessage::obtain()所用消息池的统计信息
+ */
+struct MessagePoolStats {
+    uint64_t obtained;  // 累计obtain()次数
+    uint64_t hits;      // 其中从池中取得内存的次数，hits / obtained即命中率
+    uint64_t refills;   // 线程缓存为空时从全局列表批量取回的次数（多为其他线程释放的消息）
+    uint64_t recycled;  // 消息释放后内存回到池中的次数
+    uint64_t released;  // 池已满，内存还给系统的次数
+    size_t cached;      // 当前池中缓存的消息数
+};
+
+MessagePoolStats getMessagePoolStats();
+
+template<class T> class MessageAllocator;
+template<class... Fields> class TypedMessage;
+struct TypedLayout;
+
 /**
  * @brief 消息类。包含一条消息的类型、附加数据等信息
  * 
@@ -182,6 +625,8 @@ private:
  */
 class AMessage : public std::enable_shared_from_this<AMessage>{
 private:
+    template<class T> friend class MessageAllocator; // 构造消息
+    template<class... Fields> friend class TypedMessage;
     AMessage();
     AMessage(uint32_t what, const std::shared_ptr<AHandler> &handler);
 
@@ -202,6 +647,18 @@ public:
      */
     static std::shared_ptr<AMessage> create(uint32_t what, const std::shared_ptr<AHandler> &handler);
 
+    /**
+     * @brief 创建一个通过handler id指定目标的AMessage
+     *      消息不持有handler和looper的weak_ptr，post时通过id在全局注册表中找到目标looper，
+     *      派发时同样通过id在注册表中找到目标handler，两次查找都不加锁。
+     *      handler和looper只被弱引用，所以查找后仍要weak_ptr::lock()一次，不存在免lock()的路径；
+     *      连续发往同一handler的消息只查找、lock()一次。发往已注销handler的消息会被丢弃
+     * @param what 消息号
+     * @param target 目标handler的id
+     * @return 创建成功的AMessage
+     */
+    static std::shared_ptr<AMessage> create(uint32_t what, handler_id target);
+
     /**
      * @brief 创建一个null AMessage
      *      注意AMessage::createNull() == nullptr
@@ -212,6 +669,15 @@ public:
      */
     static std::shared_ptr<AMessage> createNull();
 
+    /**
+     * @brief 从消息池中创建消息，参数同create()
+     *      消息对象与shared_ptr的控制块在一次分配中完成，释放后内存回到当前线程的缓存，
+     *      适合高频创建的消息。在其他线程释放的消息会成批归还，供创建线程取用
+     */
+    static std::shared_ptr<AMessage> obtain();
+    static std::shared_ptr<AMessage> obtain(uint32_t what, const std::shared_ptr<AHandler> &handler);
+    static std::shared_ptr<AMessage> obtain(uint32_t what, handler_id target);
+
     /**
      * @brief 指定消息号
      */
@@ -227,11 +693,30 @@ public:
      */
     void setTarget(const std::shared_ptr<AHandler> &handler);
 
+    /**
+     * @brief 通过handler id指定目标handler
+     * @param target 目标handler的id
+     */
+    void setTarget(handler_id target);
+
+    /**
+     * @return 目标handler的id，没有设置时为INVALID_HANDLER_ID
+     */
+    handler_id target() const;
+
     /**
      * @brief 清空附加数据
      */
     void clear();
 
+    /**
+     * @brief 启用消息内的arena：之后复制进来的长字符串依次存放在连续的内存块中，
+     *      不再逐个分配，消息释放时一次性释放。内存块不够时按倍数增长
+     *      注意：被覆盖的值所占的空间在clear()之前不会回收，反复修改同一字段的消息不宜启用
+     * @param initialSize 第一个内存块的大小
+     */
+    void enableArena(size_t initialSize = 512);
+
     enum Type {
         kTypeInt32,
         kTypeInt64,
@@ -241,6 +726,13 @@ public:
         kTypePointer,
         kTypeString,
         kTypeObject,
+        kTypeUnique,
+        kTypeBuffer,
+        kTypeMessage,
+        kTypeInt32Array,
+        kTypeInt64Array,
+        kTypeFloatArray,
+        kTypeDoubleArray,
     };
 
     void setInt32(const char *name, int32_t value);
@@ -258,26 +750,189 @@ public:
 
     void setObject(const char* name, const std::shared_ptr<void>& value);
 
+    /**
+     * @brief 设置对象，接管value的引用而不增加引用计数
+     */
+    void setObject(const char* name, std::shared_ptr<void>&& value);
+
     template<class T>
     bool findObject(const char* name, std::shared_ptr<T>* value){
         const Item *item = findItem(name, kTypeObject);
         if (item) {                                    
-            auto ref = item->u.refValue;
-            *value = *(reinterpret_cast<std::shared_ptr<T>*>(&(ref->value)));
+            *value = *castObject<T>(objectValue(item));
             return true;                               
         }                                              
         return false;  
     }
 
+    /**
+     * @brief 取出对象并从消息中删除该项，不改变引用计数
+     * @return true 找到并取出；false 没有该对象
+     */
+    template<class T>
+    bool takeObject(const char* name, std::shared_ptr<T>* value){
+        Item *item = detachItem(name, kTypeObject);
+        if (item) {
+            *value = std::move(*castObject<T>(objectValue(item)));
+            eraseItem(item);
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief 设置独占的对象，所有权转移到消息中，没有引用计数的开销。消息释放时delete该对象
+     * 
+     * 含独占对象的消息不能dup()
+     */
+    template<class T>
+    void setUnique(const char *name, std::unique_ptr<T> value){
+        setUniqueValue(allocateItem(name), value.release(), &deleteUnique<T>);
+    }
+
+    /**
+     * @brief 取出独占对象并从消息中删除该项
+     * @return 取出的对象；没有该对象或T与setUnique时的类型不同时返回空
+     */
+    template<class T>
+    std::unique_ptr<T> take(const char *name){
+        return std::unique_ptr<T>(static_cast<T *>(
+            takeUniqueValue(detachItem(name, kTypeUnique), &deleteUnique<T>)));
+    }
+
     void setString(const char *name, const char *s, ssize_t len = -1);
 
     void setString(const char *name, const std::string &s);
 
+    /**
+     * @brief 设置字符串，接管s的内容而不复制
+     */
+    void setString(const char *name, std::string &&s);
+
     bool findString(const char *name, std::string *value) const;
+
+    /**
+     * @brief 查找字符串但不复制
+     * @param value 输出参数。指向消息内部以'\0'结尾的字符串，在该项被修改或消息释放前有效
+     * @param len 输出参数，可为NULL。字符串的长度
+     */
+    bool findString(const char *name, const char **value, size_t *len = NULL) const;
+
+    /**
+     * @brief 设置buffer，只增加引用计数，不复制数据。writeToBuffer()会写出buffer有效范围内的数据
+     */
+    void setBuffer(const char *name, const std::shared_ptr<ABuffer> &buffer);
+
+    bool findBuffer(const char *name, std::shared_ptr<ABuffer> *buffer) const;
+
+    /**
+     * @brief 设置嵌套的消息，只保存引用。dup()时嵌套的消息也会被dup()，writeToBuffer()会一起序列化
+     *      不要让消息直接或间接地包含自己
+     */
+    void setMessage(const char *name, const std::shared_ptr<AMessage> &msg);
+
+    bool findMessage(const char *name, std::shared_ptr<AMessage> *msg) const;
+
+    /**
+     * @brief 设置数值数组，复制到一块按ABuffer::kSimdAlignment对齐的连续内存中，dup()的消息共享这块内存
+     */
+    void setInt32Array(const char *name, const int32_t *values, size_t count);
+    void setInt64Array(const char *name, const int64_t *values, size_t count);
+    void setFloatArray(const char *name, const float *values, size_t count);
+    void setDoubleArray(const char *name, const double *values, size_t count);
+
+    /**
+     * @brief 查找数组但不复制
+     * @param values 输出参数。指向消息内部对齐的连续内存，在该项被修改或消息释放前有效
+     * @param count 输出参数。元素个数
+     */
+    bool findInt32Array(const char *name, const int32_t **values, size_t *count) const;
+    bool findInt64Array(const char *name, const int64_t **values, size_t *count) const;
+    bool findFloatArray(const char *name, const float **values, size_t *count) const;
+    bool findDoubleArray(const char *name, const double **values, size_t *count) const;
     
 
     bool contains(const char *name) const;
 
+    // 以下为使用AKey的版本，不需要复制和比较名字
+    void setInt32(const AKey &key, int32_t value);
+    void setInt64(const AKey &key, int64_t value);
+    void setSize(const AKey &key, size_t value);
+    void setFloat(const AKey &key, float value);
+    void setDouble(const AKey &key, double value);
+    void setPointer(const AKey &key, void *value);
+    bool findInt32(const AKey &key, int32_t *value) const;
+    bool findInt64(const AKey &key, int64_t *value) const;
+    bool findSize(const AKey &key, size_t *value) const;
+    bool findFloat(const AKey &key, float *value) const;
+    bool findDouble(const AKey &key, double *value) const;
+    bool findPointer(const AKey &key, void **value) const;
+
+    void setObject(const AKey &key, const std::shared_ptr<void>& value);
+
+    void setObject(const AKey &key, std::shared_ptr<void>&& value);
+
+    template<class T>
+    bool findObject(const AKey &key, std::shared_ptr<T>* value){
+        const Item *item = findItem(key, kTypeObject);
+        if (item) {
+            *value = *castObject<T>(objectValue(item));
+            return true;
+        }
+        return false;
+    }
+
+    template<class T>
+    bool takeObject(const AKey &key, std::shared_ptr<T>* value){
+        Item *item = detachItem(key, kTypeObject);
+        if (item) {
+            *value = std::move(*castObject<T>(objectValue(item)));
+            eraseItem(item);
+            return true;
+        }
+        return false;
+    }
+
+    template<class T>
+    void setUnique(const AKey &key, std::unique_ptr<T> value){
+        setUniqueValue(allocateItem(key), value.release(), &deleteUnique<T>);
+    }
+
+    template<class T>
+    std::unique_ptr<T> take(const AKey &key){
+        return std::unique_ptr<T>(static_cast<T *>(
+            takeUniqueValue(detachItem(key, kTypeUnique), &deleteUnique<T>)));
+    }
+
+    void setString(const AKey &key, const char *s, ssize_t len = -1);
+
+    void setString(const AKey &key, const std::string &s);
+
+    void setString(const AKey &key, std::string &&s);
+
+    bool findString(const AKey &key, std::string *value) const;
+
+    bool findString(const AKey &key, const char **value, size_t *len = NULL) const;
+
+    void setBuffer(const AKey &key, const std::shared_ptr<ABuffer> &buffer);
+
+    bool findBuffer(const AKey &key, std::shared_ptr<ABuffer> *buffer) const;
+
+    void setMessage(const AKey &key, const std::shared_ptr<AMessage> &msg);
+
+    bool findMessage(const AKey &key, std::shared_ptr<AMessage> *msg) const;
+
+    void setInt32Array(const AKey &key, const int32_t *values, size_t count);
+    void setInt64Array(const AKey &key, const int64_t *values, size_t count);
+    void setFloatArray(const AKey &key, const float *values, size_t count);
+    void setDoubleArray(const AKey &key, const double *values, size_t count);
+    bool findInt32Array(const AKey &key, const int32_t **values, size_t *count) const;
+    bool findInt64Array(const AKey &key, const int64_t **values, size_t *count) const;
+    bool findFloatArray(const AKey &key, const float **values, size_t *count) const;
+    bool findDoubleArray(const AKey &key, const double **values, size_t *count) const;
+
+    bool contains(const AKey &key) const;
+
 
     /**
      * @brief 发送当前消息到目标handler
@@ -321,24 +976,48 @@ public:
     // their refcount incremented.
     /**
      * @brief 复制当前消息，包括附加数据
-     * @return 复制后的消息。其生命周期是独立的。
+     * 
+     * 独占对象（setUnique）无法复制，含有独占对象时dup()失败。嵌套的消息（setMessage）会逐个dup()。
+     * 
+     * 附加数据不会被立即复制：第一次dup()时复制出一份只读快照，之后的dup()共享这份快照，直到原消息被修改。
+     * 复制出的消息之后setXXX的值只写入自己，不会影响对方。因此对同一个消息反复dup()（如notify模式）的开销
+     * 与附加数据的数量无关。
+     * 
+     * dup()不改变原消息的存储，之前find得到的指针仍然有效，多个线程可以同时dup()同一个消息
+     * @return 复制后的消息。其生命周期是独立的。含有独占对象时返回NULL
      */
     std::shared_ptr<AMessage> dup() const;
 
     // std::string debugString(int32_t indent = 0) const;
    
     /**
-     * @return 返回当前附加数据的数量
+     * @return 返回当前附加数据的数量，TypedMessage的字段也计算在内
      */
     size_t countEntries() const;
     
     /**
-     * @brief 获取index所指的附加数据的类型和名字
+     * @brief 获取index所指的附加数据的类型和名字。TypedMessage的字段排在最前面
      * @param type 输出参数。所选附加数据的类型
      * @return NULL index非法；其他 所选附加数据的名称
      */
     const char *getEntryNameAt(size_t index, Type *type) const;
 
+    /**
+     * @brief 以二进制格式（小端，带版本号）序列化消息，追加到out后面
+     *      包括what和附加数据中的整数、浮点数、字符串、buffer、嵌套消息、数组，不包括target
+     *      buffer写出有效范围内的数据，readFromBuffer()得到内容相同的新buffer
+     *      格式见aloop.cpp中的说明，可以用AMessageView直接读取
+     * @param skipUnsupported true时跳过不能序列化的附加数据（pointer、object、unique、TypedMessage的字段），而不是失败
+     * @return OK；INVALID_OPERATION 含有不能序列化的附加数据（pointer、object、unique、TypedMessage的字段）
+     */
+    status_t writeToBuffer(std::vector<uint8_t> *out, bool skipUnsupported = false) const;
+
+    /**
+     * @brief 从writeToBuffer()生成的数据还原消息，还原的消息没有target
+     * @return 数据不合法时返回NULL
+     */
+    static std::shared_ptr<AMessage> readFromBuffer(const void *data, size_t size);
+
     virtual ~AMessage();
 
 private:
@@ -350,48 +1029,814 @@ private:
 
     std::weak_ptr<AHandler> mHandler;
     std::weak_ptr<ALooper> mLooper;
+    uint32_t mMigrations;   // setTarget()时handler的迁移次数
 
-    struct RefHolder {
-        RefHolder(const std::shared_ptr<void>& shptr) : value(shptr) {
-        }
+    enum {
+        kInlineStringSize = 21
+    };
 
-        std::shared_ptr<void> value;
+    enum StringStorage {
+        kStringInline,
+        kStringHeap,
+        kStringArena,
     };
 
-    struct Item {
+    struct ArenaString {
+        const char *mData;
+        size_t mSize;
+    };
+
+    // short strings (MIME types, codec names...) are stored inside the item
+    struct StringValue {
         union {
-            int32_t int32Value;
-            int64_t int64Value;
-            size_t sizeValue;
-            float floatValue;
-            double doubleValue;
+            std::string *mHeap;
+            ArenaString mArena;
+            char mInline[kInlineStringSize + 1];
+        };
+        uint8_t mLength;    // length of mInline
+        uint8_t mStorage;   // StringStorage
+    };
+
+    typedef void (*UniqueDeleter)(void *value);
+
+    template<class T>
+    static void deleteUnique(void *value) {
+        delete static_cast<T *>(value);
+    }
+
+    // deleter同时用来区分对象的类型
+    struct UniqueValue {
+        void *mValue;
+        UniqueDeleter mDelete;
+    };
+
+    struct Item {
+        union {
+            int32_t int32Value;
+            int64_t int64Value;
+            size_t sizeValue;
+            float floatValue;
+            double doubleValue;
             void *ptrValue;
-            RefHolder* refValue;
-            std::string* stringValue;
+            // std::shared_ptr<void> constructed in place. Items are moved
+            // around with memcpy, which shared_ptr tolerates
+            std::aligned_storage<sizeof(std::shared_ptr<void>),
+                alignof(std::shared_ptr<void>)>::type objectValue;
+            StringValue stringValue;
+            UniqueValue uniqueValue;
         } u;
-        const char *mName;
-        size_t      mNameLength;
+        const char *mName;//一般是interned，不需要释放；mOwnedName时由item自己保存
+        uint32_t    mNameLength : 31;
+        uint32_t    mOwnedName : 1;
         Type mType;
-        void setName(const char *name, size_t len);
     };
 
+    // most messages carry only 1-3 items (plus "replyID" when awaiting a
+    // response), keep them inline and grow on the heap beyond that
     enum {
-        kMaxNumItems = 64
+        kInlineItems = 4
     };
-    Item mItems[kMaxNumItems];
+    Item mInlineItems[kInlineItems];
+    Item *mItems;
+    // hashes of item names, packed apart from the items so that lookup scans
+    // a dense array
+    uint32_t mInlineHashes[kInlineItems];
+    uint32_t *mHashes;
     size_t mNumItems;
-
+    size_t mCapacity;
+
+    // fields of TypedMessage, NULL for plain messages
+    const TypedLayout *mLayout;
+
+    // items shared with dup()ed messages, read-only. Own items with the same
+    // name (mNumShadowed of them) take precedence
+    struct SharedItems;
+    SharedItems *mBase;
+    size_t mNumShadowed;
+    // dup()时复制出的只读快照，修改items时丢弃。dup()是const的，不能移动自己的items
+    mutable std::atomic<SharedItems *> mSnapshot;
+
+    // bump allocated blocks for long strings, newest (largest) first.
+    // Moves into SharedItems together with the items that use it
+    struct ArenaBlock;
+    ArenaBlock *mArena;
+    size_t mArenaBlockSize; // size of the next block, 0 if arena is disabled
+
+    char *allocateArena(size_t size);
+    static void freeArena(ArenaBlock *block);
+
+    void shareItems();
+    SharedItems *snapshotItems() const;
+    void dropSnapshot();
+    static void releaseShared(SharedItems *shared);
+    const Item *getItemAt(size_t index) const;
+    // calls func(const Item *, uint32_t hash) in getItemAt() order
+    template<class Func>
+    void forEachItem(Func func) const;
+
+    void reserveItems(size_t capacity);
     Item *allocateItem(const char *name);
-    void freeItemValue(Item *item);
+    Item *allocateItem(const char *name, size_t len, uint32_t hash);
+    Item *allocateItem(const AKey &key);
+    Item *appendItem(const char *internedName, size_t len, uint32_t hash);
+    static void freeItemValue(Item *item);
+    static char *copyName(const char *name, size_t len);
+    static void freeItemName(Item *item);
+    static void copyItemName(Item *to, const Item *from);
+    static void copyItemValue(Item *to, const Item *from);
+    void storeString(Item *item, const char *s, size_t len);
+    void buildString(StringValue *value, const char *s, size_t len);
+    static void initString(StringValue *value, const char *s, size_t len);
+    static std::shared_ptr<ABuffer> copyArray(const void *values, size_t size);
+    static void setArrayValue(Item *item, Type type, std::shared_ptr<ABuffer> &&buffer);
+    static bool canSerialize(const Item *item);
+    bool wireSize(size_t *size, bool skipUnsupported, int depth) const;
+    uint8_t *writeWire(uint8_t *p, bool skipUnsupported) const;
+    static std::shared_ptr<AMessage> readWire(const void *data, size_t size, int depth);
+    static void setStringValue(Item *item, const char *s, size_t len);
+    static const char *getStringValue(const Item *item, size_t *len);
     const Item *findItem(const char *name, Type type) const;
+    const Item *findItem(const AKey &key, Type type) const;
+    Item *detachItem(const char *name, Type type);
+    Item *detachItem(const AKey &key, Type type);
+    void detachBase();
+    void eraseItem(Item *item);
+    static void setUniqueValue(Item *item, void *value, UniqueDeleter deleter);
+    void *takeUniqueValue(Item *item, UniqueDeleter deleter);
+
+    static std::shared_ptr<void> *objectValue(Item *item) {
+        return static_cast<std::shared_ptr<void> *>(static_cast<void *>(&item->u.objectValue));
+    }
+    static const std::shared_ptr<void> *objectValue(const Item *item) {
+        return static_cast<const std::shared_ptr<void> *>(
+            static_cast<const void *>(&item->u.objectValue));
+    }
+    // shared_ptr<void>与shared_ptr<T>布局相同
+    template<class T>
+    static std::shared_ptr<T> *castObject(std::shared_ptr<void> *value) {
+        return static_cast<std::shared_ptr<T> *>(static_cast<void *>(value));
+    }
+    template<class T>
+    static const std::shared_ptr<T> *castObject(const std::shared_ptr<void> *value) {
+        return static_cast<const std::shared_ptr<T> *>(static_cast<const void *>(value));
+    }
+
+    const Item *lookupItem(const char *name, size_t len, uint32_t hash) const;
+    const Item *lookupItem(const AKey &key) const;
 
-    size_t findItemIndex(const char *name, size_t len) const;
+    static size_t findItemIndex(const Item *items, const uint32_t *hashes, size_t n,
+            const char *name, size_t len, uint32_t hash);
+    static size_t findInternedIndex(const Item *items, const uint32_t *hashes, size_t n,
+            const char *internedName, uint32_t hash);
+    static size_t findHash(const uint32_t *hashes, size_t n, uint32_t hash, size_t from);
 
-    void deliver();
+    std::shared_ptr<ALooper> getTargetLooper() const;
+
+    void deliver(const std::shared_ptr<AHandler> &handler);
 
     DISALLOW_EVIL_CONSTRUCTORS(AMessage);
 };
 
+/**
+ * @brief TypedMessage的字段信息，供AMessage的dup()和countEntries()/getEntryNameAt()使用
+ */
+struct TypedLayout {
+    size_t mNumFields;
+    const char *const *mNames;
+    const AMessage::Type *mTypes;
+    std::shared_ptr<AMessage> (*mCreate)();
+    void (*mCopy)(AMessage *to, const AMessage *from);
+};
+
+// 声明TypedMessage的字段，如：ALOOP_FIELD(Width, int32_t);
+#define ALOOP_FIELD(NAME, TYPE)                                 \
+    struct NAME {                                               \
+        typedef TYPE type;                                      \
+        static constexpr const char *name() { return #NAME; }   \
+    }
+
+// 字段类型对应的AMessage::Type，不支持的类型编译失败
+template<class T> struct TypedFieldType;
+template<> struct TypedFieldType<int32_t> : std::integral_constant<AMessage::Type, AMessage::kTypeInt32> {};
+template<> struct TypedFieldType<int64_t> : std::integral_constant<AMessage::Type, AMessage::kTypeInt64> {};
+template<> struct TypedFieldType<size_t> : std::integral_constant<AMessage::Type, AMessage::kTypeSize> {};
+template<> struct TypedFieldType<float> : std::integral_constant<AMessage::Type, AMessage::kTypeFloat> {};
+template<> struct TypedFieldType<double> : std::integral_constant<AMessage::Type, AMessage::kTypeDouble> {};
+template<> struct TypedFieldType<void *> : std::integral_constant<AMessage::Type, AMessage::kTypePointer> {};
+template<> struct TypedFieldType<std::string> : std::integral_constant<AMessage::Type, AMessage::kTypeString> {};
+template<class T> struct TypedFieldType<std::shared_ptr<T> > : std::integral_constant<AMessage::Type, AMessage::kTypeObject> {};
+template<> struct TypedFieldType<std::shared_ptr<ABuffer> > : std::integral_constant<AMessage::Type, AMessage::kTypeBuffer> {};
+template<> struct TypedFieldType<std::shared_ptr<AMessage> > : std::integral_constant<AMessage::Type, AMessage::kTypeMessage> {};
+
+// 字段在Fields中的位置，不存在的字段编译失败
+template<class F, class... Fields> struct TypedFieldIndex;
+template<class F, class... Fields>
+struct TypedFieldIndex<F, F, Fields...> : std::integral_constant<size_t, 0> {};
+template<class F, class G, class... Fields>
+struct TypedFieldIndex<F, G, Fields...> : std::integral_constant<size_t, 1 + TypedFieldIndex<F, Fields...>::value> {};
+
+/**
+ * @brief 字段在编译期确定的消息。字段保存在固定位置，get/set不需要查找名字，字段名写错时编译失败
+ *      可以像AMessage一样post给handler，接收端用cast()转回。
+ *      AMessage的setXXX/findXXX仍然可用，与字段互不影响；clear()不影响字段
+ * 
+ *  ALOOP_FIELD(Width, int32_t);
+ *  ALOOP_FIELD(Height, int32_t);
+ *  typedef TypedMessage<Width, Height> SizeMessage;
+ * 
+ *  auto msg = SizeMessage::create(kWhatSize, handler);
+ *  msg->set<Width>(1920);
+ *  msg->post();
+ *  //onMessageReceived中
+ *  auto size = SizeMessage::cast(msg);
+ *  int32_t width = size->get<Width>();
+ */
+template<class... Fields>
+class TypedMessage : public AMessage {
+public:
+    static_assert(sizeof...(Fields) > 0, "TypedMessage needs at least one field");
+
+    static std::shared_ptr<TypedMessage> create(uint32_t what, const std::shared_ptr<AHandler> &handler) {
+        std::shared_ptr<TypedMessage> msg(new TypedMessage);
+        msg->setWhat(what);
+        msg->setTarget(handler);
+        return msg;
+    }
+
+    static std::shared_ptr<TypedMessage> create(uint32_t what, handler_id target) {
+        std::shared_ptr<TypedMessage> msg(new TypedMessage);
+        msg->setWhat(what);
+        msg->setTarget(target);
+        return msg;
+    }
+
+    /**
+     * @return msg不是该类型的消息时返回NULL
+     */
+    static std::shared_ptr<TypedMessage> cast(const std::shared_ptr<AMessage> &msg) {
+        if (msg == NULL || msg->mLayout != &kLayout) {
+            return std::shared_ptr<TypedMessage>();
+        }
+        return std::static_pointer_cast<TypedMessage>(msg);
+    }
+
+    template<class F>
+    const typename F::type &get() const {
+        return std::get<TypedFieldIndex<F, Fields...>::value>(mFields);
+    }
+
+    template<class F>
+    void set(const typename F::type &value) {
+        std::get<TypedFieldIndex<F, Fields...>::value>(mFields) = value;
+    }
+
+    template<class F>
+    void set(typename F::type &&value) {
+        std::get<TypedFieldIndex<F, Fields...>::value>(mFields) = std::move(value);
+    }
+
+    std::shared_ptr<TypedMessage> dup() const {
+        return std::static_pointer_cast<TypedMessage>(AMessage::dup());
+    }
+
+private:
+    std::tuple<typename Fields::type...> mFields;
+
+    static const char *const kNames[sizeof...(Fields)];
+    static const AMessage::Type kTypes[sizeof...(Fields)];
+    static const TypedLayout kLayout;
+
+    TypedMessage() : mFields() {
+        mLayout = &kLayout;
+    }
+
+    static std::shared_ptr<AMessage> createEmpty() {
+        return std::shared_ptr<AMessage>(new TypedMessage);
+    }
+
+    static void copyFields(AMessage *to, const AMessage *from) {
+        static_cast<TypedMessage *>(to)->mFields = static_cast<const TypedMessage *>(from)->mFields;
+    }
+};
+
+template<class... Fields>
+const char *const TypedMessage<Fields...>::kNames[sizeof...(Fields)] = {
+    Fields::name()...
+};
+
+template<class... Fields>
+const AMessage::Type TypedMessage<Fields...>::kTypes[sizeof...(Fields)] = {
+    TypedFieldType<typename Fields::type>::value...
+};
+
+template<class... Fields>
+const TypedLayout TypedMessage<Fields...>::kLayout = {
+    sizeof...(Fields),
+    kNames,
+    kTypes,
+    &TypedMessage::createEmpty,
+    &TypedMessage::copyFields,
+};
+
+/**
+ * @brief 直接在AMessage::writeToBuffer()生成的数据上读取附加数据，不构造AMessage，不复制数据
+ *      数据在AMessageView使用期间必须有效
+ */
+class AMessageView {
+public:
+    AMessageView();
+
+    /**
+     * @brief 检查数据头和每一项的边界
+     * @return false 数据不合法或版本不支持
+     */
+    bool init(const void *data, size_t size);
+
+    uint32_t what() const;
+
+    size_t countEntries() const;
+
+    /**
+     * @return 整条消息的字节数，data中可能还有后续的消息
+     */
+    size_t size() const;
+
+    bool findInt32(const char *name, int32_t *value) const;
+    bool findInt64(const char *name, int64_t *value) const;
+    bool findSize(const char *name, size_t *value) const;
+    bool findFloat(const char *name, float *value) const;
+    bool findDouble(const char *name, double *value) const;
+    /**
+     * @param value 输出参数。指向data内部，不以'\0'结尾
+     */
+    bool findString(const char *name, const char **value, size_t *len) const;
+    bool findString(const char *name, std::string *value) const;
+    /**
+     * @brief 查找setBuffer()写出的数据
+     * @param data 输出参数。指向data内部，没有对齐保证
+     */
+    bool findBuffer(const char *name, const uint8_t **data, size_t *size) const;
+    /**
+     * @brief 读取嵌套的消息，msg指向同一份数据
+     */
+    bool findMessage(const char *name, AMessageView *msg) const;
+    bool contains(const char *name) const;
+
+    bool findInt32(const AKey &key, int32_t *value) const;
+    bool findInt64(const AKey &key, int64_t *value) const;
+    bool findSize(const AKey &key, size_t *value) const;
+    bool findFloat(const AKey &key, float *value) const;
+    bool findDouble(const AKey &key, double *value) const;
+    bool findString(const AKey &key, const char **value, size_t *len) const;
+    bool findString(const AKey &key, std::string *value) const;
+    bool findBuffer(const AKey &key, const uint8_t **data, size_t *size) const;
+    bool findMessage(const AKey &key, AMessageView *msg) const;
+    bool contains(const AKey &key) const;
+
+private:
+    const uint8_t *mData;
+    size_t mSize;
+    uint32_t mWhat;
+    uint32_t mNumItems;
+
+    // type为-1时不检查类型
+    const uint8_t *findValue(const char *name, size_t len, uint32_t hash,
+        int type, size_t *valueLen) const;
+    const uint8_t *findValue(const char *name, int type, size_t *valueLen) const;
+    const uint8_t *findValue(const AKey &key, int type, size_t *valueLen) const;
+};
+
+#ifdef __linux__
+/**
+ * @brief 跨进程的共享内存环形缓冲区，单生产者单消费者
+ *      读写只访问共享内存，只有一端需要等待（空或满）时才通过futex睡眠和唤醒
+ *      旧版glibc（2.34之前）链接时需要-lrt
+ */
+class ASharedRing {
+public:
+    /**
+     * @brief 创建共享内存并初始化
+     * @param name shm_open的名字，如"/aloop-ring"
+     * @param capacity 缓冲区大小，会向上取整为2的幂
+     * @return 失败返回NULL
+     */
+    static std::shared_ptr<ASharedRing> create(const char *name, size_t capacity);
+
+    /**
+     * @brief 打开其他进程创建的共享内存
+     * @return 失败返回NULL
+     */
+    static std::shared_ptr<ASharedRing> open(const char *name);
+
+    /**
+     * @brief 删除共享内存的名字，已经打开的不受影响
+     */
+    static void unlink(const char *name);
+
+    ~ASharedRing();
+
+    /**
+     * @brief 写入一条记录，空间不足时等待
+     * @param timeoutUs 小于0时一直等待
+     * @return OK；BUSY 超时；NO_MEM 记录超过容量的一半；NOT_FOUND 已关闭
+     */
+    status_t write(const void *data, size_t size, int64_t timeoutUs = -1);
+
+    /**
+     * @brief 读取一条记录，没有数据时等待。func在返回前调用，data只在调用期间有效
+     * @param timeoutUs 小于0时一直等待
+     * @return OK；BUSY 超时；NOT_FOUND 已关闭且没有剩余的数据
+     */
+    status_t read(const std::function<void(const void *data, size_t size)> &func,
+        int64_t timeoutUs = -1);
+
+    /**
+     * @brief 关闭缓冲区，唤醒两端，之后不能再写入
+     */
+    void close();
+
+private:
+    // 共享内存开头的控制信息，之后是数据区
+    struct Control;
+    enum {
+        kControlSize = 256
+    };
+
+    Control *mControl;
+    uint8_t *mData;
+    size_t mMapSize;
+    //映射时确定的容量，不读取共享内存中可被对端修改的值
+    size_t mCapacity;
+
+    ASharedRing(void *map, size_t mapSize);
+
+    DISALLOW_EVIL_CONSTRUCTORS(ASharedRing);
+};
+
+/**
+ * @brief 跨进程发送消息的代理handler：注册到本地looper，收到的消息序列化后写入ASharedRing
+ *      消息的target由对端的ARingReceiver上以port导出的handler决定
+ *      ring不传递回复：postAndAwaitResponse在写入ring后返回，回复中的"err"为写入的结果
+ */
+class ARingSender : public AHandler {
+public:
+    /**
+     * @param port 对端ARingReceiver导出handler的port
+     * @param timeoutUs ring已满时最长等待的时间，超时丢弃消息，接收进程退出后不会一直阻塞looper。小于0时一直等待
+     */
+    explicit ARingSender(const std::shared_ptr<ASharedRing> &ring, uint32_t port = 0,
+        int64_t timeoutUs = 1000000);
+
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage> &msg);
+
+private:
+    std::shared_ptr<ASharedRing> mRing;
+    uint32_t mPort;
+    int64_t mTimeoutUs;
+    std::vector<uint8_t> mBuffer;
+};
+
+/**
+ * @brief 在独立线程中从ASharedRing读取消息，发送给本进程以port导出的handler
+ */
+class ARingReceiver {
+public:
+    /**
+     * @param target 不为NULL时以port 0导出
+     */
+    explicit ARingReceiver(const std::shared_ptr<ASharedRing> &ring,
+        const std::shared_ptr<AHandler> &target = std::shared_ptr<AHandler>());
+
+    /**
+     * @brief 会调用stop()
+     */
+    ~ARingReceiver();
+
+    /**
+     * @brief 以port导出本进程的handler，对端ARingSender发往该port的消息会发送给handler
+     */
+    void exportHandler(uint32_t port, const std::shared_ptr<AHandler> &handler);
+
+    status_t start();
+
+    /**
+     * @brief 关闭ring并等待线程退出
+     */
+    void stop();
+
+private:
+    std::shared_ptr<ASharedRing> mRing;
+    std::mutex mExportLock;
+    std::unordered_map<uint32_t, std::weak_ptr<AHandler>> mExports;
+    std::thread mThread;
+
+    void pump();
+
+    DISALLOW_EVIL_CONSTRUCTORS(ARingReceiver);
+};
+
+/**
+ * @brief 通过本地socket（socketpair或AF_UNIX连接）连接两端的looper
+ *      本端handler以port导出，对端的handler通过getRemoteHandler()得到的代理handler访问，
+ *      代理handler上的postAndAwaitResponse会等待对端handler的回复
+ *
+ *      发送：代理handler收到的消息先编码到待发送缓冲，同一轮消息处理完后由bridge的looper一次writev写出，
+ *          socket写满时保留没写完的数据，可写时继续，不阻塞looper
+ *      接收：socket通过addFd()在bridge的looper上监听，可读时读取尽量多的数据，解码其中所有完整的帧后发送给导出的handler
+ *      消息的内容限于writeToBuffer()支持的类型
+ */
+class ASocketBridge {
+public:
+    /**
+     * @param fd 已连接的流式socket，之后由bridge负责关闭，会被设置为非阻塞
+     * @param looper 代理handler注册到的looper，读写socket也在该looper上执行
+     */
+    static std::shared_ptr<ASocketBridge> create(int fd, const std::shared_ptr<ALooper> &looper);
+
+    /**
+     * @brief 会调用stop()并关闭fd
+     */
+    ~ASocketBridge();
+
+    /**
+     * @brief 以port导出本端的handler，对端发往该port的消息会发送给handler。需要在start()前调用
+     */
+    void exportHandler(uint32_t port, const std::shared_ptr<AHandler> &handler);
+
+    /**
+     * @brief 获取对端port的代理handler。同一port返回同一个代理，已注册到looper上
+     * @return looper已经释放时返回NULL
+     */
+    std::shared_ptr<AHandler> getRemoteHandler(uint32_t port);
+
+    /**
+     * @brief 开始在looper上接收对端的消息
+     * @return OK；INVALID_OPERATION 重复启动、已经停止或addFd()失败；NOT_FOUND looper已经释放
+     */
+    status_t start();
+
+    /**
+     * @brief 关闭连接并停止监听socket，正在等待对端回复的postAndAwaitResponse会收到含"err"的回复。
+     *      连接断开或写socket出错时也会自动停止
+     */
+    void stop();
+
+    /**
+     * @brief 累计写出的消息数和writev调用次数，用于观察批量写的效果
+     */
+    void getWriteStats(uint64_t *messages, uint64_t *writes) const;
+
+private:
+    class Proxy;
+    class Writer;
+
+    int mFd;
+    std::weak_ptr<ASocketBridge> mSelf;
+    std::weak_ptr<ALooper> mLooper;
+    bool mStarted;
+    std::atomic<bool> mStopped;
+
+    // 只在looper上访问：接收缓冲及其中已有的字节数
+    std::vector<uint8_t> mReadBuffer;
+    size_t mReadFilled;
+
+    std::mutex mExportLock;
+    std::unordered_map<uint32_t, std::weak_ptr<AHandler>> mExports;
+    std::unordered_map<uint32_t, std::shared_ptr<Proxy>> mProxies;
+
+    // 待发送的帧按顺序写在若干段缓冲中
+    std::mutex mSendLock;
+    std::vector<std::vector<uint8_t>> mSegments;
+    std::vector<std::vector<uint8_t>> mSpareSegments;
+    size_t mPendingMessages;
+    bool mFlushPending;
+    bool mWaitWritable;
+    // 只在looper上访问：socket写满时没写完的段，第一段从mUnsentOffset开始
+    std::vector<std::vector<uint8_t>> mUnsent;
+    size_t mUnsentOffset;
+    std::shared_ptr<Writer> mWriter;
+    std::atomic<uint64_t> mMessagesWritten;
+    std::atomic<uint64_t> mWrites;
+
+    // 本端正在等待回复的token
+    std::mutex mReplyLock;
+    uint32_t mNextReplyID;
+    std::unordered_map<uint32_t, std::shared_ptr<AReplyToken>> mReplies;
+
+    ASocketBridge(int fd, const std::shared_ptr<ALooper> &looper);
+
+    status_t send(uint8_t kind, uint32_t port, uint32_t replyID, const std::shared_ptr<AMessage> &msg);
+    void sendRequest(uint32_t port, const std::shared_ptr<AMessage> &msg);
+    void flush();
+    void receive();
+    status_t updateFdEventsLocked();
+    void onFrame(uint8_t kind, uint32_t port, uint32_t replyID, const uint8_t *data, size_t size);
+    void failReplies();
+    bool removeReply(uint32_t replyID, std::shared_ptr<AReplyToken> *token);
+
+    DISALLOW_EVIL_CONSTRUCTORS(ASocketBridge);
+};
+
+/**
+ * @brief 把looper分发的消息追加到内存映射的日志文件中，可用AJournalReplayer重放
+ *      每条记录包括分发时间、target、what和writeToBuffer()的数据，不能序列化的附加数据被跳过
+ *      文件按块扩展和映射，写入只是内存拷贝。可以同时设置给多个looper
+ */
+class AJournalRecorder : public AMessageRecorder {
+public:
+    /**
+     * @param path 日志文件，已存在时清空
+     * @param chunkSize 每次扩展文件和映射的大小，会向上取整为页大小的倍数
+     * @return 失败返回NULL
+     */
+    static std::shared_ptr<AJournalRecorder> create(const char *path, size_t chunkSize = 4 << 20);
+
+    /**
+     * @brief 会调用close()
+     */
+    virtual ~AJournalRecorder();
+
+    virtual void record(const std::shared_ptr<AMessage> &msg, int64_t timeUs);
+
+    /**
+     * @brief 解除映射，把文件截断到实际的长度。之后的record()被忽略
+     */
+    void close();
+
+    /**
+     * @return 已记录的消息数
+     */
+    uint64_t count() const;
+
+private:
+    mutable std::mutex mLock;
+    int mFd;
+    size_t mChunkSize;
+    uint8_t *mChunk;        // 当前映射的块
+    size_t mChunkLength;
+    uint64_t mChunkOffset;  // 当前块在文件中的偏移
+    size_t mPosition;       // 当前块中下一条记录的位置
+    uint64_t mCount;
+
+    AJournalRecorder(int fd, size_t chunkSize);
+
+    bool mapChunk(uint64_t offset, size_t length);
+
+    DISALLOW_EVIL_CONSTRUCTORS(AJournalRecorder);
+};
+
+/**
+ * @brief 读取AJournalRecorder记录的日志，把消息重新post给本进程的handler
+ *      可以按记录时的时间间隔重放，也可以尽快重放，用于离线、可重复地测试handler和调度的吞吐
+ */
+class AJournalReplayer {
+public:
+    /**
+     * @return 文件不存在或格式不对时返回NULL
+     */
+    static std::shared_ptr<AJournalReplayer> open(const char *path);
+
+    ~AJournalReplayer();
+
+    /**
+     * @brief 记录中发往recorded的消息，重放时发给handler
+     */
+    void setTarget(handler_id recorded, const std::shared_ptr<AHandler> &handler);
+
+    /**
+     * @brief 没有通过setTarget()指定的消息发给handler。不设置时这些消息被丢弃
+     */
+    void setDefaultTarget(const std::shared_ptr<AHandler> &handler);
+
+    /**
+     * @brief 在调用线程上依次post日志中的消息
+     * @param realtime true 按记录的时间间隔post；false 尽快post
+     * @return post成功的消息数
+     */
+    size_t replay(bool realtime);
+
+    /**
+     * @return 日志中的记录数
+     */
+    size_t count() const;
+
+private:
+    uint8_t *mData;
+    size_t mSize;
+    std::unordered_map<handler_id, std::weak_ptr<AHandler>> mTargets;
+    std::weak_ptr<AHandler> mDefaultTarget;
+
+    AJournalReplayer(uint8_t *data, size_t size);
+
+    template<class Func>
+    void forEachRecord(Func func) const;
+
+    DISALLOW_EVIL_CONSTRUCTORS(AJournalReplayer);
+};
+
+/**
+ * @brief 为ALooper提供至少一次投递的持久化消息队列，见ALooper::setPersistentQueue()
+ *      消息追加到目录下内存映射的段文件中，分发完成后在记录上标记完成并推进段的检查点，
+ *      段中的消息都完成后删除段文件。进程崩溃时已写入映射的数据不会丢失；
+ *      为应对系统崩溃，每追加syncBatch条消息做一次msync，并发post的线程共享同一次msync（group commit）
+ *      handler的id在重启后会变化，因此用port标识消息的接收者
+ */
+class APersistentQueue : public std::enable_shared_from_this<APersistentQueue> {
+public:
+    /**
+     * @param dir 存放段文件的目录，不存在时创建
+     * @param syncBatch 每追加多少条消息msync一次。1表示post返回前消息已落盘；0表示只在sync()和析构时msync
+     * @param segmentSize 段文件的大小，会向上取整为页大小的倍数
+     * @return 失败返回NULL
+     */
+    static std::shared_ptr<APersistentQueue> open(const char *dir, size_t syncBatch = 1, size_t segmentSize = 4 << 20);
+
+    /**
+     * @brief 会调用sync()
+     */
+    ~APersistentQueue();
+
+    /**
+     * @brief 把handler绑定到port，之后post给handler的消息会被持久化。
+     *      已设置给looper时，上次未完成的发往port的消息立即恢复
+     *      port原来绑定的handler已经析构时，可以直接绑定新的handler
+     * @return OK,绑定成功；INVALID_OPERATION,port或handler已经绑定过
+     */
+    status_t bindHandler(uint32_t port, const std::shared_ptr<AHandler> &handler);
+
+    /**
+     * @brief 解除port的绑定，之后post给原来handler的消息不再持久化。
+     *      已持久化但未完成的消息保留在段文件中，port再次绑定时恢复给新的handler；
+     *      此时还在looper队列中的消息仍发给原来的handler，因此可能重复投递
+     * @return OK,解除成功；NOT_FOUND,port没有绑定
+     */
+    status_t unbindHandler(uint32_t port);
+
+    /**
+     * @brief 把已追加的消息msync到磁盘
+     */
+    void sync();
+
+    /**
+     * @return 已持久化但还未完成的消息数，包括恢复的消息
+     */
+    size_t getPendingCount() const;
+
+    /**
+     * @brief 累计追加的消息数和msync的次数，用于观察group commit的效果
+     */
+    void getStats(uint64_t *appended, uint64_t *syncs) const;
+
+private:
+    friend class ALooper; // append(), complete(), attach()
+
+    struct Segment;
+    struct Restored {
+        std::shared_ptr<AMessage> mMessage;
+        int64_t mDelayUs;
+        uint64_t mRecord;
+    };
+
+    mutable std::mutex mLock;
+    std::string mDir;
+    size_t mSyncBatch;
+    size_t mSegmentSize;
+    std::unordered_map<uint32_t, std::shared_ptr<Segment>> mSegments;
+    std::shared_ptr<Segment> mCurrent;  // 正在追加的段
+    uint32_t mNextIndex;                // 下一个段文件的序号
+    std::unordered_map<uint32_t, std::weak_ptr<AHandler>> mHandlers;   // port -> handler
+    std::unordered_map<handler_id, uint32_t> mPorts;                // handler id -> port
+    std::weak_ptr<ALooper> mLooper;
+    bool mAttached;
+    size_t mPending;
+    uint64_t mAppended;
+    uint64_t mScheduled; // 已触发msync的追加数，每syncBatch条触发一次
+    uint64_t mSynced;    // 已msync的追加数
+    uint64_t mSyncs;
+
+    // 保证同一时间只有一个线程在msync，其他线程等待后大多已被覆盖
+    std::mutex mSyncLock;
+
+    APersistentQueue(const char *dir, size_t syncBatch, size_t segmentSize);
+
+    bool load();
+    std::shared_ptr<Segment> createSegmentLocked(size_t size);
+    void removeSegmentLocked(const std::shared_ptr<Segment> &segment);
+    void syncTo(uint64_t appended);
+    void collectLocked(const uint32_t *port, std::vector<Restored> *restored);
+    bool unbindLocked(uint32_t port);
+
+    // 返回记录的位置，没有绑定或不能序列化的消息返回0
+    uint64_t append(const std::shared_ptr<AMessage> &msg, int64_t delayUs);
+    void complete(uint64_t record);
+    bool attach(const std::shared_ptr<ALooper> &looper);
+    void insertRestored(const std::shared_ptr<ALooper> &looper, std::vector<Restored> *restored);
+
+    DISALLOW_EVIL_CONSTRUCTORS(APersistentQueue);
+};
+#endif
+
 } // namespace alooper
 
 
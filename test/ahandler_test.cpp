@@ -1,5 +1,10 @@
 #include <gtest/gtest.h>
 #include "../src/aloop.h"
+#include <thread>
+#include <vector>
+#include <set>
+#include <atomic>
+#include <chrono>
 
 using namespace aloop;
 using namespace std;
@@ -80,4 +85,157 @@ TEST(AHandler, GlobalId){
     auto id2 = l2->registerHandler(h2);
 
     ASSERT_NE(id1, id2);
-}
\ No newline at end of file
+}
+TEST(AHandler, StaleIdAfterReuse){
+    auto looper = ALooper::create();
+    shared_ptr<AHandler> h1(new EmptyHandler);
+    shared_ptr<AHandler> h2(new EmptyHandler);
+
+    auto id1 = looper->registerHandler(h1);
+    looper->unregisterHandler(id1);
+    auto id2 = looper->registerHandler(h2);
+    ASSERT_NE(id1, id2);
+
+    //旧id不能注销掉复用了同一个slot的新handler
+    looper->unregisterHandler(id1);
+    ASSERT_EQ(id2, h2->id());
+}
+
+//同一个slot反复注册/注销，id不会重复
+TEST(AHandler, NoIdReuseAfterChurn){
+    auto looper = ALooper::create();
+    shared_ptr<AHandler> handler(new EmptyHandler);
+    set<handler_id> ids;
+    const int kRounds = 5000;//超过旧实现11位generation的回绕周期
+    for (int i = 0; i < kRounds; i++) {
+        auto id = looper->registerHandler(handler);
+        ASSERT_NE(INVALID_HANDLER_ID, id);
+        ASSERT_TRUE(ids.insert(id).second);
+        looper->unregisterHandler(id);
+    }
+    ASSERT_EQ((size_t)kRounds, ids.size());
+}
+
+TEST(AHandler, LooperTeardownKeepsOthers){
+    auto l1 = ALooper::create();
+    shared_ptr<AHandler> h1(new EmptyHandler);
+    shared_ptr<AHandler> h2(new EmptyHandler);
+
+    auto id1 = l1->registerHandler(h1);
+    {
+        auto l2 = ALooper::create();
+        l2->registerHandler(h2);
+    }
+    ASSERT_EQ(INVALID_HANDLER_ID, h2->id());
+    ASSERT_EQ(id1, h1->id());
+}
+
+TEST(AHandler, ConcurrentRegister){
+    auto looper = ALooper::create();
+    const int kThreads = 4;
+    const int kRounds = 1000;
+
+    vector<thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.push_back(thread([&looper]{
+            for (int i = 0; i < kRounds; i++) {
+                shared_ptr<AHandler> handler(new EmptyHandler);
+                auto id = looper->registerHandler(handler);
+                ASSERT_NE(INVALID_HANDLER_ID, id);
+                looper->unregisterHandler(id);
+                ASSERT_EQ(INVALID_HANDLER_ID, handler->id());
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
+TEST(AHandler, PruneOnDestroy){
+    auto looper = ALooper::create();
+    auto before = getRosterStats();
+    {
+        shared_ptr<AHandler> handler(new EmptyHandler);
+        ASSERT_NE(INVALID_HANDLER_ID, looper->registerHandler(handler));
+        ASSERT_EQ(before.liveHandlers + 1, getRosterStats().liveHandlers);
+    }
+    auto after = getRosterStats();
+    ASSERT_EQ(before.liveHandlers, after.liveHandlers);
+    ASSERT_EQ(before.pruned + 1, after.pruned);
+}
+
+//静态存储期的handler在进程退出时才析构，此时仍会访问注册表
+static shared_ptr<ALooper> gStaticLooper;
+static shared_ptr<AHandler> gStaticHandler;
+TEST(AHandler, PruneAtExit){
+    gStaticLooper = ALooper::create();
+    gStaticHandler.reset(new EmptyHandler);
+    ASSERT_NE(INVALID_HANDLER_ID, gStaticLooper->registerHandler(gStaticHandler));
+}
+
+TEST(AHandler, BulkRegister){
+    auto looper = ALooper::create();
+    shared_ptr<AHandler> registered(new EmptyHandler);
+    looper->registerHandler(registered);
+
+    vector<shared_ptr<AHandler>> handlers;
+    for (int i = 0; i < 32; i++) {
+        handlers.push_back(shared_ptr<AHandler>(new EmptyHandler));
+    }
+    handlers.push_back(registered);
+
+    auto ids = looper->registerHandlers(handlers);
+    ASSERT_EQ(handlers.size(), ids.size());
+    for (int i = 0; i < 32; i++) {
+        ASSERT_NE(INVALID_HANDLER_ID, ids[i]);
+        ASSERT_EQ(ids[i], handlers[i]->id());
+        ASSERT_EQ(looper, handlers[i]->getLooper().lock());
+    }
+    ASSERT_EQ(INVALID_HANDLER_ID, ids.back());
+
+    ids.pop_back();
+    looper->unregisterHandlers(ids);
+    for (int i = 0; i < 32; i++) {
+        ASSERT_EQ(INVALID_HANDLER_ID, handlers[i]->id());
+    }
+    ASSERT_NE(INVALID_HANDLER_ID, registered->id());
+}
+
+class CountHandler : public AHandler{
+public:
+    atomic<int> count{0};
+protected:
+    virtual void onMessageReceived(const shared_ptr<AMessage> &msg){
+        count++;
+    }
+};
+
+//post时按id不加锁地查找looper，其他slot同时注册/注销不影响查找结果
+TEST(AHandler, LookupDuringChurn){
+    auto looper = ALooper::create();
+    looper->start();
+    shared_ptr<CountHandler> handler(new CountHandler);
+    auto id = looper->registerHandler(handler);
+
+    const int kPosts = 2000;
+    atomic<bool> done(false);
+    thread churn([&]{
+        shared_ptr<AHandler> other(new EmptyHandler);
+        while (!done) {
+            looper->unregisterHandler(looper->registerHandler(other));
+        }
+    });
+
+    for (int i = 0; i < kPosts; i++) {
+        ASSERT_EQ(OK, AMessage::create(0, id)->post());
+    }
+    done = true;
+    churn.join();
+
+    for (int i = 0; i < 500 && handler->count < kPosts; i++) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    looper->stop();
+    ASSERT_EQ(kPosts, handler->count.load());
+}
@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
 #include "../src/aloop.h"
+#include <thread>
+#include <vector>
 
 using namespace std;
 using namespace aloop;
@@ -110,4 +112,753 @@ TEST(AMessage, dup){
     ASSERT_TRUE(dupMsg->findInt32("int32", &value));
     ASSERT_EQ(2, value);
     ASSERT_EQ(1, dupMsg->countEntries());
-}
\ No newline at end of file
+}
+TEST(AMessage, ManyEntries){
+    auto msg = AMessage::create();
+    const int kCount = 100;
+
+    char name[16];
+    for (int i = 0; i < kCount; i++) {
+        snprintf(name, sizeof(name), "int%d", i);
+        msg->setInt32(name, i);
+    }
+    msg->setString("str", "aloop");
+    ASSERT_EQ(kCount + 1, msg->countEntries());
+
+    auto dupMsg = msg->dup();
+    for (int i = 0; i < kCount; i++) {
+        snprintf(name, sizeof(name), "int%d", i);
+        int32_t value = -1;
+        ASSERT_TRUE(dupMsg->findInt32(name, &value));
+        ASSERT_EQ(i, value);
+    }
+    string str;
+    ASSERT_TRUE(dupMsg->findString("str", &str));
+    ASSERT_EQ("aloop", str);
+
+    msg->clear();
+    ASSERT_EQ(0, msg->countEntries());
+    msg->setInt32("int0", 7);
+    ASSERT_EQ(1, msg->countEntries());
+}
+
+//intern表满后动态生成的名字由消息自己保存，行为不变
+TEST(AMessage, DynamicNames) {
+    char name[32];
+    for (int i = 0; i < 20000; i++) {
+        snprintf(name, sizeof(name), "dynamic%d", i);
+        AMessage::create()->setInt32(name, i);
+    }
+
+    auto msg = AMessage::create();
+    msg->setInt32("overflow-a", 1);
+    msg->setString("overflow-b", "value");
+    int32_t value = 0;
+    ASSERT_TRUE(msg->findInt32("overflow-a", &value));
+    ASSERT_EQ(1, value);
+    //AKey总是intern，与消息自己保存的名字指向同一项
+    ASSERT_TRUE(msg->findInt32(AKey("overflow-a"), &value));
+    msg->setInt32(AKey("overflow-a"), 2);
+    ASSERT_EQ(2, msg->countEntries());
+
+    auto copy = msg->dup();
+    copy->setInt32("overflow-a", 3);
+    ASSERT_TRUE(msg->findInt32("overflow-a", &value));
+    ASSERT_EQ(2, value);
+    ASSERT_TRUE(copy->findInt32("overflow-a", &value));
+    ASSERT_EQ(3, value);
+    ASSERT_EQ(2, copy->countEntries());
+
+    vector<uint8_t> data;
+    ASSERT_EQ(OK, copy->writeToBuffer(&data));
+    msg.reset();
+    copy.reset();
+    auto read = AMessage::readFromBuffer(data.data(), data.size());
+    ASSERT_TRUE(read != NULL);
+    string str;
+    ASSERT_TRUE(read->findString("overflow-b", &str));
+    ASSERT_EQ("value", str);
+    read->clear();
+    ASSERT_EQ(0, read->countEntries());
+}
+
+TEST(AMessage, KeyEntry) {
+    static const AKey kWidth("width");
+    string name = "width";
+    ASSERT_TRUE(kWidth == AKey(name.c_str()));
+    ASSERT_STREQ("width", kWidth.name());
+    ASSERT_EQ(5u, kWidth.length());
+
+    auto msg = AMessage::create();
+    msg->setInt32(kWidth, 1920);
+    msg->setInt32("height", 1080);
+
+    int32_t value = 0;
+    ASSERT_TRUE(msg->findInt32("width", &value));
+    ASSERT_EQ(1920, value);
+    ASSERT_TRUE(msg->findInt32(AKey("height"), &value));
+    ASSERT_EQ(1080, value);
+    ASSERT_FALSE(msg->contains(AKey("depth")));
+
+    //同名的const char*和AKey指向同一项
+    msg->setInt32("width", 1280);
+    ASSERT_EQ(2, msg->countEntries());
+    ASSERT_TRUE(msg->findInt32(kWidth, &value));
+    ASSERT_EQ(1280, value);
+
+    AMessage::Type type;
+    ASSERT_EQ(kWidth.name(), msg->getEntryNameAt(0, &type));
+}
+
+TEST(AMessage, HashedLookup) {
+    static const AKey kWidth = AKEY("width");
+    ASSERT_TRUE(kWidth == AKey("width"));
+    ASSERT_EQ(AKey("width").hash(), kWidth.hash());
+    static_assert(AKey::Hash("costarring") == AKey::Hash("liquid"), "FNV-1a collision");
+
+    auto msg = AMessage::create();
+    char name[16];
+    for (int i = 0; i < 60; i++) {
+        snprintf(name, sizeof(name), "key%d", i);
+        msg->setInt32(name, i);
+    }
+    //hash相同的名字仍然要区分开
+    msg->setInt32("costarring", 1);
+    msg->setInt32("liquid", 2);
+    msg->setInt32(kWidth, 3);
+
+    int32_t value = 0;
+    for (int i = 0; i < 60; i++) {
+        snprintf(name, sizeof(name), "key%d", i);
+        ASSERT_TRUE(msg->findInt32(AKey(name), &value));
+        ASSERT_EQ(i, value);
+    }
+    ASSERT_TRUE(msg->findInt32("costarring", &value));
+    ASSERT_EQ(1, value);
+    ASSERT_TRUE(msg->findInt32(AKey("liquid"), &value));
+    ASSERT_EQ(2, value);
+    ASSERT_TRUE(msg->findInt32("width", &value));
+    ASSERT_EQ(3, value);
+    ASSERT_FALSE(msg->contains("height"));
+}
+
+TEST(AMessage, StringEntry) {
+    auto msg = AMessage::create();
+    string longStr(100, 'x');
+
+    msg->setString("mime", "video/avc");
+    msg->setString("long", longStr);
+    msg->setString("part", "audio/mp4a-latm", 5);
+
+    string moved(longStr);
+    const char *movedData = moved.data();
+    msg->setString("moved", std::move(moved));
+
+    string value;
+    ASSERT_TRUE(msg->findString("mime", &value));
+    ASSERT_EQ("video/avc", value);
+    ASSERT_TRUE(msg->findString("long", &value));
+    ASSERT_EQ(longStr, value);
+    ASSERT_TRUE(msg->findString("part", &value));
+    ASSERT_EQ("audio", value);
+
+    const char *view = NULL;
+    size_t len = 0;
+    ASSERT_TRUE(msg->findString(AKey("moved"), &view, &len));
+    ASSERT_EQ(longStr.size(), len);
+    ASSERT_EQ(movedData, view);//接管了原字符串的内容，没有复制
+
+    auto dupMsg = msg->dup();
+    ASSERT_TRUE(dupMsg->findString("mime", &view));
+    ASSERT_STREQ("video/avc", view);
+    ASSERT_TRUE(dupMsg->findString("moved", &value));
+    ASSERT_EQ(longStr, value);
+}
+
+//用消息自己的字符串设置同名或其他项
+TEST(AMessage, StringSelfAssign) {
+    const string kShort = "video/avc";
+    const string kLong = "a string longer than the inline storage";
+    for (int arena = 0; arena < 2; arena++) {
+        auto msg = AMessage::create();
+        if (arena) {
+            msg->enableArena(64);
+        }
+        msg->setString("short", kShort);
+        msg->setString("long", kLong);
+
+        const char *p;
+        size_t len;
+        ASSERT_TRUE(msg->findString("short", &p, &len));
+        msg->setString("short", p, len);
+        ASSERT_TRUE(msg->findString("long", &p, &len));
+        msg->setString("long", p, len);
+        string str;
+        ASSERT_TRUE(msg->findString("short", &str));
+        ASSERT_EQ(kShort, str);
+        ASSERT_TRUE(msg->findString("long", &str));
+        ASSERT_EQ(kLong, str);
+
+        //从内联的item复制到新的item，新增item时items会扩容移动
+        msg->setInt32("a", 1);
+        msg->setInt32("b", 2);
+        ASSERT_TRUE(msg->findString("short", &p, &len));
+        msg->setString("copy", p, len);
+        ASSERT_TRUE(msg->findString("copy", &str));
+        ASSERT_EQ(kShort, str);
+    }
+}
+
+TEST(AMessage, DupCopyOnWrite) {
+    auto msg = AMessage::create();
+    auto obj = make_shared<int>(1);
+    msg->setInt32("width", 1920);
+    msg->setString("url", string(100, 'u'));
+    msg->setObject("obj", obj);
+
+    auto copy = msg->dup();
+    auto other = msg->dup();
+    ASSERT_EQ(3u, copy->countEntries());
+
+    //各自的修改互不影响
+    copy->setInt32("width", 1280);
+    copy->setInt32("height", 720);
+    msg->setString("url", "short");
+
+    int32_t value = 0;
+    string str;
+    ASSERT_TRUE(msg->findInt32("width", &value));
+    ASSERT_EQ(1920, value);
+    ASSERT_FALSE(msg->contains("height"));
+    ASSERT_TRUE(copy->findInt32("width", &value));
+    ASSERT_EQ(1280, value);
+    ASSERT_TRUE(copy->findInt32(AKey("height"), &value));
+    ASSERT_EQ(720, value);
+    ASSERT_TRUE(copy->findString("url", &str));
+    ASSERT_EQ(string(100, 'u'), str);
+    ASSERT_TRUE(msg->findString("url", &str));
+    ASSERT_EQ("short", str);
+
+    //被覆盖的item保持原来的位置
+    ASSERT_EQ(4u, copy->countEntries());
+    AMessage::Type type;
+    ASSERT_STREQ("width", copy->getEntryNameAt(0, &type));
+    ASSERT_STREQ("url", copy->getEntryNameAt(1, &type));
+    ASSERT_EQ(AMessage::kTypeString, type);
+    ASSERT_STREQ("height", copy->getEntryNameAt(3, &type));
+    ASSERT_EQ(NULL, copy->getEntryNameAt(4, &type));
+
+    //dup修改过的消息
+    auto copy2 = copy->dup();
+    ASSERT_EQ(4u, copy2->countEntries());
+    ASSERT_TRUE(copy2->findInt32("width", &value));
+    ASSERT_EQ(1280, value);
+    ASSERT_TRUE(copy2->findInt32("height", &value));
+    ASSERT_EQ(720, value);
+
+    ASSERT_LT(1, obj.use_count());
+    msg.reset();
+    copy->clear();
+    ASSERT_EQ(0u, copy->countEntries());
+    copy.reset();
+    shared_ptr<int> found;
+    ASSERT_TRUE(other->findObject("obj", &found));
+    ASSERT_EQ(obj, found);
+    found.reset();
+    other.reset();
+    copy2.reset();
+    ASSERT_EQ(1, obj.use_count());
+}
+
+TEST(AMessage, DupKeepsSource) {
+    auto msg = AMessage::create();
+    msg->setString("url", string(100, 'u'));
+    msg->setInt32("width", 1920);
+
+    //dup()不移动原消息的items，之前取得的字符串指针仍然有效
+    const char *url = NULL;
+    size_t len = 0;
+    ASSERT_TRUE(msg->findString("url", &url, &len));
+    auto copy = msg->dup();
+    const char *again = NULL;
+    ASSERT_TRUE(msg->findString("url", &again));
+    ASSERT_EQ(url, again);
+    ASSERT_EQ(string(100, 'u'), string(url, len));
+
+    //dup()之后修改原消息，已有的副本不变，新的副本看到新值
+    msg->setInt32("width", 1280);
+    int32_t value = 0;
+    ASSERT_TRUE(copy->findInt32("width", &value));
+    ASSERT_EQ(1920, value);
+    ASSERT_TRUE(msg->dup()->findInt32("width", &value));
+    ASSERT_EQ(1280, value);
+
+    //多个线程同时dup()同一个模板消息
+    vector<thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([msg] {
+            for (int j = 0; j < 1000; ++j) {
+                auto copy = msg->dup();
+                int32_t width = 0;
+                string url;
+                ASSERT_TRUE(copy->findInt32("width", &width));
+                ASSERT_EQ(1280, width);
+                ASSERT_TRUE(copy->findString("url", &url));
+                ASSERT_EQ(100u, url.size());
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    ASSERT_TRUE(msg->findString("url", &again));
+    ASSERT_EQ(url, again);
+}
+
+TEST(AMessage, TakeObject) {
+    auto msg = AMessage::create();
+    auto obj = make_shared<string>("payload");
+    const string *raw = obj.get();
+
+    msg->setObject("copied", obj);
+    ASSERT_EQ(2, obj.use_count());
+    msg->setObject("moved", std::move(obj));
+    ASSERT_EQ(NULL, obj.get());
+
+    shared_ptr<string> found;
+    ASSERT_TRUE(msg->findObject("moved", &found));
+    ASSERT_EQ(raw, found.get());
+    ASSERT_EQ(3, found.use_count());
+    found.reset();
+
+    //取出后该项被删除
+    shared_ptr<string> taken;
+    ASSERT_TRUE(msg->takeObject(AKey("moved"), &taken));
+    ASSERT_EQ(raw, taken.get());
+    ASSERT_EQ(2, taken.use_count());
+    ASSERT_FALSE(msg->contains("moved"));
+    ASSERT_FALSE(msg->takeObject("moved", &taken));
+    ASSERT_EQ(1u, msg->countEntries());
+
+    //从dup()出来的消息中取出不影响其他消息
+    auto copy = msg->dup();
+    ASSERT_TRUE(copy->takeObject("copied", &found));
+    ASSERT_EQ(raw, found.get());
+    ASSERT_FALSE(copy->contains("copied"));
+    ASSERT_TRUE(msg->findObject("copied", &found));
+    ASSERT_EQ(raw, found.get());
+
+    msg.reset();
+    copy.reset();
+    found.reset();
+    ASSERT_EQ(1, taken.use_count());
+}
+
+TEST(AMessage, UniqueEntry) {
+    struct Buffer {
+        explicit Buffer(int *alive) : mAlive(alive) { ++*mAlive; }
+        ~Buffer() { --*mAlive; }
+        int *mAlive;
+    };
+
+    int alive = 0;
+    auto msg = AMessage::create();
+    msg->setUnique("buffer", unique_ptr<Buffer>(new Buffer(&alive)));
+    msg->setUnique(AKey("other"), unique_ptr<Buffer>(new Buffer(&alive)));
+    ASSERT_EQ(2, alive);
+
+    AMessage::Type type;
+    ASSERT_STREQ("buffer", msg->getEntryNameAt(0, &type));
+    ASSERT_EQ(AMessage::kTypeUnique, type);
+
+    //类型不符时取不出，该项保留
+    ASSERT_EQ(NULL, msg->take<int>("buffer").get());
+    ASSERT_TRUE(msg->contains("buffer"));
+
+    //独占对象不能复制
+    ASSERT_EQ(NULL, msg->dup().get());
+
+    unique_ptr<Buffer> buffer = msg->take<Buffer>(AKey("buffer"));
+    ASSERT_NE(nullptr, buffer);
+    ASSERT_FALSE(msg->contains("buffer"));
+    ASSERT_EQ(2, alive);
+    buffer.reset();
+    ASSERT_EQ(1, alive);
+
+    //覆盖和释放消息时delete
+    msg->setInt32("other", 1);
+    ASSERT_EQ(0, alive);
+    msg->setUnique("last", unique_ptr<Buffer>(new Buffer(&alive)));
+    msg.reset();
+    ASSERT_EQ(0, alive);
+}
+
+TEST(AMessage, ObtainFromPool) {
+    MessagePoolStats before = getMessagePoolStats();
+    //统计从0开始，不是未初始化的值
+    ASSERT_LE(before.hits, before.obtained);
+    ASSERT_LE(before.released, before.recycled);
+    ASSERT_LT(before.obtained, 1ULL << 40);
+    ASSERT_LE(before.cached, (size_t)1 << 20);
+
+    //释放的消息回到本线程缓存，再次obtain()时命中
+    auto msg = AMessage::obtain(1, INVALID_HANDLER_ID);
+    msg->setInt32("value", 1);
+    msg.reset();
+    msg = AMessage::obtain();
+    ASSERT_EQ(0u, msg->what());
+    ASSERT_FALSE(msg->contains("value"));
+    msg.reset();
+
+    MessagePoolStats after = getMessagePoolStats();
+    ASSERT_EQ(before.obtained + 2, after.obtained);
+    ASSERT_LE(before.hits + 1, after.hits);
+    ASSERT_EQ(before.recycled + 2, after.recycled);
+
+    //在其他线程释放的消息成批归还，创建线程可以取回
+    const int kCount = 1000;
+    vector<shared_ptr<AMessage>> msgs;
+    for (int i = 0; i < kCount; i++) {
+        msgs.push_back(AMessage::obtain());
+    }
+    thread releaser([&msgs]{
+        msgs.clear();
+    });
+    releaser.join();
+
+    before = getMessagePoolStats();
+    for (int i = 0; i < kCount; i++) {
+        msgs.push_back(AMessage::obtain());
+    }
+    after = getMessagePoolStats();
+    ASSERT_LT(before.refills, after.refills);
+    ASSERT_LE(before.hits + kCount / 2, after.hits);
+}
+
+//静态存储期的消息在进程退出时才释放，此时仍会访问消息池
+static shared_ptr<AMessage> gStaticMessage;
+TEST(AMessage, ObtainAtExit) {
+    gStaticMessage = AMessage::obtain(1, INVALID_HANDLER_ID);
+    gStaticMessage->setInt32("value", 1);
+}
+
+TEST(AMessage, ArenaStrings) {
+    auto msg = AMessage::create();
+    msg->enableArena(64);
+
+    char name[16];
+    vector<string> values;
+    for (int i = 0; i < 10; i++) {
+        snprintf(name, sizeof(name), "field%d", i);
+        values.push_back(string(40 + i, 'a' + i));
+        msg->setString(name, values.back());
+    }
+    msg->setString("short", "avc");
+
+    const char *view = NULL;
+    size_t len = 0;
+    for (int i = 0; i < 10; i++) {
+        snprintf(name, sizeof(name), "field%d", i);
+        ASSERT_TRUE(msg->findString(name, &view, &len));
+        ASSERT_EQ(values[i], string(view, len));
+        ASSERT_EQ('\0', view[len]);
+    }
+
+    //arena中的字符串在dup()之后仍然有效
+    auto copy = msg->dup();
+    msg->clear();
+    msg->setString("field0", string(100, 'z'));
+    ASSERT_TRUE(copy->findString("field9", &view, &len));
+    ASSERT_EQ(values[9], string(view, len));
+    ASSERT_TRUE(msg->findString("field0", &view, &len));
+    ASSERT_EQ(string(100, 'z'), string(view, len));
+
+    copy->setString("field1", string(30, 'y'));
+    shared_ptr<string> obj;
+    copy->setObject("obj", make_shared<string>("x"));
+    ASSERT_TRUE(copy->takeObject("obj", &obj));
+    ASSERT_TRUE(copy->findString("field2", &view, &len));
+    ASSERT_EQ(values[2], string(view, len));
+}
+
+ALOOP_FIELD(Width, int32_t);
+ALOOP_FIELD(Height, int32_t);
+ALOOP_FIELD(Mime, std::string);
+ALOOP_FIELD(Payload, std::shared_ptr<int>);
+typedef TypedMessage<Width, Height, Mime, Payload> FormatMessage;
+
+TEST(AMessage, TypedMessage) {
+    auto msg = FormatMessage::create(1, INVALID_HANDLER_ID);
+    ASSERT_EQ(0, msg->get<Width>());
+    msg->set<Width>(1920);
+    msg->set<Height>(1080);
+    msg->set<Mime>("video/avc");
+    msg->set<Payload>(make_shared<int>(7));
+    msg->setInt32("extra", 1);
+
+    ASSERT_EQ(1920, msg->get<Width>());
+    ASSERT_EQ("video/avc", msg->get<Mime>());
+
+    //字段可以通过AMessage的接口枚举
+    shared_ptr<AMessage> base = msg;
+    ASSERT_EQ(5u, base->countEntries());
+    AMessage::Type type;
+    ASSERT_STREQ("Height", base->getEntryNameAt(1, &type));
+    ASSERT_EQ(AMessage::kTypeInt32, type);
+    ASSERT_STREQ("Payload", base->getEntryNameAt(3, &type));
+    ASSERT_EQ(AMessage::kTypeObject, type);
+    ASSERT_STREQ("extra", base->getEntryNameAt(4, &type));
+
+    //通过AMessage的dup()复制也保留字段
+    auto copy = FormatMessage::cast(base->dup());
+    ASSERT_NE(nullptr, copy);
+    copy->set<Width>(1280);
+    ASSERT_EQ(1280, copy->get<Width>());
+    ASSERT_EQ(1920, msg->get<Width>());
+    ASSERT_EQ(7, *copy->get<Payload>());
+    ASSERT_TRUE(copy->contains("extra"));
+
+    //字段不能序列化，不跳过时失败，跳过时只写出普通的附加数据
+    vector<uint8_t> wire;
+    ASSERT_EQ(INVALID_OPERATION, base->writeToBuffer(&wire));
+    ASSERT_TRUE(wire.empty());
+    ASSERT_EQ(OK, base->writeToBuffer(&wire, true));
+    auto restored = AMessage::readFromBuffer(wire.data(), wire.size());
+    ASSERT_NE(nullptr, restored);
+    ASSERT_EQ(1u, restored->countEntries());
+    ASSERT_TRUE(restored->contains("extra"));
+
+    ASSERT_EQ(nullptr, FormatMessage::cast(AMessage::create()));
+    ASSERT_EQ(nullptr, (TypedMessage<Width, Height>::cast(base)));
+}
+
+TEST(AMessage, WireFormat) {
+    auto msg = AMessage::create(7, INVALID_HANDLER_ID);
+    msg->setInt32("int32", -3);
+    msg->setInt64("int64", 1LL << 40);
+    msg->setSize("size", 12345);
+    msg->setFloat("float", 1.5f);
+    msg->setDouble("double", -2.25);
+    msg->setString("mime", "video/avc");
+    msg->setString("url", string(100, 'u'));
+
+    vector<uint8_t> buffer;
+    ASSERT_EQ(OK, msg->writeToBuffer(&buffer));
+    //小端，带版本号
+    ASSERT_EQ(0, memcmp(buffer.data(), "AMSG\x01", 5));
+    ASSERT_EQ(7, buffer[8]);
+
+    auto decoded = AMessage::readFromBuffer(buffer.data(), buffer.size());
+    ASSERT_NE(nullptr, decoded);
+    ASSERT_EQ(7u, decoded->what());
+    ASSERT_EQ(7u, decoded->countEntries());
+    int32_t i32;
+    int64_t i64;
+    size_t sz;
+    float f;
+    double d;
+    string str;
+    ASSERT_TRUE(decoded->findInt32("int32", &i32));
+    ASSERT_EQ(-3, i32);
+    ASSERT_TRUE(decoded->findInt64("int64", &i64));
+    ASSERT_EQ(1LL << 40, i64);
+    ASSERT_TRUE(decoded->findSize("size", &sz));
+    ASSERT_EQ(12345u, sz);
+    ASSERT_TRUE(decoded->findFloat("float", &f));
+    ASSERT_EQ(1.5f, f);
+    ASSERT_TRUE(decoded->findDouble("double", &d));
+    ASSERT_EQ(-2.25, d);
+    ASSERT_TRUE(decoded->findString("url", &str));
+    ASSERT_EQ(string(100, 'u'), str);
+
+    //直接在数据上读取
+    AMessageView view;
+    ASSERT_TRUE(view.init(buffer.data(), buffer.size()));
+    ASSERT_EQ(7u, view.what());
+    ASSERT_EQ(buffer.size(), view.size());
+    ASSERT_TRUE(view.findInt32(AKey("int32"), &i32));
+    ASSERT_EQ(-3, i32);
+    ASSERT_TRUE(view.findDouble("double", &d));
+    ASSERT_EQ(-2.25, d);
+    const char *s = NULL;
+    size_t len = 0;
+    ASSERT_TRUE(view.findString("mime", &s, &len));
+    ASSERT_EQ("video/avc", string(s, len));
+    ASSERT_FALSE(view.findInt64("int32", &i64));
+    ASSERT_FALSE(view.contains("missing"));
+
+    //不合法的数据
+    ASSERT_FALSE(view.init(buffer.data(), buffer.size() - 1));
+    ASSERT_EQ(nullptr, AMessage::readFromBuffer(buffer.data(), 10));
+    buffer[4] = 2;
+    ASSERT_FALSE(view.init(buffer.data(), buffer.size()));
+
+    msg->setPointer("pointer", NULL);
+    ASSERT_EQ(INVALID_OPERATION, msg->writeToBuffer(&buffer));
+}
+
+TEST(AMessage, Buffer) {
+    auto buffer = ABuffer::create(1000, ABuffer::kSimdAlignment);
+    ASSERT_NE(nullptr, buffer);
+    ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(buffer->data()) % ABuffer::kSimdAlignment);
+    ASSERT_EQ(1000u, buffer->size());
+    ASSERT_EQ(nullptr, ABuffer::create(10, 3));
+    for (int i = 0; i < 1000; i++) {
+        buffer->data()[i] = (uint8_t)i;
+    }
+
+    //slice共享内存，原buffer释放后仍然有效
+    ASSERT_EQ(OK, buffer->setRange(100, 800));
+    ASSERT_EQ(INVALID_OPERATION, buffer->setRange(100, 901));
+    auto slice = buffer->slice(10, 20);
+    ASSERT_NE(nullptr, slice);
+    ASSERT_EQ(nullptr, buffer->slice(790, 11));
+    ASSERT_EQ(buffer->data() + 10, slice->data());
+    ASSERT_EQ(20u, slice->size());
+    ASSERT_EQ(OK, slice->setRange(5, 10));
+    buffer.reset();
+    ASSERT_EQ(115, slice->data()[0]);
+
+    //消息中只保存引用
+    auto msg = AMessage::create();
+    msg->setBuffer("frame", slice);
+    ASSERT_EQ(2, slice.use_count());
+    shared_ptr<ABuffer> found;
+    ASSERT_TRUE(msg->findBuffer(AKey("frame"), &found));
+    ASSERT_EQ(slice, found);
+    ASSERT_FALSE(msg->findBuffer("missing", &found));
+    auto copy = msg->dup();
+    ASSERT_TRUE(copy->findBuffer("frame", &found));
+    ASSERT_EQ(slice, found);
+    AMessage::Type type;
+    ASSERT_STREQ("frame", msg->getEntryNameAt(0, &type));
+    ASSERT_EQ(AMessage::kTypeBuffer, type);
+
+    //序列化有效范围内的数据
+    vector<uint8_t> data;
+    ASSERT_EQ(OK, msg->writeToBuffer(&data));
+    auto decoded = AMessage::readFromBuffer(data.data(), data.size());
+    ASSERT_NE(nullptr, decoded);
+    ASSERT_TRUE(decoded->findBuffer("frame", &found));
+    ASSERT_EQ(10u, found->size());
+    ASSERT_EQ(0, memcmp(slice->data(), found->data(), 10));
+
+    AMessageView view;
+    ASSERT_TRUE(view.init(data.data(), data.size()));
+    const uint8_t *bytes = NULL;
+    size_t size = 0;
+    ASSERT_TRUE(view.findBuffer("frame", &bytes, &size));
+    ASSERT_EQ(10u, size);
+    ASSERT_EQ(0, memcmp(slice->data(), bytes, 10));
+
+    copy.reset();
+    msg->clear();
+    ASSERT_EQ(1, slice.use_count());
+}
+
+TEST(AMessage, NestedMessage) {
+    auto format = AMessage::create();
+    format->setInt32("width", 1920);
+    format->setString("mime", "video/avc");
+    auto msg = AMessage::create(3, INVALID_HANDLER_ID);
+    msg->setMessage("format", format);
+    msg->setInt32("index", 1);
+
+    shared_ptr<AMessage> found;
+    ASSERT_TRUE(msg->findMessage(AKey("format"), &found));
+    ASSERT_EQ(format, found);
+    ASSERT_FALSE(msg->findMessage("index", &found));
+
+    //嵌套的消息也被dup()，修改互不影响
+    auto copy = msg->dup();
+    shared_ptr<AMessage> nestedCopy;
+    ASSERT_TRUE(copy->findMessage("format", &nestedCopy));
+    ASSERT_NE(format, nestedCopy);
+    nestedCopy->setInt32("width", 1280);
+    int32_t width = 0;
+    ASSERT_TRUE(format->findInt32("width", &width));
+    ASSERT_EQ(1920, width);
+    ASSERT_EQ(2u, copy->countEntries());
+    auto again = copy->dup();
+    ASSERT_TRUE(again->findMessage("format", &found));
+    ASSERT_TRUE(found->findInt32("width", &width));
+    ASSERT_EQ(1280, width);
+
+    vector<uint8_t> data;
+    ASSERT_EQ(OK, msg->writeToBuffer(&data));
+    auto decoded = AMessage::readFromBuffer(data.data(), data.size());
+    ASSERT_NE(nullptr, decoded);
+    ASSERT_TRUE(decoded->findMessage("format", &found));
+    string mime;
+    ASSERT_TRUE(found->findString("mime", &mime));
+    ASSERT_EQ("video/avc", mime);
+
+    AMessageView view, nested;
+    ASSERT_TRUE(view.init(data.data(), data.size()));
+    ASSERT_TRUE(view.findMessage("format", &nested));
+    ASSERT_TRUE(nested.findInt32("width", &width));
+    ASSERT_EQ(1920, width);
+    ASSERT_FALSE(view.findMessage("index", &nested));
+
+    //包含自己时不能序列化
+    format->setMessage("parent", msg);
+    ASSERT_EQ(INVALID_OPERATION, msg->writeToBuffer(&data));
+    format->clear();
+}
+
+TEST(AMessage, Arrays) {
+    vector<float> samples(1000);
+    for (size_t i = 0; i < samples.size(); i++) {
+        samples[i] = i * 0.5f;
+    }
+    const int32_t histogram[] = {1, -2, 3, -4, 5};
+    const int64_t times[] = {1LL << 40, -1};
+    auto msg = AMessage::create();
+    msg->setFloatArray("samples", samples.data(), samples.size());
+    msg->setInt32Array(AKey("histogram"), histogram, 5);
+    msg->setInt64Array("times", times, 2);
+    msg->setDoubleArray("empty", NULL, 0);
+
+    const float *values = NULL;
+    size_t count = 0;
+    ASSERT_TRUE(msg->findFloatArray("samples", &values, &count));
+    ASSERT_EQ(samples.size(), count);
+    ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(values) % ABuffer::kSimdAlignment);
+    ASSERT_EQ(0, memcmp(samples.data(), values, count * sizeof(float)));
+    const int32_t *ints = NULL;
+    ASSERT_FALSE(msg->findInt32Array("samples", &ints, &count));
+    ASSERT_TRUE(msg->findInt32Array("histogram", &ints, &count));
+    ASSERT_EQ(5u, count);
+    ASSERT_EQ(-4, ints[3]);
+
+    //dup()共享同一块内存
+    auto copy = msg->dup();
+    const float *copied = NULL;
+    ASSERT_TRUE(copy->findFloatArray(AKey("samples"), &copied, &count));
+    ASSERT_EQ(values, copied);
+
+    vector<uint8_t> data;
+    ASSERT_EQ(OK, msg->writeToBuffer(&data));
+    auto decoded = AMessage::readFromBuffer(data.data(), data.size());
+    ASSERT_NE(nullptr, decoded);
+    ASSERT_TRUE(decoded->findFloatArray("samples", &values, &count));
+    ASSERT_EQ(samples.size(), count);
+    ASSERT_EQ(0, memcmp(samples.data(), values, count * sizeof(float)));
+    const int64_t *longs = NULL;
+    ASSERT_TRUE(decoded->findInt64Array("times", &longs, &count));
+    ASSERT_EQ(2u, count);
+    ASSERT_EQ(1LL << 40, longs[0]);
+    const double *doubles = NULL;
+    ASSERT_TRUE(decoded->findDoubleArray("empty", &doubles, &count));
+    ASSERT_EQ(0u, count);
+
+    //用该项原来的数组设置自己
+    auto self = AMessage::create();
+    self->setInt32Array("histogram", histogram, 5);
+    ASSERT_TRUE(self->findInt32Array("histogram", &ints, &count));
+    self->setInt32Array("histogram", ints + 1, count - 1);
+    ASSERT_TRUE(self->findInt32Array("histogram", &ints, &count));
+    ASSERT_EQ(4u, count);
+    ASSERT_EQ(-2, ints[0]);
+    ASSERT_EQ(5, ints[3]);
+}
@@ -6,6 +6,13 @@
 #include <vector>
 #include <mutex>
 #include <condition_variable>
+#ifdef __linux__
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 using namespace std;
 using namespace aloop;
@@ -63,6 +70,76 @@ TEST_F(ALoopTest, post) {
     ASSERT_EQ(future_status::ready, barrierFuture.wait_for(chrono::milliseconds(100)));
 }
 
+TEST_F(ALoopTest, postById) {
+    promise<int32_t> received;
+    auto receivedFuture = received.get_future();
+
+    mHandler->setProcessor([&received](Msg msg){
+        int32_t value = 0;
+        msg->findInt32("extra", &value);
+        received.set_value(value);
+    });
+
+    auto msg = AMessage::create(0, mHandler->id());
+    msg->setInt32("extra", 3);
+    ASSERT_EQ(OK, msg->dup()->post());
+
+    ASSERT_EQ(future_status::ready, receivedFuture.wait_for(chrono::milliseconds(100)));
+    ASSERT_EQ(3, receivedFuture.get());
+
+    mLooper->unregisterHandler(mHandler->id());
+    ASSERT_EQ(NOT_FOUND, msg->post());
+}
+
+//同一批中前面的消息注销了handler，后面的消息不再派发给它
+TEST(ALoop, unregisterInsideBatch) {
+    auto looper = ALooper::create();
+    shared_ptr<MyHandler> handler(new MyHandler);
+    looper->registerHandler(handler);
+    int received = 0;
+    promise<void> done;
+    handler->setProcessor([&](Msg msg){
+        ++received;
+        looper->unregisterHandler(handler->id());
+    });
+    shared_ptr<MyHandler> last(new MyHandler);
+    looper->registerHandler(last);
+    last->setProcessor([&](Msg msg){
+        done.set_value();
+    });
+
+    //start前post，保证在同一批中派发
+    for (int i = 0; i < 3; i++) {
+        ASSERT_EQ(OK, AMessage::create(0, handler)->post());
+    }
+    ASSERT_EQ(OK, AMessage::create(0, handler->id())->post());
+    ASSERT_EQ(OK, AMessage::create(0, last)->post());
+    ASSERT_EQ(OK, looper->start());
+    ASSERT_EQ(future_status::ready, done.get_future().wait_for(chrono::seconds(1)));
+    ASSERT_EQ(1, received);
+    looper->stop();
+}
+
+ALOOP_FIELD(Index, int64_t);
+typedef TypedMessage<Index> IndexMessage;
+
+TEST_F(ALoopTest, postTyped) {
+    promise<int64_t> received;
+    auto receivedFuture = received.get_future();
+
+    mHandler->setProcessor([&received](Msg msg){
+        auto typed = IndexMessage::cast(msg);
+        received.set_value(typed != NULL ? typed->get<Index>() : -1);
+    });
+
+    auto msg = IndexMessage::create(0, mHandler);
+    msg->set<Index>(42);
+    ASSERT_EQ(OK, msg->post());
+
+    ASSERT_EQ(future_status::ready, receivedFuture.wait_for(chrono::milliseconds(100)));
+    ASSERT_EQ(42, receivedFuture.get());
+}
+
 TEST_F(ALoopTest, postAndAwaitResponse) {
     mHandler->setProcessor([](Msg msg){
         shared_ptr<AReplyToken> token;
@@ -135,6 +212,65 @@ TEST_F(ALoopTest, Delay){
     ASSERT_TRUE(diff < 10*1000L);
 }
 
+TEST(ALoop, migrateHandler) {
+    auto l1 = ALooper::create();
+    auto l2 = ALooper::create();
+    shared_ptr<MyHandler> handler(new MyHandler);
+    auto id = l1->registerHandler(handler);
+
+    vector<int32_t> received;
+    promise<thread::id> done;
+    handler->setProcessor([&](Msg msg){
+        received.push_back(msg->what());
+        if (received.size() == 4)
+            done.set_value(this_thread::get_id());
+    });
+
+    //l1未启动，消息都滞留在l1上，迁移后按顺序转到l2
+    auto early = AMessage::create(3, handler);
+    ASSERT_EQ(OK, AMessage::create(1, handler)->post());
+    ASSERT_EQ(OK, AMessage::create(2, id)->post());
+    ASSERT_EQ(OK, l1->migrateHandler(id, l2));
+    ASSERT_EQ(0u, l1->getQueueDepth());
+    ASSERT_EQ(id, handler->id());
+    ASSERT_EQ(l2, handler->getLooper().lock());
+
+    ASSERT_EQ(OK, early->post());
+    ASSERT_EQ(OK, AMessage::create(4, handler)->post());
+    ASSERT_EQ(4u, l2->getQueueDepth());
+
+    ASSERT_EQ(OK, l2->start());
+    auto doneFuture = done.get_future();
+    ASSERT_EQ(future_status::ready, doneFuture.wait_for(chrono::milliseconds(100)));
+    ASSERT_NE(this_thread::get_id(), doneFuture.get());
+    ASSERT_EQ((vector<int32_t>{1, 2, 3, 4}), received);
+
+    ASSERT_EQ(NOT_FOUND, l1->migrateHandler(id, l2));
+    l2->stop();
+}
+
+TEST(ALoop, balancer) {
+    auto hot = ALooper::create();
+    auto cold = ALooper::create();
+    shared_ptr<MyHandler> busy(new MyHandler);
+    shared_ptr<MyHandler> idle(new MyHandler);
+    hot->registerHandler(busy);
+    hot->registerHandler(idle);
+
+    for (int i = 0; i < 20; i++) {
+        AMessage::create(0, busy)->post();
+    }
+    AMessage::create(0, idle)->post();
+
+    ALooperBalancer balancer({hot, cold}, 10);
+    ASSERT_EQ(busy->id(), balancer.rebalance());
+    ASSERT_EQ(cold, busy->getLooper().lock());
+    ASSERT_EQ(1u, hot->getQueueDepth());
+    ASSERT_EQ(20u, cold->getQueueDepth());
+
+    ASSERT_EQ(INVALID_HANDLER_ID, balancer.rebalance());
+}
+
 TEST(ALoop, stopInsideThread) {//该项测试不应该卡死或异常
     class Sync{
     public:
@@ -187,4 +323,515 @@ TEST(ALoop, stopInsideThread) {//该项测试不应该卡死或异常
 
     std::this_thread::sleep_for(chrono::milliseconds(10));
     ASSERT_EQ(0, wp.use_count());
-}
\ No newline at end of file
+}
+#ifdef __linux__
+class PipeHandler : public AHandler {
+public:
+    PipeHandler() {
+        pipe(mFds);
+    }
+    ~PipeHandler() {
+        close(mFds[0]);
+        close(mFds[1]);
+    }
+
+    int readFd() const { return mFds[0]; }
+    void send(char c) {
+        write(mFds[1], &c, 1);
+    }
+
+    promise<thread::id> mMessageThread;
+    promise<string> mReceived;
+    size_t mExpected{0};
+    string mData;
+    thread::id mFdThread;
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage> &msg){
+        mMessageThread.set_value(this_thread::get_id());
+    }
+    virtual void onFdEvent(int fd, uint32_t events){
+        mFdThread = this_thread::get_id();
+        char buf[64];
+        ASSERT_TRUE(events & ALooper::EVENT_INPUT);
+        ssize_t n = read(fd, buf, sizeof(buf));
+        mData.append(buf, n);
+        if (mData.size() == mExpected)
+            mReceived.set_value(mData);
+    }
+private:
+    int mFds[2];
+};
+
+//fd的回调与消息在同一个looper线程上执行
+TEST_F(ALoopTest, addFd) {
+    shared_ptr<PipeHandler> handler(new PipeHandler);
+    mLooper->registerHandler(handler);
+    handler->mExpected = 3;
+    ASSERT_EQ(OK, mLooper->addFd(handler->readFd(), ALooper::EVENT_INPUT, handler));
+
+    auto received = handler->mReceived.get_future();
+    handler->send('a');
+    handler->send('b');
+    handler->send('c');
+    ASSERT_EQ(future_status::ready, received.wait_for(chrono::seconds(1)));
+    ASSERT_EQ("abc", received.get());
+
+    AMessage::create(0, handler)->post();
+    auto messageThread = handler->mMessageThread.get_future();
+    ASSERT_EQ(future_status::ready, messageThread.wait_for(chrono::seconds(1)));
+    ASSERT_EQ(messageThread.get(), handler->mFdThread);
+
+    ASSERT_EQ(OK, mLooper->removeFd(handler->readFd()));
+    ASSERT_EQ(NOT_FOUND, mLooper->removeFd(handler->readFd()));
+    handler->send('d');
+    std::this_thread::sleep_for(chrono::milliseconds(20));
+    ASSERT_EQ("abc", handler->mData);
+}
+
+class FdFuncHandler : public AHandler {
+public:
+    explicit FdFuncHandler(const function<void(int)> &func) : mFunc(func) {}
+protected:
+    virtual void onMessageReceived(const std::shared_ptr<AMessage> &msg){}
+    virtual void onFdEvent(int fd, uint32_t events){
+        mFunc(fd);
+    }
+private:
+    function<void(int)> mFunc;
+};
+
+//只能监听注册在该looper上的handler
+TEST_F(ALoopTest, addFdWrongLooper) {
+    shared_ptr<PipeHandler> handler(new PipeHandler);
+    ASSERT_EQ(INVALID_OPERATION, mLooper->addFd(handler->readFd(), ALooper::EVENT_INPUT, handler));
+    auto other = ALooper::create();
+    other->registerHandler(handler);
+    ASSERT_EQ(INVALID_OPERATION, mLooper->addFd(handler->readFd(), ALooper::EVENT_INPUT, handler));
+    ASSERT_EQ(OK, other->addFd(handler->readFd(), ALooper::EVENT_INPUT, handler));
+}
+
+//同一批就绪的fd中，被之前的回调移除的fd不再回调
+TEST_F(ALoopTest, removeFdInsideBatch) {
+    int first[2], second[2];
+    ASSERT_EQ(0, pipe(first));
+    ASSERT_EQ(0, pipe(second));
+    atomic<int> calls(0);
+    auto onFd = [&](int fd) {
+        char c;
+        read(fd, &c, 1);
+        ++calls;
+        mLooper->removeFd(first[0]);
+        mLooper->removeFd(second[0]);
+    };
+    shared_ptr<FdFuncHandler> handler1(new FdFuncHandler(onFd));
+    shared_ptr<FdFuncHandler> handler2(new FdFuncHandler(onFd));
+    mLooper->registerHandler(handler1);
+    mLooper->registerHandler(handler2);
+    ASSERT_EQ(OK, mLooper->addFd(first[0], ALooper::EVENT_INPUT, handler1));
+    ASSERT_EQ(OK, mLooper->addFd(second[0], ALooper::EVENT_INPUT, handler2));
+
+    //looper忙的时候两个fd都变为可读，之后在同一批中返回
+    promise<void> busy;
+    mHandler->setProcessor([&busy](Msg msg){
+        busy.set_value();
+        std::this_thread::sleep_for(chrono::milliseconds(50));
+    });
+    AMessage::create(0, mHandler)->post();
+    busy.get_future().wait();
+    write(first[1], "x", 1);
+    write(second[1], "x", 1);
+    std::this_thread::sleep_for(chrono::milliseconds(100));
+    ASSERT_EQ(1, calls.load());
+
+    close(first[0]);
+    close(first[1]);
+    close(second[0]);
+    close(second[1]);
+}
+
+//改为在epoll上等待后，延迟消息由timerfd按时唤醒
+TEST_F(ALoopTest, DelayWithFd){
+    shared_ptr<PipeHandler> pipeHandler(new PipeHandler);
+    mLooper->registerHandler(pipeHandler);
+    ASSERT_EQ(OK, mLooper->addFd(pipeHandler->readFd(), ALooper::EVENT_INPUT, pipeHandler));
+
+    int64_t begin = mLooper->GetNowUs();
+    promise<int64_t> duration;
+    mHandler->setProcessor([&](Msg msg){
+        duration.set_value(mLooper->GetNowUs() - begin);
+    });
+
+    const int64_t delay = 100*1000L;
+    ASSERT_EQ(OK, AMessage::create(0, mHandler)->post(delay));
+    AMessage::create(1, pipeHandler)->post();
+
+    auto durationFuture = duration.get_future();
+    ASSERT_EQ(future_status::ready, durationFuture.wait_for(chrono::milliseconds(200)));
+    auto diff = abs(durationFuture.get() - delay);
+    ASSERT_TRUE(diff < 10*1000L);
+
+    //handler析构后不再回调
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    {
+        shared_ptr<PipeHandler> temp(new PipeHandler);
+        mLooper->registerHandler(temp);
+        ASSERT_EQ(OK, mLooper->addFd(fds[0], ALooper::EVENT_INPUT, temp));
+    }
+    write(fds[1], "x", 1);
+    std::this_thread::sleep_for(chrono::milliseconds(20));
+    ASSERT_EQ(NOT_FOUND, mLooper->removeFd(fds[0]));
+    close(fds[0]);
+    close(fds[1]);
+}
+//同样的用例分别在io_uring和epoll两种方式下运行
+class ALoopIoTest : public testing::TestWithParam<bool> {
+public:
+    virtual void SetUp() {
+        mLooper = ALooper::create();
+        if (GetParam() && mLooper->enableIoUring() != OK) {
+            GTEST_SKIP() << "io_uring unavailable";
+        }
+        ASSERT_EQ(GetParam(), mLooper->isIoUringEnabled());
+        mHandler.reset(new MyHandler);
+        mLooper->registerHandler(mHandler);
+        ASSERT_EQ(OK, mLooper->start());
+    }
+    virtual void TearDown() {
+        if (mLooper)
+            mLooper->stop();
+    }
+protected:
+    shared_ptr<ALooper> mLooper;
+    shared_ptr<MyHandler> mHandler;
+};
+
+TEST_P(ALoopIoTest, ReadWriteFile) {
+    char path[] = "/tmp/aloop-io-XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    unlink(path);
+
+    auto data = ABuffer::create(64);
+    memcpy(data->data(), "hello io", 8);
+    data->setRange(0, 8);
+    promise<int32_t> written;
+    ASSERT_EQ(OK, mLooper->submitWrite(fd, data, 4, [&written](int32_t result) {
+        written.set_value(result);
+    }));
+    ASSERT_EQ(8, written.get_future().get());
+
+    //在looper线程上提交，完成时通过消息通知
+    auto buffer = ABuffer::create(64);
+    promise<string> read;
+    mHandler->setProcessor([&](Msg msg){
+        if (msg->what() == 0) {
+            ASSERT_EQ(OK, mLooper->submitRead(fd, buffer, 0, AMessage::create(1, mHandler)));
+            return;
+        }
+        int32_t result = 0;
+        ASSERT_TRUE(msg->findInt32("result", &result));
+        shared_ptr<ABuffer> received;
+        ASSERT_TRUE(msg->findBuffer("buffer", &received));
+        ASSERT_EQ(buffer, received);
+        ASSERT_EQ((size_t)result, received->size());
+        read.set_value(string((const char *)received->data(), received->size()));
+    });
+    AMessage::create(0, mHandler)->post();
+    auto future = read.get_future();
+    ASSERT_EQ(future_status::ready, future.wait_for(chrono::seconds(1)));
+    ASSERT_EQ(string(4, '\0') + "hello io", future.get());
+
+    promise<int32_t> end;
+    ASSERT_EQ(OK, mLooper->submitRead(fd, buffer, 12, [&end](int32_t result) {
+        end.set_value(result);
+    }));
+    ASSERT_EQ(0, end.get_future().get());//已经在文件末尾
+    close(fd);
+}
+
+//pipe上的读在数据到达后才完成，回调在looper线程上
+TEST_P(ALoopIoTest, Pipe) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    auto buffer = ABuffer::create(16);
+    promise<thread::id> callbackThread;
+    promise<int32_t> result;
+    ASSERT_EQ(OK, mLooper->submitRead(fds[0], buffer, -1, [&](int32_t res) {
+        callbackThread.set_value(this_thread::get_id());
+        result.set_value(res);
+    }));
+    auto future = result.get_future();
+    ASSERT_EQ(future_status::timeout, future.wait_for(chrono::milliseconds(20)));
+
+    ASSERT_EQ(3, write(fds[1], "abc", 3));
+    ASSERT_EQ(future_status::ready, future.wait_for(chrono::seconds(1)));
+    ASSERT_EQ(3, future.get());
+    ASSERT_EQ("abc", string((const char *)buffer->data(), buffer->size()));
+
+    promise<thread::id> messageThread;
+    mHandler->setProcessor([&](Msg msg){
+        messageThread.set_value(this_thread::get_id());
+    });
+    AMessage::create(0, mHandler)->post();
+    ASSERT_EQ(messageThread.get_future().get(), callbackThread.get_future().get());
+
+    //looper析构时还未完成的请求被取消
+    ASSERT_EQ(OK, mLooper->submitRead(fds[0], ABuffer::create(16), -1, [](int32_t) {
+        FAIL();
+    }));
+    mLooper->stop();
+    mLooper.reset();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_P(ALoopIoTest, Accept) {
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_GE(server, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "aloop-accept-%d-%d", getpid(), (int)GetParam());
+    socklen_t len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr.sun_path + 1);
+    ASSERT_EQ(0, ::bind(server, (struct sockaddr *)&addr, len));
+    ASSERT_EQ(0, listen(server, 4));
+
+    promise<int32_t> accepted;
+    ASSERT_EQ(OK, mLooper->submitAccept(server, [&accepted](int32_t fd) {
+        accepted.set_value(fd);
+    }));
+    int client = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT_EQ(0, connect(client, (struct sockaddr *)&addr, len));
+
+    auto future = accepted.get_future();
+    ASSERT_EQ(future_status::ready, future.wait_for(chrono::seconds(1)));
+    int fd = future.get();
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(1, write(client, "x", 1));
+    char c = 0;
+    ASSERT_EQ(1, read(fd, &c, 1));
+    ASSERT_EQ('x', c);
+    close(fd);
+    close(client);
+    close(server);
+}
+
+//消息的定时和addFd()也通过同一个后端
+TEST_P(ALoopIoTest, DelayAndFd) {
+    shared_ptr<PipeHandler> pipeHandler(new PipeHandler);
+    pipeHandler->mExpected = 1;
+    mLooper->registerHandler(pipeHandler);
+    ASSERT_EQ(OK, mLooper->addFd(pipeHandler->readFd(), ALooper::EVENT_INPUT, pipeHandler));
+
+    int64_t begin = mLooper->GetNowUs();
+    promise<int64_t> duration;
+    mHandler->setProcessor([&](Msg msg){
+        duration.set_value(mLooper->GetNowUs() - begin);
+    });
+    const int64_t delay = 50*1000L;
+    //更早的定时替换之前的定时
+    ASSERT_EQ(OK, AMessage::create(0, mHandler)->post(delay * 4));
+    ASSERT_EQ(OK, AMessage::create(0, mHandler)->post(delay));
+
+    auto received = pipeHandler->mReceived.get_future();
+    pipeHandler->send('a');
+    ASSERT_EQ(future_status::ready, received.wait_for(chrono::seconds(1)));
+
+    auto durationFuture = duration.get_future();
+    ASSERT_EQ(future_status::ready, durationFuture.wait_for(chrono::milliseconds(200)));
+    ASSERT_TRUE(abs(durationFuture.get() - delay) < 10*1000L);
+    mLooper->stop();
+}
+
+INSTANTIATE_TEST_SUITE_P(Backend, ALoopIoTest, testing::Values(true, false));
+
+//不启动looper，由测试线程上的poll()驱动
+class ALoopPollTest : public ALoopIoTest {
+public:
+    virtual void SetUp() {
+        mLooper = ALooper::create();
+        if (GetParam() && mLooper->enableIoUring() != OK) {
+            GTEST_SKIP() << "io_uring unavailable";
+        }
+        mHandler.reset(new MyHandler);
+        mLooper->registerHandler(mHandler);
+        mWakeFd = mLooper->getWakeFd();
+        ASSERT_GE(mWakeFd, 0);
+        ASSERT_EQ(-1, mLooper->pollOnce());
+    }
+
+    //等待wake fd并调用pollOnce()，直到done()为真或超时
+    bool drive(function<bool()> done, int64_t timeoutUs) {
+        int64_t endUs = ALooper::GetNowUs() + timeoutUs;
+        int64_t next = mLooper->pollOnce();
+        while (!done()) {
+            int64_t remain = endUs - ALooper::GetNowUs();
+            if (remain <= 0)
+                return false;
+            if (next != 0) {
+                struct pollfd pfd = {mWakeFd, POLLIN, 0};
+                int64_t waitUs = next < 0 ? remain : min(next, remain);
+                poll(&pfd, 1, (int)((waitUs + 999) / 1000));
+            }
+            next = mLooper->pollOnce();
+        }
+        return true;
+    }
+protected:
+    int mWakeFd{-1};
+};
+
+TEST_P(ALoopPollTest, Budget) {
+    int count = 0;
+    mHandler->setProcessor([&](Msg msg){
+        ++count;
+    });
+    for (int i = 0; i < 5; i++) {
+        ASSERT_EQ(OK, AMessage::create(0, mHandler)->post());
+    }
+    ASSERT_EQ(0, mLooper->pollOnce(2));
+    ASSERT_EQ(2, count);
+    //时间预算用完后至少也会分发一条
+    ASSERT_EQ(0, mLooper->pollOnce(10, 0));
+    ASSERT_EQ(3, count);
+    ASSERT_EQ(-1, mLooper->pollOnce());
+    ASSERT_EQ(5, count);
+
+    //maxMessages为0时按1处理，不会返回0却不分发
+    ASSERT_EQ(OK, AMessage::create(0, mHandler)->post());
+    ASSERT_EQ(-1, mLooper->pollOnce(0));
+    ASSERT_EQ(6, count);
+
+    ASSERT_EQ(OK, AMessage::create(0, mHandler)->post(1000*1000L));
+    int64_t next = mLooper->pollOnce();
+    ASSERT_GT(next, 900*1000L);
+    ASSERT_LE(next, 1000*1000L);
+    ASSERT_EQ(6, count);
+}
+
+TEST_P(ALoopPollTest, WakeFd) {
+    thread::id id = this_thread::get_id();
+    int64_t begin = ALooper::GetNowUs();
+    int64_t duration = -1;
+    mHandler->setProcessor([&](Msg msg){
+        ASSERT_EQ(id, this_thread::get_id());
+        duration = ALooper::GetNowUs() - begin;
+    });
+    const int64_t delay = 50*1000L;
+    ASSERT_EQ(OK, AMessage::create(0, mHandler)->post(delay));
+    ASSERT_GT(mLooper->pollOnce(), 0);
+    //不依赖poll()的超时，到期时wake fd自身变为可读
+    struct pollfd pfd = {mWakeFd, POLLIN, 0};
+    ASSERT_EQ(1, poll(&pfd, 1, 1000));
+    ASSERT_GE(ALooper::GetNowUs() - begin, delay - 1000L);
+    ASSERT_TRUE(drive([&]{ return duration >= 0; }, 1000*1000L));
+    ASSERT_GE(duration, delay - 1000L);
+    ASSERT_LT(duration, delay + 200*1000L);
+
+    //其他线程post时wake fd变为可读
+    duration = -1;
+    thread poster([&]{
+        std::this_thread::sleep_for(chrono::milliseconds(20));
+        begin = ALooper::GetNowUs();
+        AMessage::create(0, mHandler)->post();
+    });
+    ASSERT_TRUE(drive([&]{ return duration >= 0; }, 1000*1000L));
+    poster.join();
+    ASSERT_LT(duration, 200*1000L);
+}
+
+//由pollOnce()驱动时，其他线程可以等待回复
+TEST_P(ALoopPollTest, AwaitResponse) {
+    bool handled = false;
+    mHandler->setProcessor([&handled](Msg msg){
+        shared_ptr<AReplyToken> token;
+        ASSERT_TRUE(msg->senderAwaitsResponse(&token));
+        auto reply = AMessage::create();
+        reply->setInt32("value", 1);
+        reply->postReply(token);
+        handled = true;
+    });
+    status_t err = -1;
+    int32_t value = 0;
+    thread caller([&]{
+        auto response = AMessage::createNull();
+        err = AMessage::create(0, mHandler)->postAndAwaitResponse(&response);
+        response->findInt32("value", &value);
+    });
+    ASSERT_TRUE(drive([&]{ return handled; }, 1000*1000L));
+    caller.join();
+    ASSERT_EQ(OK, err);
+    ASSERT_EQ(1, value);
+
+    //stop()后等待中的调用返回
+    handled = false;
+    mHandler->setProcessor([&handled](Msg msg){
+        handled = true;
+    });
+    thread waiter([&]{
+        auto response = AMessage::createNull();
+        err = AMessage::create(0, mHandler)->postAndAwaitResponse(&response);
+    });
+    ASSERT_TRUE(drive([&]{ return handled; }, 1000*1000L));
+    std::this_thread::sleep_for(chrono::milliseconds(10));
+    ASSERT_EQ(OK, mLooper->stop());
+    waiter.join();
+    ASSERT_NE(OK, err);
+}
+
+//handler中提交的异步I/O在这一轮结束时提交
+TEST_P(ALoopPollTest, IoFromHandler) {
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    shared_ptr<ABuffer> buffer = ABuffer::create(16);
+    int32_t result = 0;
+    mHandler->setProcessor([&](Msg msg){
+        ASSERT_EQ(OK, mLooper->submitRead(fds[0], buffer, -1, [&](int32_t res){
+            result = res;
+        }));
+    });
+    ASSERT_EQ(OK, AMessage::create(0, mHandler)->post());
+    ASSERT_EQ(1, write(fds[1], "x", 1));
+    ASSERT_TRUE(drive([&]{ return result != 0; }, 1000*1000L));
+    ASSERT_EQ(1, result);
+    ASSERT_EQ('x', buffer->data()[0]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST_P(ALoopPollTest, Fd) {
+    shared_ptr<PipeHandler> pipeHandler(new PipeHandler);
+    pipeHandler->mExpected = 2;
+    mLooper->registerHandler(pipeHandler);
+    ASSERT_EQ(OK, mLooper->addFd(pipeHandler->readFd(), ALooper::EVENT_INPUT, pipeHandler));
+    auto received = pipeHandler->mReceived.get_future();
+    pipeHandler->send('a');
+    pipeHandler->send('b');
+    ASSERT_TRUE(drive([&]{
+        return received.wait_for(chrono::seconds(0)) == future_status::ready;
+    }, 1000*1000L));
+    ASSERT_EQ("ab", received.get());
+    ASSERT_EQ(this_thread::get_id(), pipeHandler->mFdThread);
+
+    shared_ptr<ABuffer> buffer = ABuffer::create(16);
+    int32_t result = 0;
+    pipeHandler->send('c');
+    ASSERT_EQ(OK, mLooper->removeFd(pipeHandler->readFd()));
+    ASSERT_EQ(OK, mLooper->submitRead(pipeHandler->readFd(), buffer, -1, [&](int32_t res){
+        result = res;
+    }));
+    ASSERT_TRUE(drive([&]{ return result != 0; }, 1000*1000L));
+    ASSERT_EQ(1, result);
+    ASSERT_EQ('c', buffer->data()[0]);
+}
+
+TEST(ALoop, pollOnceWhenStarted) {
+    shared_ptr<ALooper> looper = ALooper::create();
+    ASSERT_EQ(OK, looper->start());
+    ASSERT_EQ(-1, looper->pollOnce());
+    looper->stop();
+}
+
+INSTANTIATE_TEST_SUITE_P(Backend, ALoopPollTest, testing::Values(true, false));
+#endif
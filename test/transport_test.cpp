@@ -0,0 +1,778 @@
+#include <gtest/gtest.h>
+#include "../src/aloop.h"
+#include <future>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace aloop;
+using namespace std;
+
+#ifdef __linux__
+class SumHandler : public AHandler {
+public:
+    explicit SumHandler(int64_t expected) : mExpected(expected) {}
+
+    future<int64_t> done() {
+        return mDone.get_future();
+    }
+protected:
+    virtual void onMessageReceived(const shared_ptr<AMessage> &msg){
+        int32_t index = 0;
+        msg->findInt32("index", &index);
+        mSum += index;
+        if (++mReceived == mExpected)
+            mDone.set_value(mSum);
+    }
+private:
+    int64_t mExpected;
+    int64_t mReceived{0};
+    int64_t mSum{0};
+    promise<int64_t> mDone;
+};
+
+//回复空消息，用于等待looper处理完之前的消息
+class FlushHandler : public AHandler {
+protected:
+    virtual void onMessageReceived(const shared_ptr<AMessage> &msg){
+        shared_ptr<AReplyToken> token;
+        if (msg->senderAwaitsResponse(&token))
+            AMessage::create()->postReply(token);
+    }
+};
+
+class FuncHandler : public AHandler {
+public:
+    explicit FuncHandler(const function<void(const shared_ptr<AMessage> &)> &func) : mFunc(func) {}
+protected:
+    virtual void onMessageReceived(const shared_ptr<AMessage> &msg){
+        mFunc(msg);
+    }
+private:
+    function<void(const shared_ptr<AMessage> &)> mFunc;
+};
+
+TEST(ASharedRing, ReadWrite) {
+    const char *kName = "/aloop-test-ring";
+    auto ring = ASharedRing::create(kName, 256);
+    ASSERT_NE(nullptr, ring);
+    auto reader = ASharedRing::open(kName);
+    ASSERT_NE(nullptr, reader);
+    ASharedRing::unlink(kName);
+
+    string received;
+    auto append = [&received](const void *data, size_t size) {
+        received.assign(static_cast<const char *>(data), size);
+    };
+    ASSERT_EQ(BUSY, reader->read(append, 0));
+
+    //长度不同的记录反复绕回数据区开头
+    for (int i = 0; i < 100; i++) {
+        string record(i % 90, 'a' + i % 26);
+        ASSERT_EQ(OK, ring->write(record.data(), record.size(), 0));
+        ASSERT_EQ(OK, reader->read(append, 0));
+        ASSERT_EQ(record, received);
+    }
+
+    ASSERT_EQ(NO_MEM, ring->write(string(200, 'x').data(), 200));
+    //写满后超时
+    string record(100, 'x');
+    int written = 0;
+    while (ring->write(record.data(), record.size(), 1000) == OK) {
+        written++;
+    }
+    ASSERT_GE(written, 1);
+    ASSERT_LE(written, 2);
+
+    //关闭后仍能读完剩余的数据
+    ring->close();
+    ASSERT_EQ(NOT_FOUND, ring->write("y", 1));
+    for (int i = 0; i < written; i++) {
+        ASSERT_EQ(OK, reader->read(append));
+        ASSERT_EQ(record, received);
+    }
+    ASSERT_EQ(NOT_FOUND, reader->read(append));
+}
+
+TEST(ASharedRing, TwoProcesses) {
+    const char *kName = "/aloop-test-ring-2";
+    const int kCount = 10000;
+
+    auto ring = ASharedRing::create(kName, 4096);
+    ASSERT_NE(nullptr, ring);
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        //子进程：通过代理handler发送，容量较小，会等待接收端
+        auto childRing = ASharedRing::open(kName);
+        auto looper = ALooper::create();
+        shared_ptr<ARingSender> sender(new ARingSender(childRing));
+        shared_ptr<FlushHandler> flush(new FlushHandler);
+        looper->registerHandler(sender);
+        looper->registerHandler(flush);
+        looper->start();
+        for (int i = 0; i < kCount; i++) {
+            auto msg = AMessage::create(1, sender);
+            msg->setInt32("index", i);
+            msg->post();
+        }
+        auto response = AMessage::createNull();
+        AMessage::create(0, flush)->postAndAwaitResponse(&response);
+        _exit(0);
+    }
+
+    auto looper = ALooper::create();
+    shared_ptr<SumHandler> handler(new SumHandler(kCount));
+    looper->registerHandler(handler);
+    looper->start();
+    auto done = handler->done();
+
+    ARingReceiver receiver(ring, handler);
+    ASSERT_EQ(OK, receiver.start());
+
+    ASSERT_EQ(future_status::ready, done.wait_for(chrono::seconds(10)));
+    ASSERT_EQ((int64_t)kCount * (kCount - 1) / 2, done.get());
+
+    int status = 0;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(0, WEXITSTATUS(status));
+
+    receiver.stop();
+    looper->stop();
+    ASharedRing::unlink(kName);
+}
+
+TEST(ASharedRing, Ports) {
+    const char *kName = "/aloop-test-ring-ports";
+    auto ring = ASharedRing::create(kName, 4096);
+    ASSERT_NE(nullptr, ring);
+    auto receiverRing = ASharedRing::open(kName);
+    ASSERT_NE(nullptr, receiverRing);
+    ASharedRing::unlink(kName);
+
+    auto looper = ALooper::create();
+    promise<int32_t> first, second;
+    shared_ptr<AHandler> handler1(new FuncHandler([&first](const shared_ptr<AMessage> &msg) {
+        first.set_value(msg->what());
+    }));
+    shared_ptr<AHandler> handler2(new FuncHandler([&second](const shared_ptr<AMessage> &msg) {
+        second.set_value(msg->what());
+    }));
+    shared_ptr<ARingSender> sender1(new ARingSender(ring, 1));
+    shared_ptr<ARingSender> sender2(new ARingSender(ring, 2));
+    looper->registerHandler(handler1);
+    looper->registerHandler(handler2);
+    looper->registerHandler(sender1);
+    looper->registerHandler(sender2);
+    ASSERT_EQ(OK, looper->start());
+
+    ARingReceiver receiver(receiverRing);
+    receiver.exportHandler(1, handler1);
+    receiver.exportHandler(2, handler2);
+    ASSERT_EQ(OK, receiver.start());
+
+    //每条消息发给sender对应port上导出的handler，等待回复的发送者得到写入的结果
+    auto response = AMessage::createNull();
+    ASSERT_EQ(OK, AMessage::create(20, sender2)->postAndAwaitResponse(&response));
+    int32_t err = -1;
+    ASSERT_TRUE(response->findInt32("err", &err));
+    ASSERT_EQ(OK, err);
+    AMessage::create(10, sender1)->post();
+    ASSERT_EQ(10, first.get_future().get());
+    ASSERT_EQ(20, second.get_future().get());
+
+    receiver.stop();
+    looper->stop();
+}
+
+TEST(ASharedRing, SendTimeout) {
+    const char *kName = "/aloop-test-ring-timeout";
+    auto ring = ASharedRing::create(kName, 256);
+    ASSERT_NE(nullptr, ring);
+    ASharedRing::unlink(kName);
+
+    //没有接收端读取，ring写满后超时丢弃，looper不会一直阻塞
+    auto looper = ALooper::create();
+    shared_ptr<ARingSender> sender(new ARingSender(ring, 0, 10 * 1000));
+    looper->registerHandler(sender);
+    ASSERT_EQ(OK, looper->start());
+
+    int32_t err = OK;
+    for (int i = 0; i < 10 && err == OK; i++) {
+        auto msg = AMessage::create(1, sender);
+        msg->setString("data", string(64, 'x'));
+        auto response = AMessage::createNull();
+        ASSERT_EQ(OK, msg->postAndAwaitResponse(&response));
+        ASSERT_TRUE(response->findInt32("err", &err));
+    }
+    ASSERT_EQ(BUSY, err);
+
+    //不能序列化的消息也会回复
+    auto msg = AMessage::create(1, sender);
+    msg->setPointer("ptr", &err);
+    auto response = AMessage::createNull();
+    ASSERT_EQ(OK, msg->postAndAwaitResponse(&response));
+    ASSERT_TRUE(response->findInt32("err", &err));
+    ASSERT_EQ(INVALID_OPERATION, err);
+    looper->stop();
+}
+
+TEST(ASharedRing, CorruptedControl) {
+    const char *kName = "/aloop-test-ring-corrupt";
+    const size_t kControlSize = 256;
+    auto ring = ASharedRing::create(kName, 256);
+    ASSERT_NE(nullptr, ring);
+    auto reader = ASharedRing::open(kName);
+    ASSERT_NE(nullptr, reader);
+
+    int fd = shm_open(kName, O_RDWR, 0);
+    ASSERT_GE(fd, 0);
+    ASharedRing::unlink(kName);
+    uint8_t *map = static_cast<uint8_t *>(mmap(NULL, kControlSize + 256,
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    close(fd);
+    ASSERT_NE(MAP_FAILED, (void *)map);
+
+    auto ignore = [](const void *, size_t) {};
+    string record(56, 'x');
+    for (int i = 0; i < 3; i++) {
+        ASSERT_EQ(OK, ring->write(record.data(), record.size(), 0));
+        ASSERT_EQ(OK, reader->read(ignore, 0));
+    }
+
+    //对端修改的容量不影响已经映射的ring
+    uint32_t capacity = 1u << 30;
+    memcpy(map + 4, &capacity, sizeof(capacity));
+    ASSERT_EQ(OK, ring->write("abc", 3, 0));
+
+    //记录的长度超出数据区剩余的空间
+    uint32_t len = 100;
+    memcpy(map + kControlSize + 192, &len, sizeof(len));
+    ASSERT_EQ(NOT_FOUND, reader->read(ignore, 0));
+    munmap(map, kControlSize + 256);
+}
+
+class ASocketBridgeTest : public testing::Test {
+protected:
+    virtual void SetUp() {
+        int fds[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        mLooperA = ALooper::create();
+        mLooperB = ALooper::create();
+        ASSERT_EQ(OK, mLooperA->start());
+        ASSERT_EQ(OK, mLooperB->start());
+        mBridgeA = ASocketBridge::create(fds[0], mLooperA);
+        mBridgeB = ASocketBridge::create(fds[1], mLooperB);
+    }
+    virtual void TearDown() {
+        mBridgeA.reset();
+        mBridgeB.reset();
+        mLooperA->stop();
+        mLooperB->stop();
+    }
+
+    //等待looper A上的flush执行完，之后写出的统计才完整
+    void flushLooperA() {
+        shared_ptr<FlushHandler> flush(new FlushHandler);
+        mLooperA->registerHandler(flush);
+        auto response = AMessage::createNull();
+        AMessage::create(0, flush)->postAndAwaitResponse(&response);
+    }
+
+    shared_ptr<ALooper> mLooperA;
+    shared_ptr<ALooper> mLooperB;
+    shared_ptr<ASocketBridge> mBridgeA;
+    shared_ptr<ASocketBridge> mBridgeB;
+};
+
+TEST_F(ASocketBridgeTest, Post) {
+    const int kCount = 10000;
+    shared_ptr<SumHandler> sum(new SumHandler(kCount));
+    mLooperB->registerHandler(sum);
+    auto done = sum->done();
+    mBridgeB->exportHandler(1, sum);
+    ASSERT_EQ(OK, mBridgeA->start());
+    ASSERT_EQ(OK, mBridgeB->start());
+
+    auto remote = mBridgeA->getRemoteHandler(1);
+    ASSERT_NE(nullptr, remote);
+    ASSERT_EQ(remote, mBridgeA->getRemoteHandler(1));
+    for (int i = 0; i < kCount; i++) {
+        auto msg = AMessage::create(1, remote);
+        msg->setInt32("index", i);
+        msg->post();
+    }
+    ASSERT_EQ(future_status::ready, done.wait_for(chrono::seconds(10)));
+    ASSERT_EQ((int64_t)kCount * (kCount - 1) / 2, done.get());
+
+    flushLooperA();
+    uint64_t messages = 0, writes = 0;
+    mBridgeA->getWriteStats(&messages, &writes);
+    ASSERT_EQ((uint64_t)kCount, messages);
+    ASSERT_LE(writes, messages);
+}
+
+//同一轮里发出的消息合并为一次写
+TEST_F(ASocketBridgeTest, BatchedWrite) {
+    const int kCount = 100;
+    shared_ptr<SumHandler> sum(new SumHandler(kCount));
+    mLooperB->registerHandler(sum);
+    auto done = sum->done();
+    mBridgeB->exportHandler(1, sum);
+    ASSERT_EQ(OK, mBridgeB->start());
+
+    auto remote = mBridgeA->getRemoteHandler(1);
+    shared_ptr<FuncHandler> burst(new FuncHandler([&remote](const shared_ptr<AMessage> &) {
+        for (int i = 0; i < kCount; i++) {
+            auto msg = AMessage::create(1, remote);
+            msg->setInt32("index", i);
+            msg->post();
+        }
+    }));
+    mLooperA->registerHandler(burst);
+    AMessage::create(0, burst)->post();
+
+    ASSERT_EQ(future_status::ready, done.wait_for(chrono::seconds(10)));
+    flushLooperA();
+    uint64_t messages = 0, writes = 0;
+    mBridgeA->getWriteStats(&messages, &writes);
+    ASSERT_EQ((uint64_t)kCount, messages);
+    ASSERT_EQ(1u, writes);
+}
+
+TEST_F(ASocketBridgeTest, PostAndAwaitResponse) {
+    shared_ptr<FuncHandler> echo(new FuncHandler([](const shared_ptr<AMessage> &msg) {
+        shared_ptr<AReplyToken> token;
+        ASSERT_TRUE(msg->senderAwaitsResponse(&token));
+        int32_t value = 0;
+        msg->findInt32("value", &value);
+        auto reply = AMessage::create();
+        reply->setInt32("value", value + 1);
+        reply->setString("from", "B");
+        ASSERT_EQ(OK, reply->postReply(token));
+        ASSERT_EQ(BUSY, reply->postReply(token));
+    }));
+    mLooperB->registerHandler(echo);
+    mBridgeB->exportHandler(2, echo);
+    ASSERT_EQ(OK, mBridgeA->start());
+    ASSERT_EQ(OK, mBridgeB->start());
+
+    auto remote = mBridgeA->getRemoteHandler(2);
+    for (int i = 0; i < 100; i++) {
+        auto msg = AMessage::create(2, remote);
+        msg->setInt32("value", i);
+        auto response = AMessage::createNull();
+        ASSERT_EQ(OK, msg->postAndAwaitResponse(&response));
+        int32_t value = 0;
+        ASSERT_TRUE(response->findInt32("value", &value));
+        ASSERT_EQ(i + 1, value);
+        string from;
+        ASSERT_TRUE(response->findString("from", &from));
+        ASSERT_EQ("B", from);
+    }
+
+    //没有导出的port
+    auto response = AMessage::createNull();
+    ASSERT_EQ(OK, AMessage::create(0, mBridgeA->getRemoteHandler(3))->postAndAwaitResponse(&response));
+    int32_t err = OK;
+    ASSERT_TRUE(response->findInt32("err", &err));
+    ASSERT_EQ(NOT_FOUND, err);
+}
+
+//连接断开时，等待回复的一端收到错误
+TEST_F(ASocketBridgeTest, LinkClosed) {
+    promise<void> received;
+    shared_ptr<FuncHandler> silent(new FuncHandler([&received](const shared_ptr<AMessage> &) {
+        received.set_value();
+    }));
+    mLooperB->registerHandler(silent);
+    mBridgeB->exportHandler(1, silent);
+    ASSERT_EQ(OK, mBridgeA->start());
+    ASSERT_EQ(OK, mBridgeB->start());
+
+    auto remote = mBridgeA->getRemoteHandler(1);
+    auto result = async(launch::async, [&remote]() {
+        auto response = AMessage::createNull();
+        AMessage::create(0, remote)->postAndAwaitResponse(&response);
+        int32_t err = OK;
+        response->findInt32("err", &err);
+        return err;
+    });
+    received.get_future().wait();
+    mBridgeB.reset();
+    ASSERT_EQ(future_status::ready, result.wait_for(chrono::seconds(10)));
+    ASSERT_EQ(NOT_FOUND, result.get());
+
+    auto response = AMessage::createNull();
+    ASSERT_EQ(OK, AMessage::create(0, remote)->postAndAwaitResponse(&response));
+    ASSERT_TRUE(response->contains("err"));
+}
+//对端没有读取时socket写满，looper不阻塞，对端开始读取后继续写出。超大的帧之后缓冲恢复原来的大小
+TEST_F(ASocketBridgeTest, SlowReader) {
+    const int kCount = 2000;
+    promise<void> large;
+    shared_ptr<SumHandler> sum(new SumHandler(kCount));
+    shared_ptr<FuncHandler> big(new FuncHandler([&large](const shared_ptr<AMessage> &msg) {
+        string data;
+        msg->findString("data", &data);
+        if (data.size() == 4 * 1024 * 1024)
+            large.set_value();
+    }));
+    mLooperB->registerHandler(sum);
+    mLooperB->registerHandler(big);
+    auto done = sum->done();
+    mBridgeB->exportHandler(1, sum);
+    mBridgeB->exportHandler(2, big);
+
+    auto msg = AMessage::create(2, mBridgeA->getRemoteHandler(2));
+    msg->setString("data", string(4 * 1024 * 1024, 'x'));
+    msg->post();
+    auto remote = mBridgeA->getRemoteHandler(1);
+    for (int i = 0; i < kCount; i++) {
+        auto msg = AMessage::create(1, remote);
+        msg->setInt32("index", i);
+        msg->setString("padding", string(1000, 'p'));
+        msg->post();
+    }
+    flushLooperA();
+
+    ASSERT_EQ(OK, mBridgeB->start());
+    ASSERT_EQ(future_status::ready, large.get_future().wait_for(chrono::seconds(10)));
+    ASSERT_EQ(future_status::ready, done.wait_for(chrono::seconds(10)));
+    ASSERT_EQ((int64_t)kCount * (kCount - 1) / 2, done.get());
+}
+
+TEST(AJournal, RecordAndReplay) {
+    const char *kPath = "/tmp/aloop-test.journal";
+    const int kCount = 1000;
+    //块很小，记录会跨块，还有一条比块大的记录
+    auto recorder = AJournalRecorder::create(kPath, 4096);
+    ASSERT_NE(nullptr, recorder);
+
+    auto looper = ALooper::create();
+    shared_ptr<SumHandler> sum(new SumHandler(kCount + 1));
+    looper->registerHandler(sum);
+    looper->setRecorder(recorder);
+    looper->start();
+    for (int i = 0; i < kCount; i++) {
+        auto msg = AMessage::create(i, sum);
+        msg->setInt32("index", i);
+        msg->setObject("local", make_shared<int>(i)); //不能序列化，不记录
+        msg->post();
+    }
+    auto large = AMessage::create(kCount, sum);
+    large->setString("payload", string(10000, 'x'));
+    large->post();
+    ASSERT_EQ(future_status::ready, sum->done().wait_for(chrono::seconds(10)));
+    looper->setRecorder(nullptr);
+    looper->stop();
+    ASSERT_EQ((uint64_t)kCount + 1, recorder->count());
+    recorder->close();
+
+    auto replayer = AJournalReplayer::open(kPath);
+    ASSERT_NE(nullptr, replayer);
+    ASSERT_EQ((size_t)kCount + 1, replayer->count());
+
+    //没有目标时消息被丢弃
+    ASSERT_EQ(0u, replayer->replay(false));
+
+    auto replayLooper = ALooper::create();
+    vector<int32_t> whats;
+    string payload;
+    promise<void> done;
+    shared_ptr<FuncHandler> target(new FuncHandler([&](const shared_ptr<AMessage> &msg) {
+        whats.push_back(msg->what());
+        ASSERT_FALSE(msg->contains("local"));
+        if (msg->what() == kCount) {
+            msg->findString("payload", &payload);
+            done.set_value();
+        }
+    }));
+    replayLooper->registerHandler(target);
+    replayLooper->start();
+    replayer->setTarget(sum->id(), target);
+    ASSERT_EQ((size_t)kCount + 1, replayer->replay(false));
+    ASSERT_EQ(future_status::ready, done.get_future().wait_for(chrono::seconds(10)));
+    replayLooper->stop();
+
+    ASSERT_EQ((size_t)kCount + 1, whats.size());
+    for (int i = 0; i <= kCount; i++) {
+        ASSERT_EQ(i, whats[i]);
+    }
+    ASSERT_EQ(string(10000, 'x'), payload);
+    unlink(kPath);
+}
+
+//按记录时的间隔重放
+TEST(AJournal, Realtime) {
+    const char *kPath = "/tmp/aloop-test-realtime.journal";
+    auto recorder = AJournalRecorder::create(kPath);
+    ASSERT_NE(nullptr, recorder);
+
+    auto looper = ALooper::create();
+    shared_ptr<SumHandler> sum(new SumHandler(3));
+    looper->registerHandler(sum);
+    looper->setRecorder(recorder);
+    looper->start();
+    for (int i = 0; i < 3; i++) {
+        AMessage::create(i, sum)->post(i * 50000);
+    }
+    ASSERT_EQ(future_status::ready, sum->done().wait_for(chrono::seconds(10)));
+    looper->stop();
+    recorder->close();
+
+    auto replayer = AJournalReplayer::open(kPath);
+    ASSERT_NE(nullptr, replayer);
+    auto replayLooper = ALooper::create();
+    shared_ptr<FlushHandler> target(new FlushHandler);
+    replayLooper->registerHandler(target);
+    replayLooper->start();
+    replayer->setDefaultTarget(target);
+
+    int64_t startUs = ALooper::GetNowUs();
+    ASSERT_EQ(3u, replayer->replay(true));
+    ASSERT_GE(ALooper::GetNowUs() - startUs, 90000);
+
+    startUs = ALooper::GetNowUs();
+    ASSERT_EQ(3u, replayer->replay(false));
+    ASSERT_LT(ALooper::GetNowUs() - startUs, 50000);
+    replayLooper->stop();
+    unlink(kPath);
+}
+static size_t countSegments(const char *dir) {
+    size_t count = 0;
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return 0;
+    while (struct dirent *entry = readdir(d)) {
+        if (entry->d_name[0] != '.')
+            count++;
+    }
+    closedir(d);
+    return count;
+}
+
+class APersistentQueueTest : public testing::Test {
+protected:
+    virtual void SetUp() {
+        ASSERT_EQ(0, system("rm -rf /tmp/aloop-test-queue"));
+    }
+    virtual void TearDown() {
+        system("rm -rf /tmp/aloop-test-queue");
+    }
+
+    const char *kDir = "/tmp/aloop-test-queue";
+};
+
+//looper没有处理完的消息在重启后恢复
+TEST_F(APersistentQueueTest, Restore) {
+    const int kCount = 1000;
+    {
+        auto queue = APersistentQueue::open(kDir, 1, 4096);
+        ASSERT_NE(nullptr, queue);
+        auto looper = ALooper::create();
+        shared_ptr<SumHandler> sum(new SumHandler(kCount));
+        shared_ptr<SumHandler> other(new SumHandler(1));
+        looper->registerHandler(sum);
+        looper->registerHandler(other);
+        ASSERT_EQ(OK, queue->bindHandler(1, sum));
+        ASSERT_EQ(INVALID_OPERATION, queue->bindHandler(1, other));
+        ASSERT_EQ(OK, looper->setPersistentQueue(queue));
+        ASSERT_EQ(INVALID_OPERATION, looper->setPersistentQueue(queue));
+
+        for (int i = 0; i < kCount; i++) {
+            auto msg = AMessage::create(i, sum);
+            msg->setInt32("index", i);
+            msg->setString("name", string(i % 100, 'n'));
+            msg->post(i == kCount - 1 ? 100000 : 0);
+        }
+        //没有绑定的handler不持久化
+        AMessage::create(0, other)->post();
+        ASSERT_EQ((size_t)kCount, queue->getPendingCount());
+        ASSERT_GT(countSegments(kDir), 1u);
+
+        uint64_t appended = 0, syncs = 0;
+        queue->getStats(&appended, &syncs);
+        ASSERT_EQ((uint64_t)kCount, appended);
+        ASSERT_EQ((uint64_t)kCount, syncs);
+    }
+
+    auto queue = APersistentQueue::open(kDir);
+    ASSERT_NE(nullptr, queue);
+    ASSERT_EQ((size_t)kCount, queue->getPendingCount());
+    auto looper = ALooper::create();
+    vector<int32_t> whats;
+    promise<void> done;
+    shared_ptr<FuncHandler> handler(new FuncHandler([&](const shared_ptr<AMessage> &msg) {
+        string name;
+        ASSERT_TRUE(msg->findString("name", &name));
+        ASSERT_EQ(string(msg->what() % 100, 'n'), name);
+        whats.push_back(msg->what());
+        if ((int)whats.size() == kCount)
+            done.set_value();
+    }));
+    looper->registerHandler(handler);
+    ASSERT_EQ(OK, looper->setPersistentQueue(queue));
+    //绑定前的消息在绑定时恢复
+    ASSERT_EQ((size_t)0, looper->getQueueDepth());
+    ASSERT_EQ(OK, queue->bindHandler(1, handler));
+    ASSERT_EQ((size_t)kCount, looper->getQueueDepth());
+
+    int64_t startUs = ALooper::GetNowUs();
+    looper->start();
+    ASSERT_EQ(future_status::ready, done.get_future().wait_for(chrono::seconds(10)));
+    //延迟的消息保留剩余的延迟
+    ASSERT_GE(ALooper::GetNowUs() - startUs, 50000);
+    looper->stop();
+    for (int i = 0; i < kCount; i++) {
+        ASSERT_EQ(i, whats[i]);
+    }
+    ASSERT_EQ((size_t)0, queue->getPendingCount());
+    ASSERT_EQ((size_t)0, countSegments(kDir));
+}
+
+//解除绑定或handler析构后，port可以绑定新的handler
+TEST_F(APersistentQueueTest, Rebind) {
+    auto queue = APersistentQueue::open(kDir, 0);
+    ASSERT_NE(nullptr, queue);
+    auto looper = ALooper::create();
+    shared_ptr<SumHandler> first(new SumHandler(1));
+    shared_ptr<SumHandler> second(new SumHandler(1));
+    looper->registerHandler(first);
+    looper->registerHandler(second);
+    ASSERT_EQ(OK, looper->setPersistentQueue(queue));
+
+    ASSERT_EQ(OK, queue->bindHandler(1, first));
+    ASSERT_EQ(OK, queue->unbindHandler(1));
+    ASSERT_EQ(NOT_FOUND, queue->unbindHandler(1));
+    AMessage::create(0, first)->post();
+    ASSERT_EQ((size_t)0, queue->getPendingCount());
+    ASSERT_EQ(OK, queue->bindHandler(1, first));
+    ASSERT_EQ(INVALID_OPERATION, queue->bindHandler(1, second));
+
+    first.reset();
+    ASSERT_EQ(OK, queue->bindHandler(1, second));
+    AMessage::create(0, second)->post();
+    ASSERT_EQ((size_t)1, queue->getPendingCount());
+}
+
+//已处理的消息不再恢复，滞留在队列中的消息下次恢复
+TEST_F(APersistentQueueTest, Checkpoint) {
+    const int kCount = 100;
+    {
+        auto queue = APersistentQueue::open(kDir, 0);
+        auto looper = ALooper::create();
+        shared_ptr<SumHandler> sum(new SumHandler(kCount));
+        looper->registerHandler(sum);
+        queue->bindHandler(1, sum);
+        looper->setPersistentQueue(queue);
+        looper->start();
+        auto done = sum->done();
+        for (int i = 0; i < kCount; i++) {
+            auto msg = AMessage::create(0, sum);
+            msg->setInt32("index", i);
+            msg->post();
+        }
+        ASSERT_EQ(future_status::ready, done.wait_for(chrono::seconds(10)));
+        looper->stop();
+
+        for (int i = 0; i < kCount; i++) {
+            auto msg = AMessage::create(0, sum);
+            msg->setInt32("index", kCount + i);
+            msg->post();
+        }
+        ASSERT_EQ((size_t)kCount, queue->getPendingCount());
+        uint64_t appended = 0, syncs = 0;
+        queue->getStats(&appended, &syncs);
+        ASSERT_EQ(0u, syncs);
+    }
+
+    auto queue = APersistentQueue::open(kDir);
+    ASSERT_EQ((size_t)kCount, queue->getPendingCount());
+    auto looper = ALooper::create();
+    shared_ptr<SumHandler> sum(new SumHandler(kCount));
+    looper->registerHandler(sum);
+    queue->bindHandler(1, sum);
+    looper->setPersistentQueue(queue);
+    auto done = sum->done();
+    looper->start();
+    ASSERT_EQ(future_status::ready, done.wait_for(chrono::seconds(10)));
+    ASSERT_EQ((int64_t)kCount * (3 * kCount - 1) / 2, done.get());
+    looper->stop();
+    ASSERT_EQ((size_t)0, queue->getPendingCount());
+}
+
+//迁移到其他looper的消息由目标looper处理后才标记完成，找不到handler的消息保持未完成
+TEST_F(APersistentQueueTest, Migrate) {
+    const int kCount = 10;
+    auto queue = APersistentQueue::open(kDir, 0);
+    auto looper = ALooper::create();
+    auto target = ALooper::create();
+    shared_ptr<SumHandler> sum(new SumHandler(kCount));
+    shared_ptr<SumHandler> gone(new SumHandler(1));
+    looper->registerHandler(sum);
+    auto goneID = looper->registerHandler(gone);
+    queue->bindHandler(1, sum);
+    queue->bindHandler(2, gone);
+    looper->setPersistentQueue(queue);
+
+    for (int i = 0; i < kCount; i++) {
+        auto msg = AMessage::create(0, sum);
+        msg->setInt32("index", i);
+        msg->post();
+    }
+    AMessage::create(0, gone)->post();
+    ASSERT_EQ((size_t)kCount + 1, queue->getPendingCount());
+
+    ASSERT_EQ(OK, looper->migrateHandler(sum->id(), target));
+    ASSERT_EQ((size_t)kCount + 1, queue->getPendingCount());
+    looper->unregisterHandler(goneID);
+
+    auto done = sum->done();
+    target->start();
+    looper->start();
+    ASSERT_EQ(future_status::ready, done.wait_for(chrono::seconds(10)));
+    ASSERT_EQ((int64_t)kCount * (kCount - 1) / 2, done.get());
+    target->stop();
+    looper->stop();
+    ASSERT_EQ((size_t)1, queue->getPendingCount());
+}
+
+//并发post时多条消息共享一次msync
+TEST_F(APersistentQueueTest, GroupCommit) {
+    const int kThreads = 4;
+    const int kPerThread = 256;
+    auto queue = APersistentQueue::open(kDir, 16);
+    auto looper = ALooper::create();
+    shared_ptr<SumHandler> sum(new SumHandler(kThreads * kPerThread));
+    looper->registerHandler(sum);
+    queue->bindHandler(1, sum);
+    looper->setPersistentQueue(queue);
+
+    vector<thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.push_back(thread([&sum]() {
+            for (int i = 0; i < kPerThread; i++) {
+                AMessage::create(0, sum)->post();
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    uint64_t appended = 0, syncs = 0;
+    queue->getStats(&appended, &syncs);
+    ASSERT_EQ((uint64_t)kThreads * kPerThread, appended);
+    ASSERT_LE(syncs, appended / 16);
+    ASSERT_GE(syncs, 1u);
+}
+#endif